@@ -3,6 +3,36 @@
 // This library implements a dynamic generic data container that can hold
 // bools, numbers, strings, arrays and objects. Basically, anything you can
 // represent with a JSON file.
+//
+// ## Saving and loading
+//
+// All the data is stored in a single buffer that uses offsets rather than
+// pointers, so it can be saved as is. `nfcd_save_to_buffer()` writes it as
+// a *file image*, prefixed with a header that identifies the format and
+// holds a checksum. The allocator is not part of the image.
+//
+// `nfcd_open_readonly()` validates an image, for example a read-only memory
+// mapped file, and returns the config data inside it without copying. Only
+// the query functions, which take a `const` config data, can be used on
+// it. To modify loaded data, copy it to a new buffer with `nfcd_load()`.
+//
+// File images are not portable between platforms with different
+// endianness or pointer size, `nfcd_open_readonly()` rejects them. You
+// probably want to call `nfcd_pack()` before saving.
+//
+// ## Building large documents
+//
+// When a single buffer config data grows, the whole buffer is reallocated,
+// which for big documents means copying hundreds of megabytes over and
+// over. A config data made with `nfcd_make_arena()` instead stores its
+// data in a list of fixed size chunks. New data goes into fresh chunks, so
+// nothing is ever moved or copied while the document is built. All the
+// functions work the same on it, except for saving.
+//
+// When the document is done, `nfcd_flatten()` copies the chunks into a
+// classic single buffer. The chunks are laid out so that the data keeps
+// its offsets, so the locs you hold stay valid and the flatten is just a
+// `memcpy()` of each chunk.
 
 // ## Interface
 
@@ -19,22 +49,37 @@ enum {
 typedef int nfcd_loc;
 typedef void * (*nfcd_realloc) (void *ud, void *ptr, int osize, int nsize, const char *file, int line);
 
+// Returned by `nfcd_add_string()` when the string table is full. String
+// locs hold the string's symbol, which limits the string table to
+// `NFCD_MAX_STRING_TABLE_BYTES`.
+#define NFCD_STRING_TABLE_FULL (-1)
+#define NFCD_MAX_STRING_TABLE_BYTES (1 << (31 - NFCD_TYPE_BITS))
+
+// An entry of the remap table returned by `nfcd_pack()`.
+struct nfcd_LocRemap
+{
+	nfcd_loc old_loc;
+	nfcd_loc new_loc;
+};
+
 struct nfcd_ConfigData *nfcd_make(nfcd_realloc realloc, void *ud, int config_size, int stringtable_size);
+struct nfcd_ConfigData *nfcd_make_arena(nfcd_realloc realloc, void *ud, int chunk_size, int stringtable_size);
+void nfcd_flatten(struct nfcd_ConfigData **cd);
 void nfcd_free(struct nfcd_ConfigData *cd);
 
-nfcd_loc nfcd_root(struct nfcd_ConfigData *cd);
-int nfcd_type(struct nfcd_ConfigData *cd, nfcd_loc loc);
-double nfcd_to_number(struct nfcd_ConfigData *cd, nfcd_loc loc);
-const char *nfcd_to_string(struct nfcd_ConfigData *cd, nfcd_loc loc);
+nfcd_loc nfcd_root(const struct nfcd_ConfigData *cd);
+int nfcd_type(const struct nfcd_ConfigData *cd, nfcd_loc loc);
+double nfcd_to_number(const struct nfcd_ConfigData *cd, nfcd_loc loc);
+const char *nfcd_to_string(const struct nfcd_ConfigData *cd, nfcd_loc loc);
 
-int nfcd_array_size(struct nfcd_ConfigData *cd, nfcd_loc arr);
-nfcd_loc nfcd_array_item(struct nfcd_ConfigData *cd, nfcd_loc arr, int i);
+int nfcd_array_size(const struct nfcd_ConfigData *cd, nfcd_loc arr);
+nfcd_loc nfcd_array_item(const struct nfcd_ConfigData *cd, nfcd_loc arr, int i);
 
-int nfcd_object_size(struct nfcd_ConfigData *cd, nfcd_loc object);
-nfcd_loc nfcd_object_keyloc(struct nfcd_ConfigData *cd, nfcd_loc object, int i);
-const char *nfcd_object_key(struct nfcd_ConfigData *cd, nfcd_loc object, int i);
-nfcd_loc nfcd_object_value(struct nfcd_ConfigData *cd, nfcd_loc object, int i);
-nfcd_loc nfcd_object_lookup(struct nfcd_ConfigData *cd, nfcd_loc object, const char *key);
+int nfcd_object_size(const struct nfcd_ConfigData *cd, nfcd_loc object);
+nfcd_loc nfcd_object_keyloc(const struct nfcd_ConfigData *cd, nfcd_loc object, int i);
+const char *nfcd_object_key(const struct nfcd_ConfigData *cd, nfcd_loc object, int i);
+nfcd_loc nfcd_object_value(const struct nfcd_ConfigData *cd, nfcd_loc object, int i);
+nfcd_loc nfcd_object_lookup(const struct nfcd_ConfigData *cd, nfcd_loc object, const char *key);
 
 nfcd_loc nfcd_null();
 nfcd_loc nfcd_false();
@@ -49,26 +94,45 @@ void nfcd_push(struct nfcd_ConfigData **cd, nfcd_loc array, nfcd_loc item);
 void nfcd_set(struct nfcd_ConfigData **cd, nfcd_loc object, const char *key, nfcd_loc value);
 void nfcd_set_loc(struct nfcd_ConfigData **cd, nfcd_loc object, nfcd_loc key, nfcd_loc value);
 
+int nfcd_pack(struct nfcd_ConfigData **cd, struct nfcd_LocRemap **remap);
+nfcd_loc nfcd_remap_loc(const struct nfcd_LocRemap *remap, int n, nfcd_loc old_loc);
+
+int nfcd_save_bytes(const struct nfcd_ConfigData *cd);
+void nfcd_save_to_buffer(const struct nfcd_ConfigData *cd, void *buffer);
+const struct nfcd_ConfigData *nfcd_open_readonly(const void *data, int bytes, int verify_checksum);
+struct nfcd_ConfigData *nfcd_load(nfcd_realloc realloc, void *ud, const void *data, int bytes);
+
 nfcd_realloc nfcd_allocator(struct nfcd_ConfigData *cd, void **user_data);
 
 // ## Implementation
 
 #include <memory.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <assert.h>
 
 struct nfst_StringTable;
 void nfst_init(struct nfst_StringTable *st, int bytes, int average_string_size);
 void nfst_grow(struct nfst_StringTable *st, int bytes);
+int nfst_pack(struct nfst_StringTable *st);
 int nfst_to_symbol(struct nfst_StringTable *st, const char *s);
 int nfst_to_symbol_const(const struct nfst_StringTable *st, const char *s);
-const char *nfst_to_string(struct nfst_StringTable *, int symbol);
+const char *nfst_to_string(const struct nfst_StringTable *, int symbol);
+int nfst_validate(const void *data, int bytes);
 
 // All the data is stored in a single buffer. A data reference (`nfcd_loc`)
 // encodes the data type and the offset into this buffer in a single int.
+// All data is 8 byte aligned and the offset is stored in units of 8 bytes,
+// so the data can use the whole `int` range (2 GB).
 //
 // Strings are stored in an nfst_StringTable, so for strings the offset
-// represents the offset into the string table.
+// represents the offset into the string table (its symbol). The string
+// table is stored after the config data, at `allocated_bytes`.
+//
+// A config data made with `nfcd_make_arena()` has no data in its buffer,
+// only the string table. Its offsets refer to the chunks of its `arena`
+// instead, see `data()`.
 
 // Container for the config data.
 struct nfcd_ConfigData
@@ -79,12 +143,45 @@ struct nfcd_ConfigData
 	nfcd_loc root;
 	nfcd_realloc realloc;
 	void *realloc_user_data;
+
+	// The chunks of a config data made with `nfcd_make_arena()`, NULL for a
+	// single buffer config data.
+	struct arena *arena;
+};
+
+// A chunk of an `arena`.
+struct chunk
+{
+	char *p;
+
+	// Size of the allocation that starts at this chunk, or 0 if the chunk is
+	// part of an allocation that starts at an earlier chunk.
+	int allocated_bytes;
+};
+
+// Storage for the data of an arena config data. The offsets of the data are
+// virtual: chunk `i` holds the offsets from `i << chunk_shift` up to the
+// next chunk. Data that is bigger than a chunk gets an allocation that spans
+// several consecutive chunks, so every item is contiguous in memory.
+//
+// Data is only added at the end, at `used_bytes` of the config data, so it
+// never moves. When the data doesn't fit in the last allocation, the rest
+// of it is zeroed and left unused.
+//
+// The chunk table is stored in the same allocation as the header, so that
+// finding an offset doesn't need an extra pointer chase.
+struct arena
+{
+	int chunk_shift;
+	int num_chunks;
+	int allocated_chunks;
+	struct chunk chunks[];
 };
 
 // Header for array and object data. The data is stored in a chain of blocks.
 // When the data grows dynamically, we add bigger and bigger blocks to the
-// chain. When we pack the data for disk storage, these chais are coalesced
-// into a single block.
+// chain. When we pack the data for disk storage (`nfcd_pack()`), these chains
+// are coalesced into a single block.
 //
 // For an array, the data stored in a block consists of the array items:
 //
@@ -93,11 +190,17 @@ struct nfcd_ConfigData
 // For an object, the data consists of interleaved keys and values:
 //
 //     [key] [vaulue] [key] [value] ...
+//
+// Objects with many keys also have a hash index, see `object_index`.
 struct block
 {
 	int allocated_size;
 	int size;
 	nfcd_loc next_block;
+
+	// Offset of the `object_index` of an object. Only used in the first block
+	// of an object, 0 if the object doesn't have an index.
+	int index;
 };
 
 // Represents a stored item in an object block.
@@ -107,41 +210,206 @@ struct object_item
 	nfcd_loc value;
 };
 
+// Hash index for the keys of an object. This is an open addressing hash
+// table with linear probing that maps keys to the offsets of their
+// `object_item`. The slots follow directly after this header:
+//
+//     [object_index] [slot] [slot] ...
+//
+// Since the index stores offsets rather than pointers, the data is still
+// relocatable. The index is created when an object gets
+// `NFCD_INDEX_THRESHOLD` keys and is kept at most half full.
+struct object_index
+{
+	int num_slots;
+	int count;
+};
+
+// Number of keys at which an object gets a hash index. Below this, a linear
+// search of the keys is as fast as a hash lookup.
+#ifndef NFCD_INDEX_THRESHOLD
+	#define NFCD_INDEX_THRESHOLD (32)
+#endif
+
+// Header of the file images written by `nfcd_save_to_buffer()`. The config
+// data follows directly after the header. `endian_mark` reads differently
+// on a platform with the other endianness and `header_bytes` (the size of
+// `nfcd_ConfigData`) differs between 32 and 64 bit platforms.
+struct FileHeader
+{
+	uint32_t magic;
+	uint32_t endian_mark;
+	uint32_t version;
+	uint32_t header_bytes;
+
+	// Size of the config data, including the string table.
+	uint32_t data_bytes;
+	uint32_t unused;
+
+	// `checksum()` of the config data.
+	uint64_t checksum;
+};
+
+#define FILE_MAGIC (0x4443464eu)
+#define FILE_ENDIAN_MARK (0x01020304u)
+#define FILE_VERSION (3)
+
+// Alignment of all data in the config data and the unit of `nfcd_loc`
+// offsets.
+#define LOC_UNIT (8)
+
+// The maximum size of the buffer. Offsets must fit in an `nfcd_loc`.
+#define MAX_TOTAL_BYTES (0x7ffffff8)
+
 // Extracts the offset from an `nfcd_loc` item.
-#define LOC_OFFSET(loc)			((loc) >> NFCD_TYPE_BITS)
+#define LOC_OFFSET(loc)			(((loc) >> NFCD_TYPE_BITS) * LOC_UNIT)
+
+// Extracts the string table symbol from a string `nfcd_loc`.
+#define LOC_SYMBOL(loc)			((loc) >> NFCD_TYPE_BITS)
 
 // Extracts the type from an `nfcd_loc` item.
 #define LOC_TYPE(loc)			((loc) & NFCD_TYPE_MASK)
 
 // Makes an `nfcd_loc` item from object and type.
-#define MAKE_LOC(type, offset)	((type) | (offset) << NFCD_TYPE_BITS)
+#define MAKE_LOC(type, offset)	((type) | (offset) / LOC_UNIT << NFCD_TYPE_BITS)
+
+// Makes a string `nfcd_loc` item from a string table symbol.
+#define MAKE_STRING_LOC(symbol)	(NFCD_TYPE_STRING | (symbol) << NFCD_TYPE_BITS)
+
+// Rounds `bytes` up to a multiple of `LOC_UNIT`.
+#define ALIGN(bytes)			(((bytes) + LOC_UNIT - 1) & ~(LOC_UNIT - 1))
+
+// Offset of the first data item, after the `nfcd_ConfigData` header.
+#define DATA_START				((int)ALIGN(sizeof(struct nfcd_ConfigData)))
+
+// Default size of arena chunks.
+#define DEFAULT_CHUNK_SIZE		(1024*1024)
 
 #define STRINGTABLE(cd)			((struct nfst_StringTable *)((char *)(cd) + (cd)->allocated_bytes))
+#define CONST_STRINGTABLE(cd)	((const struct nfst_StringTable *)((const char *)(cd) + (cd)->allocated_bytes))
 
+static inline char *data(const struct nfcd_ConfigData *cd, int offset);
 static nfcd_loc write(struct nfcd_ConfigData **cdp, int type, void *p, int count, int zeroes);
-static struct object_item *object_item(struct nfcd_ConfigData *cd, nfcd_loc object, int i);
+static int grow(struct nfcd_ConfigData **cdp, int data_bytes, int string_bytes);
+static int arena_alloc(struct nfcd_ConfigData *cd, int bytes);
+static struct object_item *object_item(const struct nfcd_ConfigData *cd, nfcd_loc object, int i);
+static int *index_find(const struct nfcd_ConfigData *cd, int index, nfcd_loc key);
+static int index_slots(int size);
+static void build_index(struct nfcd_ConfigData **cdp, nfcd_loc object, int size);
+static int packed_bytes(struct nfcd_ConfigData *cd, nfcd_loc loc, unsigned char *reachable, int *count);
+static uint64_t checksum(const char *p, int n);
+static nfcd_loc pack_copy(struct nfcd_ConfigData *cd, struct nfcd_ConfigData **packed, nfcd_loc loc,
+	unsigned char *reachable, struct nfcd_LocRemap *remap, int *count);
+
+// Returns a pointer to the data at `offset` in the config data.
+static inline char *data(const struct nfcd_ConfigData *cd, int offset)
+{
+	const struct arena *a = cd->arena;
+	if (!a)
+		return (char *)cd + offset;
+	return a->chunks[offset >> a->chunk_shift].p + (offset & ((1 << a->chunk_shift) - 1));
+}
 
+// Writes `count` bytes from `p` followed by `zeroes` zero bytes (padded to
+// `LOC_UNIT`) to the end of the config data and returns an `nfcd_loc` of
+// the `type` for them.
 static nfcd_loc write(struct nfcd_ConfigData **cdp, int type, void *p, int count, int zeroes)
 {
-	int total = count + zeroes;
+	const int total = ALIGN(count + zeroes);
+	int offset;
+	if ((*cdp)->arena)
+		offset = arena_alloc(*cdp, total);
+	else {
+		if ((*cdp)->used_bytes + total > (*cdp)->allocated_bytes)
+			grow(cdp, (*cdp)->used_bytes + total - (*cdp)->allocated_bytes, 0);
+		offset = (*cdp)->used_bytes;
+		(*cdp)->used_bytes += total;
+	}
+	char * const dest = data(*cdp, offset);
+	memcpy(dest, p, count);
+	memset(dest + count, 0, total - count);
+	return MAKE_LOC(type, offset);
+}
+
+// Reserves `bytes` at the end of the data of an arena config data and
+// returns their offset. If they don't fit in the last allocation, a new
+// allocation of one or more chunks is made.
+static int arena_alloc(struct nfcd_ConfigData *cd, int bytes)
+{
+	struct arena *a = cd->arena;
+	const int chunk_bytes = 1 << a->chunk_shift;
+	const int end = a->num_chunks << a->chunk_shift;
+	if (cd->used_bytes + bytes > end) {
+		const int n = (bytes + chunk_bytes - 1) >> a->chunk_shift;
+		assert((long long)end + (long long)n * chunk_bytes <= MAX_TOTAL_BYTES);
+		if (a->num_chunks + n > a->allocated_chunks) {
+			int allocated_chunks = a->allocated_chunks * 2;
+			if (allocated_chunks < a->num_chunks + n)
+				allocated_chunks = a->num_chunks + n;
+			a = cd->realloc(cd->realloc_user_data, a, sizeof(*a) + a->allocated_chunks * sizeof(struct chunk),
+				sizeof(*a) + allocated_chunks * sizeof(struct chunk), __FILE__, __LINE__);
+			a->allocated_chunks = allocated_chunks;
+			cd->arena = a;
+		}
+		if (cd->used_bytes < end)
+			memset(data(cd, cd->used_bytes), 0, end - cd->used_bytes);
+
+		char *p = cd->realloc(cd->realloc_user_data, NULL, 0, n * chunk_bytes, __FILE__, __LINE__);
+		for (int i=0; i<n; ++i) {
+			a->chunks[a->num_chunks + i].p = p + i * chunk_bytes;
+			a->chunks[a->num_chunks + i].allocated_bytes = 0;
+		}
+		a->chunks[a->num_chunks].allocated_bytes = n * chunk_bytes;
+		a->num_chunks += n;
+		cd->used_bytes = end;
+	}
+	const int offset = cd->used_bytes;
+	cd->used_bytes += bytes;
+	return offset;
+}
+
+// Grows the buffer so that the config data gets at least `data_bytes` (or
+// the string table at least `string_bytes`) more bytes of space.
+//
+// All the new space goes to the part that ran out, which at least doubles
+// in size. The whole buffer also grows by at least a quarter each time, so
+// that the cost of realloc copying the buffer and of moving the string
+// table, which is stored after the config data, when the config data grows
+// is amortized O(1) per byte added.
+//
+// The string table never grows past `NFCD_MAX_STRING_TABLE_BYTES`. If it
+// can't get the `string_bytes`, nothing is changed and false is returned.
+static int grow(struct nfcd_ConfigData **cdp, int data_bytes, int string_bytes)
+{
 	struct nfcd_ConfigData *cd = *cdp;
-	while (cd->used_bytes + total > cd->allocated_bytes) {
-		int string_bytes = cd->total_bytes - cd->allocated_bytes;
-		int new_allocated_bytes = cd->allocated_bytes * 2;
-		int new_total_bytes = new_allocated_bytes + string_bytes;
-		cd = cd->realloc(cd->realloc_user_data, cd, cd->total_bytes, new_total_bytes,
-			__FILE__, __LINE__);
-		memmove(cd + new_allocated_bytes, cd + cd->allocated_bytes, string_bytes);
-		cd->total_bytes = new_total_bytes;
-		cd->allocated_bytes = new_allocated_bytes;
-		*cdp = cd;
+	const int old_string_bytes = cd->total_bytes - cd->allocated_bytes;
+	const long long needed = data_bytes ? data_bytes : string_bytes;
+	long long extra = data_bytes ? cd->allocated_bytes : old_string_bytes;
+	if (extra < cd->total_bytes / 4)
+		extra = cd->total_bytes / 4;
+	if (extra < needed)
+		extra = needed;
+	if (cd->total_bytes + extra > MAX_TOTAL_BYTES)
+		extra = MAX_TOTAL_BYTES - cd->total_bytes;
+	if (!data_bytes && old_string_bytes + extra > NFCD_MAX_STRING_TABLE_BYTES) {
+		// Round down, so that aligning doesn't take us past the limit.
+		extra = (NFCD_MAX_STRING_TABLE_BYTES - old_string_bytes) & ~(LOC_UNIT - 1);
+		if (extra < needed)
+			return 0;
 	}
-	nfcd_loc loc = MAKE_LOC(type, cd->used_bytes);
-	memcpy((char *)cd + cd->used_bytes, p, count);
-	cd->used_bytes += count;
-	memset((char *)cd + cd->used_bytes, 0, zeroes);
-	cd->used_bytes += zeroes;
-	return loc;
+	assert(needed <= extra);
+	const int extra_bytes = (int)ALIGN(extra);
+	cd = cd->realloc(cd->realloc_user_data, cd, cd->total_bytes, cd->total_bytes + extra_bytes,
+		__FILE__, __LINE__);
+	cd->total_bytes += extra_bytes;
+	if (data_bytes) {
+		const int new_allocated_bytes = cd->allocated_bytes + extra_bytes;
+		memmove((char *)cd + new_allocated_bytes, (char *)cd + cd->allocated_bytes, old_string_bytes);
+		cd->allocated_bytes = new_allocated_bytes;
+	} else
+		nfst_grow(STRINGTABLE(cd), old_string_bytes + extra_bytes);
+	*cdp = cd;
+	return 1;
 }
 
 // Creates a new `nfcd_ConfigData` object. The `realloc` function will be used for 
@@ -153,61 +421,137 @@ struct nfcd_ConfigData *nfcd_make(nfcd_realloc realloc, void *ud, int config_siz
 		config_size = 8*1024;
 	if (!stringtable_size)
 		stringtable_size = 8*1024;
+	config_size = ALIGN(config_size);
+	if (config_size < DATA_START)
+		config_size = DATA_START;
+	assert(stringtable_size <= NFCD_MAX_STRING_TABLE_BYTES);
 
 	int total_bytes = config_size + stringtable_size;
 
 	struct nfcd_ConfigData *cd = realloc(ud, NULL, 0, total_bytes, __FILE__, __LINE__);
+	memset(cd, 0, DATA_START);
 
 	cd->total_bytes = total_bytes;
 	cd->allocated_bytes = config_size;
-	cd->used_bytes = sizeof(*cd);
+	cd->used_bytes = DATA_START;
 	cd->root = NFCD_TYPE_NULL;
 	cd->realloc = realloc;
 	cd->realloc_user_data = ud;
+	cd->arena = NULL;
 
 	nfst_init(STRINGTABLE(cd), stringtable_size, 15);
 
 	return cd;
 }
 
-// Frees an nfcd_ConfigData object created by nfcd_make.
+// Creates a new `nfcd_ConfigData` object that stores its data in chunks of
+// `chunk_size` bytes (rounded up to a power of two) rather than in a single
+// buffer, see "Building large documents". You can use 0 for a default
+// chunk size of 1 MB and string table size.
+struct nfcd_ConfigData *nfcd_make_arena(nfcd_realloc realloc, void *ud, int chunk_size, int stringtable_size)
+{
+	if (!chunk_size)
+		chunk_size = DEFAULT_CHUNK_SIZE;
+	int chunk_shift = 6;
+	while ((1 << chunk_shift) < chunk_size)
+		++chunk_shift;
+
+	struct nfcd_ConfigData *cd = nfcd_make(realloc, ud, DATA_START, stringtable_size);
+	struct arena *a = realloc(ud, NULL, 0, sizeof(*a), __FILE__, __LINE__);
+	a->chunk_shift = chunk_shift;
+	a->num_chunks = 0;
+	a->allocated_chunks = 0;
+	cd->arena = a;
+
+	// The first chunk starts with the space of the header in a single buffer
+	// config data, so that the offsets are the same after `nfcd_flatten()`.
+	cd->used_bytes = 0;
+	arena_alloc(cd, DATA_START);
+	memset(data(cd, 0), 0, DATA_START);
+	return cd;
+}
+
+// Converts an arena config data to a single buffer config data, by copying
+// all its chunks into a single, exactly sized, buffer. All `nfcd_loc`s stay
+// the same. Does nothing if the config data already is a single buffer.
+//
+// The data is moved to a new allocation and `*cdp` is updated.
+void nfcd_flatten(struct nfcd_ConfigData **cdp)
+{
+	struct nfcd_ConfigData *cd = *cdp;
+	struct arena *a = cd->arena;
+	if (!a)
+		return;
+
+	const int string_bytes = cd->total_bytes - cd->allocated_bytes;
+	const int total_bytes = cd->used_bytes + string_bytes;
+	struct nfcd_ConfigData *flat = cd->realloc(cd->realloc_user_data, NULL, 0, total_bytes, __FILE__, __LINE__);
+	for (int i=0; i<a->num_chunks; ++i) {
+		if (!a->chunks[i].allocated_bytes)
+			continue;
+		const int start = i << a->chunk_shift;
+		int bytes = a->chunks[i].allocated_bytes;
+		if (bytes > cd->used_bytes - start)
+			bytes = cd->used_bytes - start;
+		memcpy((char *)flat + start, a->chunks[i].p, bytes);
+	}
+	memcpy(flat, cd, sizeof(*cd));
+	flat->total_bytes = total_bytes;
+	flat->allocated_bytes = cd->used_bytes;
+	flat->arena = NULL;
+	memcpy(STRINGTABLE(flat), STRINGTABLE(cd), string_bytes);
+
+	nfcd_free(cd);
+	*cdp = flat;
+}
+
+// Frees an nfcd_ConfigData object created by nfcd_make or nfcd_make_arena.
 void nfcd_free(struct nfcd_ConfigData *cd)
 {
+	struct arena *a = cd->arena;
+	if (a) {
+		for (int i=0; i<a->num_chunks; ++i) {
+			if (a->chunks[i].allocated_bytes)
+				cd->realloc(cd->realloc_user_data, a->chunks[i].p, a->chunks[i].allocated_bytes, 0, __FILE__, __LINE__);
+		}
+		cd->realloc(cd->realloc_user_data, a, sizeof(*a) + a->allocated_chunks * sizeof(struct chunk), 0,
+			__FILE__, __LINE__);
+	}
 	cd->realloc(cd->realloc_user_data, cd, cd->total_bytes, 0, __FILE__, __LINE__);
 }
 
 // Returns the root item of the config data.
-nfcd_loc nfcd_root(struct nfcd_ConfigData *cd)
+nfcd_loc nfcd_root(const struct nfcd_ConfigData *cd)
 {
 	return cd->root;
 }
 
 // Returns the type of the config data item `loc`.
-int nfcd_type(struct nfcd_ConfigData *cd, nfcd_loc loc)
+int nfcd_type(const struct nfcd_ConfigData *cd, nfcd_loc loc)
 {
 	return LOC_TYPE(loc);
 }
 
 // Returns the numeric representation of `loc`.
-double nfcd_to_number(struct nfcd_ConfigData *cd, nfcd_loc loc)
+double nfcd_to_number(const struct nfcd_ConfigData *cd, nfcd_loc loc)
 {
-	return *(double *)((char *)cd + LOC_OFFSET(loc));
+	return *(double *)data(cd, LOC_OFFSET(loc));
 }
 
 // Returns the string representation of `loc`.
-const char *nfcd_to_string(struct nfcd_ConfigData *cd, nfcd_loc loc)
+const char *nfcd_to_string(const struct nfcd_ConfigData *cd, nfcd_loc loc)
 {
-	return nfst_to_string(STRINGTABLE(cd), LOC_OFFSET(loc));
+	return nfst_to_string(CONST_STRINGTABLE(cd), LOC_SYMBOL(loc));
 }
 
 // Returns the number of array items in `loc`.
-int nfcd_array_size(struct nfcd_ConfigData *cd, nfcd_loc array)
+int nfcd_array_size(const struct nfcd_ConfigData *cd, nfcd_loc array)
 {
-	struct block *arr = (struct block *)((char *)cd + LOC_OFFSET(array));
+	struct block *arr = (struct block *)data(cd, LOC_OFFSET(array));
 	int sz = 0;
 	sz += arr->size;
 	while (arr->next_block) {
-		arr = (struct block *)((char *)cd + LOC_OFFSET(arr->next_block));
+		arr = (struct block *)data(cd, LOC_OFFSET(arr->next_block));
 		sz += arr->size;
 	}
 	return sz;
@@ -215,13 +559,13 @@ int nfcd_array_size(struct nfcd_ConfigData *cd, nfcd_loc array)
 
 // Returns the item at index `i` of the array, or `nfcd_null()` if `i` is
 // beyond the end of the array.
-nfcd_loc nfcd_array_item(struct nfcd_ConfigData *cd, nfcd_loc array, int i)
+nfcd_loc nfcd_array_item(const struct nfcd_ConfigData *cd, nfcd_loc array, int i)
 {
 	assert(i >= 0);
-	struct block *arr = (struct block *)((char *)cd + LOC_OFFSET(array));
+	struct block *arr = (struct block *)data(cd, LOC_OFFSET(array));
 	while (arr->next_block && i >= arr->size) {
 		i -= arr->size;
-		arr = (struct block *)((char *)cd + LOC_OFFSET(arr->next_block));
+		arr = (struct block *)data(cd, LOC_OFFSET(arr->next_block));
 	}
 	if (i >= arr->size)
 		return nfcd_null();
@@ -230,13 +574,13 @@ nfcd_loc nfcd_array_item(struct nfcd_ConfigData *cd, nfcd_loc array, int i)
 }
 
 // Returns the number of key-value pairs in `loc`.
-int nfcd_object_size(struct nfcd_ConfigData *cd, nfcd_loc obj)
+int nfcd_object_size(const struct nfcd_ConfigData *cd, nfcd_loc obj)
 {
-	struct block *block = (struct block *)((char *)cd + LOC_OFFSET(obj));
+	struct block *block = (struct block *)data(cd, LOC_OFFSET(obj));
 	int sz = 0;
 	sz += block->size;
 	while (block->next_block) {
-		block = (struct block *)((char *)cd + LOC_OFFSET(block->next_block));
+		block = (struct block *)data(cd, LOC_OFFSET(block->next_block));
 		sz += block->size;
 	}
 	return sz;
@@ -244,13 +588,13 @@ int nfcd_object_size(struct nfcd_ConfigData *cd, nfcd_loc obj)
 
 // Returns the `i`th `object_item` in `loc`. Or `NULL` if `i` is beyond the
 // end of the object.
-static struct object_item *object_item(struct nfcd_ConfigData *cd, nfcd_loc object, int i)
+static struct object_item *object_item(const struct nfcd_ConfigData *cd, nfcd_loc object, int i)
 {
 	assert(i >= 0);
-	struct block *block = (struct block *)((char *)cd + LOC_OFFSET(object));
+	struct block *block = (struct block *)data(cd, LOC_OFFSET(object));
 	while (block->next_block && i >= block->size) {
 		i -= block->size;
-		block = (struct block *)((char *)cd + LOC_OFFSET(block->next_block));
+		block = (struct block *)data(cd, LOC_OFFSET(block->next_block));
 	}
 	if (i >= block->size)
 		return NULL;
@@ -259,7 +603,7 @@ static struct object_item *object_item(struct nfcd_ConfigData *cd, nfcd_loc obje
 }
 
 // Returns the `i`th key as an `nfcd_loc`.
-nfcd_loc nfcd_object_keyloc(struct nfcd_ConfigData *cd, nfcd_loc object, int i)
+nfcd_loc nfcd_object_keyloc(const struct nfcd_ConfigData *cd, nfcd_loc object, int i)
 {
 	struct object_item *item = object_item(cd, object, i);
 	if (!item)
@@ -268,7 +612,7 @@ nfcd_loc nfcd_object_keyloc(struct nfcd_ConfigData *cd, nfcd_loc object, int i)
 }
 
 // Returns the `i`th key as a string.
-const char *nfcd_object_key(struct nfcd_ConfigData *cd, nfcd_loc object, int i)
+const char *nfcd_object_key(const struct nfcd_ConfigData *cd, nfcd_loc object, int i)
 {
 	struct object_item *item = object_item(cd, object, i);
 	if (!item)
@@ -277,7 +621,7 @@ const char *nfcd_object_key(struct nfcd_ConfigData *cd, nfcd_loc object, int i)
 }
 
 // Returns the `i`th value.
-nfcd_loc nfcd_object_value(struct nfcd_ConfigData *cd, nfcd_loc object, int i)
+nfcd_loc nfcd_object_value(const struct nfcd_ConfigData *cd, nfcd_loc object, int i)
 {
 	struct object_item *item = object_item(cd, object, i);
 	if (!item)
@@ -289,17 +633,22 @@ nfcd_loc nfcd_object_value(struct nfcd_ConfigData *cd, nfcd_loc object, int i)
 //
 // If there is no item with the `key`, `nfcd_null()` is returned.
 //
-// Note that the lookup uses linear search O(n) to find the entry with the
-// specified key. Objects are assumed to be "smallish" so that the extra
-// overhead for more complicated lookups (hashtables, etc) is not needed.
-// If you are dealing with an object with tens of thousands of keys, consider
-// holding your own lookup structures to be able to quickly find items in
-// the object, without the O(n) cost of `nfcd_object_lookup()`.
-nfcd_loc nfcd_object_lookup(struct nfcd_ConfigData *cd, nfcd_loc object, const char *key)
+// Small objects are searched linearly. Objects with `NFCD_INDEX_THRESHOLD`
+// or more keys have a hash index, so the lookup is O(1).
+nfcd_loc nfcd_object_lookup(const struct nfcd_ConfigData *cd, nfcd_loc object, const char *key)
 {
-	nfcd_loc key_loc = MAKE_LOC(NFCD_TYPE_STRING, nfst_to_symbol_const(STRINGTABLE(cd), key));
-
-	struct block *block = (struct block *)((char *)cd + LOC_OFFSET(object));
+	const int sym = nfst_to_symbol_const(CONST_STRINGTABLE(cd), key);
+	if (sym < 0)
+		return nfcd_null();
+	nfcd_loc key_loc = MAKE_STRING_LOC(sym);
+
+	struct block *block = (struct block *)data(cd, LOC_OFFSET(object));
+	if (block->index) {
+		const int item = *index_find(cd, block->index, key_loc);
+		if (!item)
+			return nfcd_null();
+		return ((struct object_item *)data(cd, item))->value;
+	}
 	while (1) {
 		struct object_item *items = (struct object_item *)(block + 1);
 		for (int i=0; i<block->size; ++i) {
@@ -308,7 +657,7 @@ nfcd_loc nfcd_object_lookup(struct nfcd_ConfigData *cd, nfcd_loc object, const c
 		}
 		if (block->next_block == 0)
 			break;
-		block = (struct block *)((char *)cd + LOC_OFFSET(block->next_block));
+		block = (struct block *)data(cd, LOC_OFFSET(block->next_block));
 	}
 
 	return nfcd_null();
@@ -342,25 +691,21 @@ nfcd_loc nfcd_add_number(struct nfcd_ConfigData **cdp, double n)
 	return write(cdp, NFCD_TYPE_NUMBER, &n, sizeof(n), 0);
 }
 
-// Adds the string `s` to the config data nad returns its reference.
+// Adds the string `s` to the config data nad returns its reference. If the
+// string table has reached `NFCD_MAX_STRING_TABLE_BYTES` and the string
+// isn't in it already, `NFCD_STRING_TABLE_FULL` is returned instead.
 nfcd_loc nfcd_add_string(struct nfcd_ConfigData **cdp, const char *s)
 {
-	struct nfcd_ConfigData *cd = *cdp;
-	struct nfst_StringTable *st = STRINGTABLE(cd);
-	int sym = nfst_to_symbol(st, s);
+	int sym = nfst_to_symbol(STRINGTABLE(*cdp), s);
 	while (sym < 0) {
-		int string_bytes = cd->total_bytes - cd->allocated_bytes;
-		int new_string_bytes = string_bytes * 2;
-		int new_total_bytes = cd->allocated_bytes + new_string_bytes;
-		cd = cd->realloc(cd->realloc_user_data, cd, cd->total_bytes, new_total_bytes, __FILE__, __LINE__);
-		cd->total_bytes = new_total_bytes;
-		st = STRINGTABLE(cd);
-		nfst_grow(st, new_string_bytes);
-		sym = nfst_to_symbol(st, s);
-		*cdp = cd;
+		if (!grow(cdp, 0, 1))
+			return NFCD_STRING_TABLE_FULL;
+		sym = nfst_to_symbol(STRINGTABLE(*cdp), s);
 	}
 
-	return MAKE_LOC(NFCD_TYPE_STRING, sym);
+	// Symbols are smaller than the string table, so this always fits.
+	assert(sym < NFCD_MAX_STRING_TABLE_BYTES);
+	return MAKE_STRING_LOC(sym);
 }
 
 // Adds a new array, preallocated to the specified size to the config data
@@ -389,48 +734,437 @@ void nfcd_set_root(struct nfcd_ConfigData *cd, nfcd_loc loc)
 // Pushes `item` to the end of the `array`.
 void nfcd_push(struct nfcd_ConfigData **cdp, nfcd_loc array, nfcd_loc item)
 {
-	struct block *arr = (struct block *)((char *)*cdp + LOC_OFFSET(array));
+	struct block *arr = (struct block *)data(*cdp, LOC_OFFSET(array));
 	while (arr->size == arr->allocated_size) {
-		if (arr->next_block == 0)
-			arr->next_block = nfcd_add_array(cdp, arr->allocated_size*2);
-		arr = (struct block *)((char *)*cdp + LOC_OFFSET(arr->next_block));
+		if (arr->next_block == 0) {
+			const nfcd_loc next = nfcd_add_array(cdp, arr->allocated_size ? arr->allocated_size*2 : 4);
+			arr = (struct block *)data(*cdp, LOC_OFFSET(array));
+			arr->next_block = next;
+		}
+		array = arr->next_block;
+		arr = (struct block *)data(*cdp, LOC_OFFSET(array));
 	}
 	nfcd_loc *items = (nfcd_loc *)(arr + 1);
 	items[arr->size] = item;
 	++arr->size;
 }
 
-// Sets the `key` to the `value` in the `object`.
+// Sets the `key` to the `value` in the `object`. If the key can't be added
+// to the string table (see `nfcd_add_string()`), the object is left
+// unchanged.
 void nfcd_set(struct nfcd_ConfigData **cdp, nfcd_loc object, const char *key, nfcd_loc value)
 {
 	nfcd_loc key_loc = nfcd_add_string(cdp, key);
+	if (key_loc == NFCD_STRING_TABLE_FULL)
+		return;
 	nfcd_set_loc(cdp, object, key_loc, value);
 }
 
 // Sets the `key` to the `value` in the `object`. Note that only string
 // keys are allowed.
+//
+// If the object has a hash index, the key is found through the index,
+// otherwise the keys are searched linearly. The object gets an index when
+// it reaches `NFCD_INDEX_THRESHOLD` keys.
 void nfcd_set_loc(struct nfcd_ConfigData **cdp, nfcd_loc object, nfcd_loc key, nfcd_loc value)
 {
-	struct block *block = (struct block *)((char *)*cdp + LOC_OFFSET(object));
+	struct block *block = (struct block *)data(*cdp, LOC_OFFSET(object));
+	const int indexed = block->index != 0;
+	if (indexed) {
+		const int item = *index_find(*cdp, block->index, key);
+		if (item) {
+			((struct object_item *)data(*cdp, item))->value = value;
+			return;
+		}
+	}
+
+	// Find the block to add the key to, searching for the key on the way if
+	// there is no index. Adding a block can move the data, so the block is
+	// found again from its offset after that.
+	int size = 0;
+	int block_offset = LOC_OFFSET(object);
 	while (1) {
+		block = (struct block *)data(*cdp, block_offset);
 		struct object_item *items = (struct object_item *)(block + 1);
-		for (int i=0; i<block->size; ++i) {
+		for (int i=0; !indexed && i<block->size; ++i) {
 			if (items[i].key == key) {
 				items[i].value = value;
 				return;
 			}
 		}
+		size += block->size;
 		if (block->size < block->allocated_size)
 			break;
-		if (block->next_block == 0)
-			block->next_block = nfcd_add_object(cdp, block->allocated_size*2);
-		block = (struct block *)((char *)*cdp + LOC_OFFSET(block->next_block));
+		if (block->next_block == 0) {
+			const nfcd_loc next = nfcd_add_object(cdp, block->allocated_size ? block->allocated_size*2 : 4);
+			block = (struct block *)data(*cdp, block_offset);
+			block->next_block = next;
+		}
+		block_offset = LOC_OFFSET(block->next_block);
 	}
 
 	struct object_item *items = (struct object_item *)(block + 1);
 	items[block->size].key = key;
 	items[block->size].value = value;
+	const int item = block_offset + (int)((char *)(items + block->size) - (char *)block);
 	++block->size;
+	++size;
+
+	// Add the key to the index, or create or grow the index. A new index is
+	// sized for the space allocated in the first block, so an object that was
+	// allocated with the right size only builds its index once.
+	struct block *first = (struct block *)data(*cdp, LOC_OFFSET(object));
+	if (first->index) {
+		struct object_index *index = (struct object_index *)data(*cdp, first->index);
+		if (2 * (index->count + 1) <= index->num_slots) {
+			*index_find(*cdp, first->index, key) = item;
+			++index->count;
+		} else
+			build_index(cdp, object, 2 * size);
+	} else if (size >= NFCD_INDEX_THRESHOLD)
+		build_index(cdp, object, size > first->allocated_size ? size : first->allocated_size);
+}
+
+// Returns the hash of the string `key` in an object index.
+static inline unsigned key_hash(nfcd_loc key)
+{
+	const unsigned h = (unsigned)key * 0x9e3779b1u;
+	return h ^ (h >> 16);
+}
+
+// Returns the slot in the object index at offset `index` that holds the
+// `key`, or the empty slot where it should be added if it is not in the
+// object.
+static int *index_find(const struct nfcd_ConfigData *cd, int index, nfcd_loc key)
+{
+	const struct object_index *header = (struct object_index *)data(cd, index);
+	int * const slots = (int *)(header + 1);
+	const unsigned mask = header->num_slots - 1;
+	for (unsigned i = key_hash(key) & mask; ; i = (i + 1) & mask) {
+		if (!slots[i] || ((struct object_item *)data(cd, slots[i]))->key == key)
+			return slots + i;
+	}
+}
+
+// Returns the number of slots of an object index with room for `size` keys.
+static int index_slots(int size)
+{
+	int num_slots = 2 * NFCD_INDEX_THRESHOLD;
+	while (num_slots < 2 * size)
+		num_slots *= 2;
+	return num_slots;
+}
+
+// Builds a new hash index with room for `size` keys for the `object` and
+// adds all its keys to it. Any old index is abandoned.
+static void build_index(struct nfcd_ConfigData **cdp, nfcd_loc object, int size)
+{
+	struct object_index header = {0};
+	header.num_slots = index_slots(size);
+	const nfcd_loc loc = write(cdp, NFCD_TYPE_NULL, &header, sizeof(header), header.num_slots * sizeof(int));
+
+	struct nfcd_ConfigData *cd = *cdp;
+	const int index = LOC_OFFSET(loc);
+	int block_offset = LOC_OFFSET(object);
+	struct block *block = (struct block *)data(cd, block_offset);
+	block->index = index;
+	while (1) {
+		for (int i=0; i<block->size; ++i) {
+			const int item = block_offset + sizeof(struct block) + i * sizeof(struct object_item);
+			*index_find(cd, index, ((struct object_item *)(block + 1))[i].key) = item;
+		}
+		((struct object_index *)data(cd, index))->count += block->size;
+		if (block->next_block == 0)
+			break;
+		block_offset = LOC_OFFSET(block->next_block);
+		block = (struct block *)data(cd, block_offset);
+	}
+}
+
+// Orders `nfcd_LocRemap` entries by their `old_loc`.
+static int compare_old_loc(const void *a, const void *b)
+{
+	const nfcd_loc x = ((const struct nfcd_LocRemap *)a)->old_loc;
+	const nfcd_loc y = ((const struct nfcd_LocRemap *)b)->old_loc;
+	return x < y ? -1 : x > y;
+}
+
+// Packs the config data so that it uses as little memory as possible. The data
+// reachable from the root is rewritten depth-first with each array and
+// object in a single block, objects with `NFCD_INDEX_THRESHOLD` or more
+// keys get a fresh hash index, and data that is no longer reachable, such
+// as overwritten values, is dropped. The string table is packed with
+// `nfst_pack()`. Strings keep their `nfcd_loc`s, but unreachable strings
+// are not removed from the string table.
+//
+// The data is moved to a new, exactly sized allocation and `*cdp` is
+// updated. An arena config data is packed to a single buffer. Numbers,
+// arrays and objects get new `nfcd_loc`s. If `remap` is not NULL, it is set
+// to a table of the old and new locs of everything that was kept, sorted
+// by `old_loc`, which you can use to update any locs you are holding with
+// `nfcd_remap_loc()`. The table is allocated with the config data's
+// allocator (see `nfcd_allocator()`) and it is up to you to free it. The
+// return value is the number of entries in the table.
+//
+// Arrays and objects that appear in more than one place in the data are
+// kept shared. The data must not have cycles.
+int nfcd_pack(struct nfcd_ConfigData **cdp, struct nfcd_LocRemap **remap)
+{
+	struct nfcd_ConfigData *cd = *cdp;
+	struct nfst_StringTable *st = STRINGTABLE(cd);
+	const int string_bytes = nfst_pack(st);
+
+	// Mark everything that is reachable, and compute the size it packs to.
+	const int reachable_bytes = (cd->used_bytes / LOC_UNIT + 7) / 8;
+	unsigned char *reachable = cd->realloc(cd->realloc_user_data, NULL, 0, reachable_bytes, __FILE__, __LINE__);
+	memset(reachable, 0, reachable_bytes);
+	int count = 0;
+	const int config_bytes = DATA_START + packed_bytes(cd, cd->root, reachable, &count);
+
+	const int total_bytes = config_bytes + string_bytes;
+	struct nfcd_ConfigData *packed = cd->realloc(cd->realloc_user_data, NULL, 0, total_bytes, __FILE__, __LINE__);
+	memset(packed, 0, DATA_START);
+	packed->total_bytes = total_bytes;
+	packed->allocated_bytes = config_bytes;
+	packed->used_bytes = DATA_START;
+	packed->realloc = cd->realloc;
+	packed->realloc_user_data = cd->realloc_user_data;
+	packed->arena = NULL;
+	memcpy(STRINGTABLE(packed), st, string_bytes);
+
+	struct nfcd_LocRemap *table = NULL;
+	if (remap)
+		table = cd->realloc(cd->realloc_user_data, NULL, 0, count * sizeof(*table), __FILE__, __LINE__);
+	int n = 0;
+	packed->root = pack_copy(cd, &packed, cd->root, reachable, table, &n);
+	assert(packed->used_bytes == packed->allocated_bytes && n == count);
+
+	cd->realloc(cd->realloc_user_data, reachable, reachable_bytes, 0, __FILE__, __LINE__);
+	nfcd_free(cd);
+	*cdp = packed;
+
+	if (remap) {
+		// Items are visited in depth-first order, so the table needs sorting.
+		qsort(table, n, sizeof(*table), compare_old_loc);
+		*remap = table;
+	}
+	return n;
+}
+
+// Returns the new loc of the `old_loc` from the `n` entry `remap` table
+// returned by `nfcd_pack()`. Locs that don't refer to the config data
+// buffer (null, bools and strings) are returned unchanged. If the data
+// at `old_loc` was dropped by the pack, `nfcd_null()` is returned.
+nfcd_loc nfcd_remap_loc(const struct nfcd_LocRemap *remap, int n, nfcd_loc old_loc)
+{
+	const int type = LOC_TYPE(old_loc);
+	if (type != NFCD_TYPE_NUMBER && type != NFCD_TYPE_ARRAY && type != NFCD_TYPE_OBJECT)
+		return old_loc;
+
+	int lo = 0, hi = n;
+	while (lo < hi) {
+		const int mid = lo + (hi - lo) / 2;
+		if (remap[mid].old_loc < old_loc)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < n && remap[lo].old_loc == old_loc)
+		return remap[lo].new_loc;
+	return nfcd_null();
+}
+
+// Marks the data at `loc` and everything it refers to in the `reachable`
+// bitmap (one bit per `LOC_UNIT` of the buffer) and returns the number of
+// bytes it takes in a packed buffer. Data that is already marked is shared
+// and isn't counted again. `*count` is incremented for each marked item.
+static int packed_bytes(struct nfcd_ConfigData *cd, nfcd_loc loc, unsigned char *reachable, int *count)
+{
+	const int type = LOC_TYPE(loc);
+	if (type != NFCD_TYPE_NUMBER && type != NFCD_TYPE_ARRAY && type != NFCD_TYPE_OBJECT)
+		return 0;
+	const int bit = LOC_OFFSET(loc) / LOC_UNIT;
+	if (reachable[bit / 8] & (1 << bit % 8))
+		return 0;
+	reachable[bit / 8] |= 1 << bit % 8;
+	++*count;
+
+	if (type == NFCD_TYPE_NUMBER)
+		return ALIGN(sizeof(double));
+
+	int bytes = 0;
+	if (type == NFCD_TYPE_ARRAY) {
+		const int size = nfcd_array_size(cd, loc);
+		bytes += ALIGN(sizeof(struct block) + size * sizeof(nfcd_loc));
+		for (int i=0; i<size; ++i)
+			bytes += packed_bytes(cd, nfcd_array_item(cd, loc, i), reachable, count);
+	} else {
+		const int size = nfcd_object_size(cd, loc);
+		bytes += ALIGN(sizeof(struct block) + size * sizeof(struct object_item));
+		if (size >= NFCD_INDEX_THRESHOLD)
+			bytes += ALIGN(sizeof(struct object_index) + index_slots(size) * sizeof(int));
+		for (int i=0; i<size; ++i)
+			bytes += packed_bytes(cd, nfcd_object_value(cd, loc, i), reachable, count);
+	}
+	return bytes;
+}
+
+// Copies the data at `loc` and everything it refers to from `cd` to the
+// end of `packed` and returns its new loc. The `reachable` bit of copied
+// data is cleared and its first four bytes in `cd` are overwritten with
+// the new loc, so that data that is referred to again is not copied twice.
+// The old and new locs are added to `remap` (if not NULL) at `*count`.
+static nfcd_loc pack_copy(struct nfcd_ConfigData *cd, struct nfcd_ConfigData **packed, nfcd_loc loc,
+	unsigned char *reachable, struct nfcd_LocRemap *remap, int *count)
+{
+	const int type = LOC_TYPE(loc);
+	if (type != NFCD_TYPE_NUMBER && type != NFCD_TYPE_ARRAY && type != NFCD_TYPE_OBJECT)
+		return loc;
+	int * const forward = (int *)data(cd, LOC_OFFSET(loc));
+	const int bit = LOC_OFFSET(loc) / LOC_UNIT;
+	if (!(reachable[bit / 8] & (1 << bit % 8)))
+		return *forward;
+	reachable[bit / 8] &= ~(1 << bit % 8);
+
+	// The packed buffer is sized exactly, so writes never move it.
+	nfcd_loc new_loc;
+	if (type == NFCD_TYPE_NUMBER)
+		new_loc = nfcd_add_number(packed, nfcd_to_number(cd, loc));
+	else if (type == NFCD_TYPE_ARRAY) {
+		const int size = nfcd_array_size(cd, loc);
+		new_loc = nfcd_add_array(packed, size);
+		struct block *block = (struct block *)data(*packed, LOC_OFFSET(new_loc));
+		block->size = size;
+		nfcd_loc *items = (nfcd_loc *)(block + 1);
+		for (int i=0; i<size; ++i)
+			items[i] = nfcd_array_item(cd, loc, i);
+		for (int i=0; i<size; ++i)
+			items[i] = pack_copy(cd, packed, items[i], reachable, remap, count);
+	} else {
+		const int size = nfcd_object_size(cd, loc);
+		new_loc = nfcd_add_object(packed, size);
+		struct block *block = (struct block *)data(*packed, LOC_OFFSET(new_loc));
+		block->size = size;
+		struct object_item *items = (struct object_item *)(block + 1);
+		for (int i=0; i<size; ++i)
+			items[i] = *object_item(cd, loc, i);
+		if (size >= NFCD_INDEX_THRESHOLD)
+			build_index(packed, new_loc, size);
+		for (int i=0; i<size; ++i)
+			items[i].value = pack_copy(cd, packed, items[i].value, reachable, remap, count);
+	}
+
+	if (remap) {
+		remap[*count].old_loc = loc;
+		remap[*count].new_loc = new_loc;
+	}
+	++*count;
+	*forward = new_loc;
+	return new_loc;
+}
+
+// Returns the size of the file image that `nfcd_save_to_buffer()` writes for
+// the config data. An arena config data must be flattened with
+// `nfcd_flatten()` (or packed) before it is saved.
+int nfcd_save_bytes(const struct nfcd_ConfigData *cd)
+{
+	assert(!cd->arena);
+	return sizeof(struct FileHeader) + cd->total_bytes;
+}
+
+// Writes a file image of the config data to `buffer`, which must have room
+// for `nfcd_save_bytes()` bytes. The allocator and the unused space after
+// the data are zeroed in the image.
+void nfcd_save_to_buffer(const struct nfcd_ConfigData *cd, void *buffer)
+{
+	assert(!cd->arena);
+	char * const image = (char *)buffer + sizeof(struct FileHeader);
+	memcpy(image, cd, cd->total_bytes);
+	memset(image + offsetof(struct nfcd_ConfigData, realloc), 0,
+		sizeof(*cd) - offsetof(struct nfcd_ConfigData, realloc));
+	memset(image + cd->used_bytes, 0, cd->allocated_bytes - cd->used_bytes);
+
+	struct FileHeader header = {0};
+	header.magic = FILE_MAGIC;
+	header.endian_mark = FILE_ENDIAN_MARK;
+	header.version = FILE_VERSION;
+	header.header_bytes = sizeof(*cd);
+	header.data_bytes = cd->total_bytes;
+	header.checksum = checksum(image, cd->total_bytes);
+	memcpy(buffer, &header, sizeof(header));
+}
+
+// Validates the `bytes` large file image at `data` and returns the config
+// data stored in it, or NULL if it isn't a valid image for this platform.
+// The image must stay in memory while the data is used. `data` must be
+// aligned to 8 bytes, which memory mapped files and allocations always are.
+//
+// If `verify_checksum` is true, the whole image is read to check that it
+// isn't corrupted. Otherwise only the headers of the data and of its string
+// table are checked, so that pages of a memory mapped file are only loaded
+// as they are used.
+const struct nfcd_ConfigData *nfcd_open_readonly(const void *data, int bytes, int verify_checksum)
+{
+	struct FileHeader header;
+	if (bytes < (int)sizeof(header) + (int)sizeof(struct nfcd_ConfigData))
+		return NULL;
+	memcpy(&header, data, sizeof(header));
+	if (header.magic != FILE_MAGIC || header.endian_mark != FILE_ENDIAN_MARK || header.version != FILE_VERSION)
+		return NULL;
+	if (header.header_bytes != sizeof(struct nfcd_ConfigData))
+		return NULL;
+	if (header.data_bytes > (uint32_t)bytes - sizeof(header))
+		return NULL;
+
+	const struct nfcd_ConfigData * const cd = (const struct nfcd_ConfigData *)((const char *)data + sizeof(header));
+	if (cd->total_bytes != (int)header.data_bytes || cd->allocated_bytes > cd->total_bytes ||
+		cd->used_bytes > cd->allocated_bytes || cd->used_bytes < DATA_START || cd->arena)
+		return NULL;
+	if (LOC_TYPE(cd->root) >= NFCD_TYPE_NUMBER && LOC_TYPE(cd->root) != NFCD_TYPE_STRING &&
+		LOC_OFFSET(cd->root) >= cd->used_bytes)
+		return NULL;
+	if (cd->allocated_bytes % 8 != 0 ||
+		!nfst_validate(CONST_STRINGTABLE(cd), cd->total_bytes - cd->allocated_bytes))
+		return NULL;
+	if (verify_checksum && checksum((const char *)cd, header.data_bytes) != header.checksum)
+		return NULL;
+	return cd;
+}
+
+// Creates a new `nfcd_ConfigData` object with a copy of the config data in
+// the `bytes` large file image at `data`. The `realloc` function is used
+// for allocating the data, as with `nfcd_make()`. Returns NULL if the
+// image isn't valid, the checksum is always verified.
+struct nfcd_ConfigData *nfcd_load(nfcd_realloc realloc, void *ud, const void *data, int bytes)
+{
+	const struct nfcd_ConfigData * const image = nfcd_open_readonly(data, bytes, 1);
+	if (!image)
+		return NULL;
+
+	struct nfcd_ConfigData *cd = realloc(ud, NULL, 0, image->total_bytes, __FILE__, __LINE__);
+	memcpy(cd, image, image->total_bytes);
+	cd->realloc = realloc;
+	cd->realloc_user_data = ud;
+	cd->arena = NULL;
+	return cd;
+}
+
+// Computes the checksum of the `n` bytes at `p` stored in file images. This
+// reads eight bytes at a time, so it runs close to memory speed.
+static uint64_t checksum(const char *p, int n)
+{
+	const uint64_t k = 0x9e3779b97f4a7c15ull;
+	uint64_t h = (uint64_t)n * k;
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		uint64_t w;
+		memcpy(&w, p + i, sizeof(w));
+		h = (h ^ w) * k;
+		h ^= h >> 32;
+	}
+	for (; i < n; ++i)
+		h = (h ^ (unsigned char)p[i]) * k;
+	return h ^ (h >> 29);
 }
 
 // Returns the allocateor and the user data of the config data.
@@ -443,6 +1177,7 @@ nfcd_realloc nfcd_allocator(struct nfcd_ConfigData *cd, void **user_data)
 #ifdef NFCD_UNIT_TEST
 
 	#include <stdlib.h>
+	#include <stdio.h>
 	#include <assert.h>
 
 	struct memory_record
@@ -450,7 +1185,7 @@ nfcd_realloc nfcd_allocator(struct nfcd_ConfigData *cd, void **user_data)
 		void *ptr;
 		int size;
 	};
-	#define MAX_MEMORY_RECORDS 128
+	#define MAX_MEMORY_RECORDS 1024
 	static struct memory_record memlog[MAX_MEMORY_RECORDS];
 	static int memlog_size = 0;
 	
@@ -465,9 +1200,10 @@ nfcd_realloc nfcd_allocator(struct nfcd_ConfigData *cd, void **user_data)
 					index = i;
 			}
 			assert(index >= 0);
-			if (nsize > 0)
+			if (nsize > 0) {
+				memlog[index].ptr = nptr;
 				memlog[index].size = nsize;
-			else
+			} else
 				memlog[index] = memlog[--memlog_size];
 		} else {
 			assert(memlog_size < MAX_MEMORY_RECORDS);
@@ -532,8 +1268,386 @@ nfcd_realloc nfcd_allocator(struct nfcd_ConfigData *cd, void **user_data)
 		assert(nfcd_type(copy, nfcd_object_lookup(copy, obj, "title")) == NFCD_TYPE_NULL);
 
 		nfcd_free(copy);
+
+		// Save and load test
+		{
+			const int bytes = nfcd_save_bytes(cd);
+			char *image = realloc_f(0, 0, 0, bytes, __FILE__, __LINE__);
+			nfcd_save_to_buffer(cd, image);
+			const struct nfcd_ConfigData *ro = nfcd_open_readonly(image, bytes, 1);
+			assert(ro && nfcd_object_size(ro, obj) == 2);
+			assert(strcmp(nfcd_to_string(ro, nfcd_object_value(ro, obj, 0)), "Niklas") == 0);
+			assert(nfcd_to_number(ro, nfcd_object_lookup(ro, obj, "age")) == 41);
+			assert(nfcd_type(ro, nfcd_object_lookup(ro, obj, "title")) == NFCD_TYPE_NULL);
+
+			// The image doesn't depend on the allocator.
+			char *image_2 = realloc_f(0, 0, 0, bytes, __FILE__, __LINE__);
+			copy = nfcd_load(realloc_f, 0, image, bytes);
+			assert(copy);
+			void *ud = &ud;
+			assert(nfcd_allocator(copy, &ud) == realloc_f && ud == 0);
+			nfcd_save_to_buffer(copy, image_2);
+			assert(memcmp(image, image_2, bytes) == 0);
+			nfcd_set(&copy, obj, "title", nfcd_add_string(&copy, "Mr"));
+			assert(strcmp(nfcd_to_string(copy, nfcd_object_lookup(copy, obj, "title")), "Mr") == 0);
+			nfcd_free(copy);
+
+			// Damaged and truncated images are rejected. The embedded string
+			// table is checked even without verifying the checksum.
+			int *table_bytes = (int *)((char *)ro + ro->allocated_bytes);
+			*table_bytes -= 8;
+			assert(nfcd_open_readonly(image, bytes, 0) == NULL);
+			*table_bytes += 8;
+			unsigned *table_flags = (unsigned *)(table_bytes + 2);
+			*table_flags ^= 0x80u << 24;
+			assert(nfcd_open_readonly(image, bytes, 0) == NULL);
+			*table_flags ^= 0x80u << 24;
+			int *table_slots = table_bytes + 3;
+			const int num_slots = *table_slots;
+			*table_slots = 1 << 24;
+			assert(nfcd_open_readonly(image, bytes, 0) == NULL);
+			*table_slots = num_slots;
+			assert(nfcd_open_readonly(image, bytes, 1) == ro);
+			assert(nfcd_open_readonly(image, bytes - 1, 0) == NULL);
+			assert(nfcd_open_readonly(image, 16, 0) == NULL);
+			image[bytes - 1] ^= 1;
+			assert(nfcd_open_readonly(image, bytes, 0) != NULL);
+			assert(nfcd_open_readonly(image, bytes, 1) == NULL);
+			assert(nfcd_load(realloc_f, 0, image, bytes) == NULL);
+			image[0] ^= 1;
+			assert(nfcd_open_readonly(image, bytes, 0) == NULL);
+
+			realloc_f(0, image_2, bytes, 0, __FILE__, __LINE__);
+			realloc_f(0, image, bytes, 0, __FILE__, __LINE__);
+		}
+
 		nfcd_free(cd);
 		assert(memlog_size == 0);
+
+		// Objects with many keys get a hash index. Objects that start small and
+		// grow a chain of blocks and objects allocated with their full size
+		// should work the same.
+		for (int allocated = 4; allocated <= 10000; allocated *= 2500) {
+			const int n = 10000;
+			cd = nfcd_make(realloc_f, 0, 0, 0);
+			obj = nfcd_add_object(&cd, allocated);
+			for (int i=0; i<n; ++i) {
+				char key[16];
+				sprintf(key, "key%i", i);
+				nfcd_set(&cd, obj, key, nfcd_add_number(&cd, i));
+			}
+			for (int i=0; i<n; i += 7) {
+				char key[16];
+				sprintf(key, "key%i", i);
+				nfcd_set(&cd, obj, key, nfcd_add_number(&cd, -i));
+			}
+			nfcd_set_root(cd, nfcd_add_string(&cd, "not a key"));
+			assert(nfcd_object_size(cd, obj) == n);
+			assert(((struct block *)data(cd, LOC_OFFSET(obj)))->index != 0);
+
+			copy = realloc_f(0, 0, 0, cd->total_bytes, __FILE__, __LINE__);
+			memcpy(copy, cd, cd->total_bytes);
+			for (int i=0; i<n; ++i) {
+				char key[16];
+				sprintf(key, "key%i", i);
+				assert(strcmp(nfcd_object_key(copy, obj, i), key) == 0);
+				assert(nfcd_to_number(copy, nfcd_object_lookup(copy, obj, key)) == (i % 7 ? i : -i));
+			}
+			assert(nfcd_type(copy, nfcd_object_lookup(copy, obj, "not a key")) == NFCD_TYPE_NULL);
+			assert(nfcd_type(copy, nfcd_object_lookup(copy, obj, "missing")) == NFCD_TYPE_NULL);
+			nfcd_free(copy);
+			nfcd_free(cd);
+		}
+		assert(memlog_size == 0);
+
+		// Pack test
+		for (int with_remap = 0; with_remap < 2; ++with_remap) {
+			cd = nfcd_make(realloc_f, 0, 0, 0);
+			nfcd_loc root = nfcd_add_object(&cd, 1);
+			nfcd_set_root(cd, root);
+			nfcd_loc list = nfcd_add_array(&cd, 1);
+			for (int i=0; i<100; ++i)
+				nfcd_push(&cd, list, nfcd_add_number(&cd, i));
+			nfcd_set(&cd, root, "list", list);
+			nfcd_loc big = nfcd_add_object(&cd, 2);
+			for (int i=0; i<100; ++i) {
+				char key[16];
+				sprintf(key, "key%i", i);
+				nfcd_set(&cd, big, key, nfcd_add_number(&cd, i));
+			}
+			nfcd_set(&cd, root, "big", big);
+			nfcd_set(&cd, root, "empty", nfcd_add_array(&cd, 0));
+			nfcd_set(&cd, root, "name", nfcd_add_string(&cd, "Niklas"));
+			nfcd_set(&cd, root, "other", list);
+			nfcd_loc garbage = nfcd_add_number(&cd, 1);
+			nfcd_set(&cd, root, "age", garbage);
+			nfcd_loc age = nfcd_add_number(&cd, 41);
+			nfcd_set(&cd, root, "age", age);
+			const nfcd_loc old_list = list;
+			const int old_used = cd->used_bytes;
+
+			struct nfcd_LocRemap *remap = NULL;
+			const int n = nfcd_pack(&cd, with_remap ? &remap : NULL);
+			assert(n == 1 + 1 + 100 + 1 + 100 + 1 + 1);
+			assert(cd->used_bytes == cd->allocated_bytes && cd->used_bytes < old_used);
+
+			root = nfcd_root(cd);
+			assert(nfcd_object_size(cd, root) == 6);
+			list = nfcd_object_lookup(cd, root, "list");
+			assert(nfcd_object_lookup(cd, root, "other") == list);
+			assert(((struct block *)data(cd, LOC_OFFSET(list)))->next_block == 0);
+			assert(nfcd_array_size(cd, list) == 100 && nfcd_to_number(cd, nfcd_array_item(cd, list, 99)) == 99);
+			big = nfcd_object_lookup(cd, root, "big");
+			assert(((struct block *)data(cd, LOC_OFFSET(big)))->index != 0);
+			assert(nfcd_to_number(cd, nfcd_object_lookup(cd, big, "key57")) == 57);
+			assert(strcmp(nfcd_to_string(cd, nfcd_object_lookup(cd, root, "name")), "Niklas") == 0);
+			assert(nfcd_to_number(cd, nfcd_object_lookup(cd, root, "age")) == 41);
+			if (with_remap) {
+				// The shared list is kept once, both keys map to it.
+				assert(nfcd_remap_loc(remap, n, old_list) == nfcd_object_lookup(cd, root, "list"));
+				assert(nfcd_remap_loc(remap, n, old_list) == nfcd_object_lookup(cd, root, "other"));
+				assert(nfcd_remap_loc(remap, n, garbage) == nfcd_null());
+				assert(nfcd_remap_loc(remap, n, age) == nfcd_object_lookup(cd, root, "age"));
+				assert(nfcd_remap_loc(remap, n, nfcd_true()) == nfcd_true());
+				void *ud;
+				nfcd_allocator(cd, &ud)(ud, remap, n * sizeof(*remap), 0, __FILE__, __LINE__);
+			}
+
+			// Packed data can still be modified.
+			nfcd_push(&cd, nfcd_object_lookup(cd, root, "empty"), nfcd_true());
+			nfcd_set(&cd, root, "new", nfcd_false());
+			assert(nfcd_array_size(cd, nfcd_object_lookup(cd, root, "empty")) == 1);
+			assert(nfcd_type(cd, nfcd_object_lookup(cd, root, "new")) == NFCD_TYPE_FALSE);
+			nfcd_free(cd);
+		}
+		assert(memlog_size == 0);
+
+		// Growth test. Both the data and the string table should grow many
+		// times without disturbing each other.
+		{
+			cd = nfcd_make(realloc_f, 0, 64, 1024);
+			nfcd_loc arr = nfcd_add_array(&cd, 0);
+			nfcd_set_root(cd, arr);
+			const int n = 20000;
+			for (int i=0; i<n; ++i) {
+				char s[16];
+				sprintf(s, "s%i", i);
+				nfcd_push(&cd, arr, nfcd_add_string(&cd, s));
+				nfcd_push(&cd, arr, nfcd_add_number(&cd, i));
+			}
+			assert(cd->used_bytes <= cd->allocated_bytes && cd->allocated_bytes < cd->total_bytes);
+			assert(nfcd_array_size(cd, arr) == 2*n);
+			for (int i=0; i<n; ++i) {
+				char s[16];
+				sprintf(s, "s%i", i);
+				assert(strcmp(nfcd_to_string(cd, nfcd_array_item(cd, arr, 2*i)), s) == 0);
+				assert(nfcd_to_number(cd, nfcd_array_item(cd, arr, 2*i+1)) == i);
+			}
+			nfcd_free(cd);
+		}
+		assert(memlog_size == 0);
+
+		// Arena test. Data built in an arena should work the same as in a
+		// single buffer and should never move. Flattening keeps the locs,
+		// packing an arena works as for a single buffer.
+		for (int pack = 0; pack < 2; ++pack) {
+			cd = nfcd_make_arena(realloc_f, 0, 1024, 0);
+			nfcd_loc root = nfcd_add_object(&cd, 0);
+			nfcd_set_root(cd, root);
+			nfcd_loc list = nfcd_add_array(&cd, 0);
+			nfcd_loc big = nfcd_add_object(&cd, 0);
+			nfcd_loc wide = nfcd_add_array(&cd, 1000);
+			nfcd_set(&cd, root, "list", list);
+			nfcd_set(&cd, root, "big", big);
+			nfcd_set(&cd, root, "wide", wide);
+			const struct block * const first = (struct block *)data(cd, LOC_OFFSET(list));
+			const int n = 1000;
+			for (int i=0; i<n; ++i) {
+				char key[16];
+				sprintf(key, "key%i", i);
+				nfcd_push(&cd, list, nfcd_add_number(&cd, i));
+				nfcd_set(&cd, big, key, nfcd_add_string(&cd, key));
+				nfcd_push(&cd, wide, nfcd_true());
+			}
+			assert(cd->arena->num_chunks > 10);
+			assert((struct block *)data(cd, LOC_OFFSET(list)) == first);
+
+			for (int converted = 0; converted < 2; ++converted) {
+				if (converted) {
+					if (pack)
+						nfcd_pack(&cd, NULL);
+					else
+						nfcd_flatten(&cd);
+					assert(cd->arena == NULL);
+					root = nfcd_root(cd);
+					if (!pack)
+						assert(nfcd_object_lookup(cd, root, "list") == list && nfcd_object_lookup(cd, root, "big") == big);
+					list = nfcd_object_lookup(cd, root, "list");
+					big = nfcd_object_lookup(cd, root, "big");
+					wide = nfcd_object_lookup(cd, root, "wide");
+				}
+				assert(nfcd_object_size(cd, root) == 3);
+				assert(nfcd_array_size(cd, list) == n && nfcd_array_size(cd, wide) == n);
+				assert(((struct block *)data(cd, LOC_OFFSET(big)))->index != 0);
+				for (int i=0; i<n; ++i) {
+					char key[16];
+					sprintf(key, "key%i", i);
+					assert(nfcd_to_number(cd, nfcd_array_item(cd, list, i)) == i);
+					assert(strcmp(nfcd_to_string(cd, nfcd_object_lookup(cd, big, key)), key) == 0);
+					assert(nfcd_array_item(cd, wide, i) == nfcd_true());
+				}
+			}
+
+			const int bytes = nfcd_save_bytes(cd);
+			void *image = realloc_f(0, 0, 0, bytes, __FILE__, __LINE__);
+			nfcd_save_to_buffer(cd, image);
+			const struct nfcd_ConfigData *ro = nfcd_open_readonly(image, bytes, 1);
+			assert(ro && nfcd_to_number(ro, nfcd_array_item(ro, nfcd_object_lookup(ro, nfcd_root(ro), "list"), 7)) == 7);
+			realloc_f(0, image, bytes, 0, __FILE__, __LINE__);
+			nfcd_free(cd);
+		}
+		assert(memlog_size == 0);
+
+		// An empty arena flattens to an empty config data.
+		cd = nfcd_make_arena(realloc_f, 0, 0, 0);
+		nfcd_flatten(&cd);
+		assert(cd->used_bytes == DATA_START && nfcd_type(cd, nfcd_root(cd)) == NFCD_TYPE_NULL);
+		nfcd_set_root(cd, nfcd_add_number(&cd, 3));
+		assert(nfcd_to_number(cd, nfcd_root(cd)) == 3);
+		nfcd_free(cd);
+		assert(memlog_size == 0);
+
+		// The string table stops growing at its limit and reports it.
+		{
+			const int n = 1 << 20;
+			char *s = realloc_f(0, 0, 0, n, __FILE__, __LINE__);
+			memset(s, 'x', n - 1);
+			s[n - 1] = 0;
+			cd = nfcd_make(realloc_f, 0, 0, 0);
+			const nfcd_loc object = nfcd_add_object(&cd, 0);
+			nfcd_set_root(cd, object);
+			nfcd_loc loc = 0;
+			for (int i = 0; loc != NFCD_STRING_TABLE_FULL; ++i) {
+				char prefix[16];
+				memcpy(s, prefix, sprintf(prefix, "%i", i));
+				loc = nfcd_add_string(&cd, s);
+				assert(i < 512);
+			}
+			assert(cd->total_bytes - cd->allocated_bytes > NFCD_MAX_STRING_TABLE_BYTES - 2 * n);
+			assert(cd->total_bytes - cd->allocated_bytes <= NFCD_MAX_STRING_TABLE_BYTES);
+			nfcd_set(&cd, object, s, nfcd_true());
+			assert(nfcd_object_size(cd, object) == 0);
+			realloc_f(0, s, n, 0, __FILE__, __LINE__);
+			nfcd_free(cd);
+		}
+		assert(memlog_size == 0);
+	}
+
+#endif
+
+#ifdef NFCD_PERFORMANCE_TEST
+
+	#include <stdlib.h>
+	#include <stdio.h>
+	#include <time.h>
+
+	#ifndef CD_STRESS_BYTES
+		#define CD_STRESS_BYTES (1024*1024*1024)
+	#endif
+
+	static int reallocs;
+
+	// If set, `realloc_f()` always allocates a new block and copies the data,
+	// like allocators that can't grow blocks in place. (The C library
+	// `realloc()` can grow big blocks without copying, by remapping pages.)
+	static int copying_realloc;
+
+	static void *realloc_f(void *ud, void *ptr, int osize, int nsize, const char *file, int line)
+	{
+		++reallocs;
+		if (nsize == 0) {
+			free(ptr);
+			return NULL;
+		}
+		void *nptr;
+		if (copying_realloc) {
+			nptr = malloc(nsize);
+			if (nptr && ptr)
+				memcpy(nptr, ptr, osize < nsize ? osize : nsize);
+			free(ptr);
+		} else
+			nptr = realloc(ptr, nsize);
+		if (!nptr) {
+			fprintf(stderr, "Out of memory allocating %i bytes\n", nsize);
+			exit(1);
+		}
+		return nptr;
+	}
+
+	// Builds a document with `CD_STRESS_BYTES` of data, starting from the default
+	// size, and reports the time and the number of reallocations. The root is
+	// an array of small objects with numbers, strings from a bounded
+	// vocabulary and nested arrays, similar to a large level file. If `arena`
+	// is true, the document is built in an arena and flattened. `copying`
+	// sets `copying_realloc`.
+	static void stress_performance(int arena, int copying)
+	{
+		static const char *names[] = {"position", "rotation", "scale", "mesh", "material", "tags"};
+
+		reallocs = 0;
+		copying_realloc = copying;
+		clock_t start = clock();
+		struct nfcd_ConfigData *cd = arena ? nfcd_make_arena(realloc_f, 0, 0, 0) : nfcd_make(realloc_f, 0, 0, 0);
+		nfcd_loc root = nfcd_add_array(&cd, 0);
+		nfcd_set_root(cd, root);
+		int entities = 0;
+		while (cd->used_bytes < CD_STRESS_BYTES) {
+			char s[32];
+			nfcd_loc e = nfcd_add_object(&cd, 4);
+			nfcd_loc v = nfcd_add_array(&cd, 3);
+			for (int i=0; i<3; ++i)
+				nfcd_push(&cd, v, nfcd_add_number(&cd, entities + i));
+			nfcd_set(&cd, e, names[entities % 3], v);
+			sprintf(s, "content/mesh_%i.mesh", entities % 100000);
+			nfcd_set(&cd, e, names[3], nfcd_add_string(&cd, s));
+			sprintf(s, "material_%i", entities % 1000);
+			nfcd_set(&cd, e, names[4], nfcd_add_string(&cd, s));
+			nfcd_set(&cd, e, names[5], nfcd_add_array(&cd, 0));
+			nfcd_push(&cd, root, e);
+			++entities;
+		}
+		clock_t built = clock();
+		nfcd_flatten(&cd);
+		clock_t stop = clock();
+
+		double delta = ((double)(stop-start)) / CLOCKS_PER_SEC;
+		printf("%s, %s realloc: built %i MB (%i MB data, %i MB strings) with %i entities in %.2f s, %.1f MB/s, %i reallocs\n",
+			arena ? "Arena" : "Buffer", copying ? "copying" : "C", cd->total_bytes / (1024*1024), cd->used_bytes / (1024*1024),
+			(cd->total_bytes - cd->allocated_bytes) / (1024*1024), entities, delta,
+			cd->used_bytes / delta / (1024*1024), reallocs);
+		if (arena)
+			printf("Flatten %.2f s\n", ((double)(stop-built)) / CLOCKS_PER_SEC);
+
+		start = clock();
+		double sum = 0;
+		for (int i=0; i<entities; i += 97) {
+			nfcd_loc e = nfcd_array_item(cd, root, i);
+			nfcd_loc v = nfcd_object_lookup(cd, e, names[i % 3]);
+			sum += nfcd_to_number(cd, nfcd_array_item(cd, v, 2));
+		}
+		stop = clock();
+		delta = ((double)(stop-start)) / CLOCKS_PER_SEC;
+		printf("Looked up every 97th entity in %.2f s (%g)\n", delta, sum);
+		nfcd_free(cd);
+	}
+
+	int main(int argc, char **argv)
+	{
+		for (int copying = 0; copying < 2; ++copying) {
+			stress_performance(0, copying);
+			stress_performance(1, copying);
+		}
+		return 0;
 	}
 
 #endif
@@ -44,6 +44,7 @@ const char *nfjp_parse_with_settings(const char *s, struct nfcd_ConfigData **cdp
 
 typedef int nfcd_loc;
 typedef void * (*nfcd_realloc) (void *ud, void *ptr, int osize, int nsize, const char *file, int line);
+#define NFCD_STRING_TABLE_FULL (-1)
 nfcd_loc nfcd_null();
 nfcd_loc nfcd_false();
 nfcd_loc nfcd_true();
@@ -108,6 +109,7 @@ struct CharBuffer
 static void cb_grow(struct Parser *p, struct CharBuffer *cb);
 static void cb_free(struct Parser *p, struct CharBuffer *cb);
 static inline void cb_push(struct Parser *p, struct CharBuffer *cb, char c);
+static nfcd_loc cb_add_string(struct Parser *p, struct CharBuffer *cb);
 
 // Stack storage space for nfcd_loc buffer.
 #define LOC_BUFFER_STATIC_SIZE 128
@@ -238,9 +240,7 @@ static nfcd_loc parse_string(struct Parser *p)
 		skip_char(p, '"');
 		skip_char(p, '"');
 		cb_push(p, &cb, 0);
-		nfcd_loc loc = nfcd_add_string(p->cdp, cb.s);
-		cb_free(p, &cb);
-		return loc;
+		return cb_add_string(p, &cb);
 	}
 
 	while (1) {
@@ -270,9 +270,7 @@ static nfcd_loc parse_string(struct Parser *p)
 
 	skip_char(p, '"');
 	cb_push(p, &cb, 0);
-	nfcd_loc loc = nfcd_add_string(p->cdp, cb.s);
-	cb_free(p, &cb);
-	return loc;
+	return cb_add_string(p, &cb);
 }
 
 // Parses and returns a number at `p->s`.
@@ -370,9 +368,7 @@ static nfcd_loc parse_key(struct Parser *p)
 			++p->s;
 		}
 		cb_push(p, &cb, 0);
-		nfcd_loc loc = nfcd_add_string(p->cdp, cb.s);
-		cb_free(p, &cb);
-		return loc;
+		return cb_add_string(p, &cb);
 	}
 
 	return parse_string(p);
@@ -578,6 +574,17 @@ static void cb_free(struct Parser *p, struct CharBuffer *cb)
 		temp_realloc(p, cb->s, cb->allocated, 0);
 }
 
+// Adds the zero terminated string in `cb` to the config data, frees `cb`
+// and returns the string's loc.
+static nfcd_loc cb_add_string(struct Parser *p, struct CharBuffer *cb)
+{
+	const nfcd_loc loc = nfcd_add_string(p->cdp, cb->s);
+	cb_free(p, cb);
+	if (loc == NFCD_STRING_TABLE_FULL)
+		error(p, "String table full");
+	return loc;
+}
+
 // Adds `c` to the end of `cb`.
 static inline void cb_push(struct Parser *p, struct CharBuffer *cb, char c)
 {
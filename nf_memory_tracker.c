@@ -43,6 +43,7 @@ struct nfmt_Buffer nfmt_read();
 struct nfst_StringTable;
 void nfst_init(struct nfst_StringTable *st, int bytes, int average_string_size);
 int nfst_to_symbol(struct nfst_StringTable *st, const char *s);
+int nfst_to_string_len(const struct nfst_StringTable *st, int symbol);
 
 #define STREAM_SIZE (16*1024)
 #define STRING_TABLE_SIZE (2*1024)
@@ -122,7 +123,7 @@ static inline int to_symbol(const char *s)
 	
 	// New symbol, add it to the stream.
 	if (sym > sent_symbols) {
-		record(RECORD_TYPE_SYMBOL, &sym, sizeof(sym), s, strlen(s)+1);
+		record(RECORD_TYPE_SYMBOL, &sym, sizeof(sym), s, nfst_to_string_len(strings, sym)+1);
 		sent_symbols = sym;
 	}
 
@@ -0,0 +1,516 @@
+// # String Interner
+//
+// This file implements a thread safe string interner on top of
+// *nf_string_table*. Any number of threads can intern strings at the same
+// time.
+//
+// Strings are routed by hash to one of a number of *shards*. Each shard is
+// an `nfst_StringTable` with its own spin lock, so threads only contend
+// when they add strings to the same shard at the same time. Lookups of
+// strings that are already interned, as well as `nfsi_to_string()`, don't
+// take any locks at all. They use the lock-free reader support of
+// *nf_string_table* (see the **Threading** section there).
+//
+// A symbol encodes the shard in its low bits and the symbol within the
+// shard's string table in the rest, so converting a symbol back to a
+// string is O(1).
+//
+// When all strings have been interned, `nfsi_pack()` merges the shards into
+// a single packed `nfst_StringTable`, suitable for shipping.
+//
+// See example code in the **Unit Test** section below.
+
+// ## Interface
+
+typedef void * (*nfsi_realloc) (void *ud, void *ptr, int osize, int nsize, const char *file, int line);
+
+struct nfsi_Interner;
+struct nfst_StringTable;
+
+struct nfsi_Interner *nfsi_make(nfsi_realloc realloc, void *ud, int num_shards, int shard_bytes);
+void nfsi_free(struct nfsi_Interner *si);
+int nfsi_to_symbol(struct nfsi_Interner *si, const char *s);
+int nfsi_to_symbol_const(struct nfsi_Interner *si, const char *s);
+const char *nfsi_to_string(struct nfsi_Interner *si, int symbol);
+struct nfst_StringTable *nfsi_pack(struct nfsi_Interner *si, int *bytes);
+
+// ## Implementation
+
+#include <assert.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+void nfst_init(struct nfst_StringTable *st, int bytes, int average_string_size);
+void nfst_grow(struct nfst_StringTable *st, int bytes);
+void nfst_grow_copy(struct nfst_StringTable *dst, const struct nfst_StringTable *src, int bytes);
+int nfst_pack(struct nfst_StringTable *st);
+int nfst_to_symbol(struct nfst_StringTable *st, const char *s);
+int nfst_to_symbol_const(const struct nfst_StringTable *st, const char *s);
+const char *nfst_to_string(const struct nfst_StringTable *, int symbol);
+int nfst_next_symbol(struct nfst_StringTable *st, int symbol);
+
+#define NFST_STRING_TABLE_FULL (-1)
+
+#define MAX_SHARDS (64)
+#define DEFAULT_SHARD_BYTES (4*1024)
+
+// Shards are placed on separate cache lines so that threads working on
+// different shards don't fight over the lock cache lines.
+#define SHARD_STRIDE (64)
+
+#if defined(_MSC_VER)
+	#include <intrin.h>
+	#define EXCHANGE_ACQUIRE(p, v)	_InterlockedExchange((volatile long *)(p), (v))
+	#define STORE_RELEASE(p, v)		(*(volatile long *)(p) = (v))
+	#define LOAD_RELAXED(p)			(*(volatile long *)(p))
+	#define STORE_PTR_RELEASE(p, v)	(*(void * volatile *)(p) = (v))
+	#define LOAD_PTR_ACQUIRE(p)		(*(void * volatile *)(p))
+#else
+	#define EXCHANGE_ACQUIRE(p, v)	__atomic_exchange_n((p), (v), __ATOMIC_ACQUIRE)
+	#define STORE_RELEASE(p, v)		__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+	#define LOAD_RELAXED(p)			__atomic_load_n((p), __ATOMIC_RELAXED)
+	#define STORE_PTR_RELEASE(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+	#define LOAD_PTR_ACQUIRE(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#endif
+
+// A string table buffer that a shard has grown out of. Readers may still be
+// using it, so it is kept until the interner is freed.
+struct Retired
+{
+	struct Retired *next;
+	struct nfst_StringTable *st;
+	int bytes;
+};
+
+struct Shard
+{
+	// Spin lock that must be held to add strings to the shard.
+	int lock;
+
+	// Size of the shard's string table buffer.
+	int bytes;
+
+	// The shard's current string table. Readers load this without holding
+	// the lock.
+	struct nfst_StringTable *st;
+
+	// Buffers that the shard has grown out of.
+	struct Retired *retired;
+};
+
+// The interner. The shards are stored after this header, SHARD_STRIDE bytes
+// apart.
+struct nfsi_Interner
+{
+	nfsi_realloc realloc;
+	void *realloc_user_data;
+
+	// Total size of the allocated interner, including the shards.
+	int allocated_bytes;
+
+	int num_shards;
+	int shard_bits;
+};
+
+static inline struct Shard *shard(struct nfsi_Interner *si, int i);
+static inline uint32_t route_hash(const char *s);
+static inline int max_shard_bytes(const struct nfsi_Interner *si);
+static inline int encode(const struct nfsi_Interner *si, int sym, int i);
+static void lock(struct Shard *sh);
+static void unlock(struct Shard *sh);
+static int grow(struct nfsi_Interner *si, struct Shard *sh);
+
+// Creates a new interner with `num_shards` shards, allocated with `realloc`.
+// `num_shards` must be a power of two, no larger than 64. A good choice is
+// a small multiple of the number of threads that will use the interner.
+// `shard_bytes` is the initial size of each shard's string table, you can
+// use 0 for a default size.
+struct nfsi_Interner *nfsi_make(nfsi_realloc realloc, void *ud, int num_shards, int shard_bytes)
+{
+	assert(num_shards > 0 && num_shards <= MAX_SHARDS);
+	assert((num_shards & (num_shards - 1)) == 0);
+	if (!shard_bytes)
+		shard_bytes = DEFAULT_SHARD_BYTES;
+
+	const int bytes = SHARD_STRIDE + num_shards * SHARD_STRIDE;
+	struct nfsi_Interner *si = realloc(ud, NULL, 0, bytes, __FILE__, __LINE__);
+	si->realloc = realloc;
+	si->realloc_user_data = ud;
+	si->allocated_bytes = bytes;
+	si->num_shards = num_shards;
+	si->shard_bits = 0;
+	while ((1 << si->shard_bits) < num_shards)
+		++si->shard_bits;
+
+	for (int i=0; i<num_shards; ++i) {
+		struct Shard *sh = shard(si, i);
+		sh->lock = 0;
+		sh->bytes = shard_bytes;
+		sh->st = realloc(ud, NULL, 0, shard_bytes, __FILE__, __LINE__);
+		sh->retired = NULL;
+		nfst_init(sh->st, shard_bytes, 15);
+	}
+	return si;
+}
+
+// Frees an interner created by `nfsi_make()`. No other threads may be using
+// the interner when it is freed.
+void nfsi_free(struct nfsi_Interner *si)
+{
+	for (int i=0; i<si->num_shards; ++i) {
+		struct Shard *sh = shard(si, i);
+		while (sh->retired) {
+			struct Retired *r = sh->retired;
+			sh->retired = r->next;
+			si->realloc(si->realloc_user_data, r->st, r->bytes, 0, __FILE__, __LINE__);
+			si->realloc(si->realloc_user_data, r, sizeof(*r), 0, __FILE__, __LINE__);
+		}
+		si->realloc(si->realloc_user_data, sh->st, sh->bytes, 0, __FILE__, __LINE__);
+	}
+	si->realloc(si->realloc_user_data, si, si->allocated_bytes, 0, __FILE__, __LINE__);
+}
+
+// Returns the symbol for the string `s`, adding it to the interner if it
+// isn't there already. This can be called from any thread.
+//
+// The empty string is guaranteed to have the symbol `0`. If the string's
+// shard can't grow any further, `NFST_STRING_TABLE_FULL` is returned.
+int nfsi_to_symbol(struct nfsi_Interner *si, const char *s)
+{
+	if (!*s) return 0;
+
+	const int i = route_hash(s) & (si->num_shards - 1);
+	struct Shard * const sh = shard(si, i);
+
+	// Most strings are already interned, so try without the lock first.
+	int sym = nfst_to_symbol_const(LOAD_PTR_ACQUIRE(&sh->st), s);
+	if (sym != NFST_STRING_TABLE_FULL)
+		return encode(si, sym, i);
+
+	lock(sh);
+	sym = nfst_to_symbol(sh->st, s);
+	while (sym == NFST_STRING_TABLE_FULL && grow(si, sh))
+		sym = nfst_to_symbol(sh->st, s);
+	unlock(sh);
+
+	return encode(si, sym, i);
+}
+
+// As `nfsi_to_symbol()`, but never adds the string. If the string hasn't
+// been interned, `NFST_STRING_TABLE_FULL` is returned. This never takes a
+// lock.
+int nfsi_to_symbol_const(struct nfsi_Interner *si, const char *s)
+{
+	if (!*s) return 0;
+
+	const int i = route_hash(s) & (si->num_shards - 1);
+	struct Shard * const sh = shard(si, i);
+	return encode(si, nfst_to_symbol_const(LOAD_PTR_ACQUIRE(&sh->st), s), i);
+}
+
+// Returns the string for the `symbol`. This can be called from any thread
+// and never takes a lock.
+const char *nfsi_to_string(struct nfsi_Interner *si, int symbol)
+{
+	struct Shard * const sh = shard(si, symbol & (si->num_shards - 1));
+	return nfst_to_string(LOAD_PTR_ACQUIRE(&sh->st), symbol >> si->shard_bits);
+}
+
+// Merges all the shards into a single packed string table, allocated with
+// the interner's allocator. The size of the allocation is returned in
+// `*bytes`.
+//
+// The symbols of the packed table are not the same as the interner's
+// symbols. Use `nfst_to_symbol_const()` on the packed table to convert them.
+//
+// No other threads may add strings to the interner while it is packed.
+struct nfst_StringTable *nfsi_pack(struct nfsi_Interner *si, int *bytes)
+{
+	int size = 0;
+	for (int i=0; i<si->num_shards; ++i)
+		size += shard(si, i)->bytes;
+
+	struct nfst_StringTable *st = si->realloc(si->realloc_user_data, NULL, 0, size, __FILE__, __LINE__);
+	nfst_init(st, size, 15);
+
+	for (int i=0; i<si->num_shards; ++i) {
+		struct nfst_StringTable * const src = shard(si, i)->st;
+		for (int sym = nfst_next_symbol(src, 0); sym; sym = nfst_next_symbol(src, sym)) {
+			const char * const s = nfst_to_string(src, sym);
+			while (nfst_to_symbol(st, s) == NFST_STRING_TABLE_FULL) {
+				st = si->realloc(si->realloc_user_data, st, size, size * 2, __FILE__, __LINE__);
+				nfst_grow(st, size * 2);
+				size *= 2;
+			}
+		}
+	}
+
+	const int packed_size = nfst_pack(st);
+	st = si->realloc(si->realloc_user_data, st, size, packed_size, __FILE__, __LINE__);
+	*bytes = packed_size;
+	return st;
+}
+
+static inline struct Shard *shard(struct nfsi_Interner *si, int i)
+{
+	return (struct Shard *)((char *)si + SHARD_STRIDE + i * SHARD_STRIDE);
+}
+
+// Hash used for routing strings to shards (FNV-1a). This is independent
+// of the hash used inside the shards' string tables.
+static inline uint32_t route_hash(const char *s)
+{
+	uint32_t h = 2166136261u;
+	for (; *s; ++s)
+		h = (h ^ (unsigned char)*s) * 16777619u;
+	return h ^ (h >> 16);
+}
+
+// Largest size of a shard's string table. Shard symbols are offsets into
+// the table, so this ensures that they can be shifted up to make room for
+// the shard index without overflowing.
+static inline int max_shard_bytes(const struct nfsi_Interner *si)
+{
+	return INT_MAX >> si->shard_bits;
+}
+
+// Combines the symbol `sym` of shard `i` into an interner symbol.
+// `NFST_STRING_TABLE_FULL` is passed through.
+static inline int encode(const struct nfsi_Interner *si, int sym, int i)
+{
+	if (sym == NFST_STRING_TABLE_FULL || sym > max_shard_bytes(si))
+		return NFST_STRING_TABLE_FULL;
+	return sym << si->shard_bits | i;
+}
+
+static void lock(struct Shard *sh)
+{
+	while (EXCHANGE_ACQUIRE(&sh->lock, 1)) {
+		while (LOAD_RELAXED(&sh->lock))
+			;
+	}
+}
+
+static void unlock(struct Shard *sh)
+{
+	STORE_RELEASE(&sh->lock, 0);
+}
+
+// Doubles the size of the shard's string table, up to `max_shard_bytes()`.
+// Must be called with the shard locked. The table is grown into a new
+// buffer, so that lock-free readers can continue to use the old one.
+// Returns 0 if the table is already at its maximum size.
+static int grow(struct nfsi_Interner *si, struct Shard *sh)
+{
+	const int max_bytes = max_shard_bytes(si);
+	if (sh->bytes >= max_bytes)
+		return 0;
+	const int bytes = sh->bytes > max_bytes / 2 ? max_bytes : sh->bytes * 2;
+	struct nfst_StringTable *st = si->realloc(si->realloc_user_data, NULL, 0, bytes, __FILE__, __LINE__);
+	nfst_grow_copy(st, sh->st, bytes);
+
+	struct Retired *r = si->realloc(si->realloc_user_data, NULL, 0, sizeof(*r), __FILE__, __LINE__);
+	r->next = sh->retired;
+	r->st = sh->st;
+	r->bytes = sh->bytes;
+	sh->retired = r;
+
+	sh->bytes = bytes;
+	STORE_PTR_RELEASE(&sh->st, st);
+	return 1;
+}
+
+// ## Unit Test
+
+#ifdef NFSI_UNIT_TEST
+
+	#include <stdio.h>
+	#include <string.h>
+
+	#define assert_strequal(a,b)	assert(strcmp((a), (b)) == 0)
+
+	static int allocated_bytes = 0;
+
+	static void *realloc_f(void *ud, void *ptr, int osize, int nsize, const char *file, int line)
+	{
+	#if defined(_WIN32)
+		allocated_bytes += nsize - osize;
+	#else
+		__atomic_add_fetch(&allocated_bytes, nsize - osize, __ATOMIC_RELAXED);
+	#endif
+		return realloc(ptr, nsize);
+	}
+
+	#if !defined(_WIN32)
+		#include <pthread.h>
+
+		// Each thread interns half of the strings "t0", "t1", ..., starting
+		// at a different offset, so that every string is interned by two
+		// threads. The symbols are recorded in `threading_syms`.
+		#define THREADING_THREADS 4
+		#define THREADING_STRINGS 20000
+		#define THREADING_PER_THREAD (THREADING_STRINGS / 2)
+
+		static struct nfsi_Interner *threading_si;
+		static int threading_syms[THREADING_THREADS][THREADING_PER_THREAD];
+
+		static int threading_string(int t, int k)
+		{
+			return (t * THREADING_STRINGS / THREADING_THREADS + k) % THREADING_STRINGS;
+		}
+
+		static void *threading_worker(void *arg)
+		{
+			const int t = (int)(uintptr_t)arg;
+			for (int k=0; k<THREADING_PER_THREAD; ++k) {
+				char s[16];
+				sprintf(s, "t%i", threading_string(t, k));
+				threading_syms[t][k] = nfsi_to_symbol(threading_si, s);
+				assert(threading_syms[t][k] > 0);
+				assert_strequal(s, nfsi_to_string(threading_si, threading_syms[t][k]));
+			}
+			return NULL;
+		}
+	#endif
+
+	int main(int argc, char **argv)
+	{
+		assert(sizeof(struct Shard) <= SHARD_STRIDE);
+		assert(sizeof(struct nfsi_Interner) <= SHARD_STRIDE);
+
+		struct nfsi_Interner *si = nfsi_make(realloc_f, NULL, 8, 256);
+
+		assert(nfsi_to_symbol(si, "") == 0);
+		assert_strequal("", nfsi_to_string(si, 0));
+
+		int syms[10000];
+		for (int i=0; i<10000; ++i) {
+			char s[16];
+			sprintf(s, "%i", i);
+			syms[i] = nfsi_to_symbol(si, s);
+			assert(syms[i] > 0);
+			assert_strequal(s, nfsi_to_string(si, syms[i]));
+		}
+		for (int i=0; i<10000; ++i) {
+			char s[16];
+			sprintf(s, "%i", i);
+			assert(nfsi_to_symbol(si, s) == syms[i]);
+			assert(nfsi_to_symbol_const(si, s) == syms[i]);
+			assert_strequal(s, nfsi_to_string(si, syms[i]));
+		}
+		assert(nfsi_to_symbol_const(si, "salmon") == NFST_STRING_TABLE_FULL);
+
+		int bytes = 0;
+		struct nfst_StringTable *st = nfsi_pack(si, &bytes);
+		for (int i=0; i<10000; ++i) {
+			char s[16];
+			sprintf(s, "%i", i);
+			const int sym = nfst_to_symbol_const(st, s);
+			assert(sym > 0);
+			assert_strequal(s, nfst_to_string(st, sym));
+		}
+		assert(nfst_to_symbol_const(st, "salmon") == NFST_STRING_TABLE_FULL);
+		realloc_f(NULL, st, bytes, 0, __FILE__, __LINE__);
+
+		nfsi_free(si);
+		assert(allocated_bytes == 0);
+
+	#if !defined(_WIN32)
+		// Threads interning overlapping strings get the same symbols.
+		{
+			threading_si = nfsi_make(realloc_f, NULL, 4, 256);
+			pthread_t threads[THREADING_THREADS];
+			for (int t=0; t<THREADING_THREADS; ++t)
+				pthread_create(&threads[t], NULL, threading_worker, (void *)(uintptr_t)t);
+			for (int t=0; t<THREADING_THREADS; ++t)
+				pthread_join(threads[t], NULL);
+
+			int expected[THREADING_STRINGS] = {0};
+			for (int t=0; t<THREADING_THREADS; ++t) {
+				for (int k=0; k<THREADING_PER_THREAD; ++k) {
+					const int j = threading_string(t, k);
+					if (expected[j])
+						assert(threading_syms[t][k] == expected[j]);
+					expected[j] = threading_syms[t][k];
+				}
+			}
+			for (int j=0; j<THREADING_STRINGS; ++j) {
+				char s[16];
+				sprintf(s, "t%i", j);
+				assert(expected[j] > 0);
+				assert(nfsi_to_symbol_const(threading_si, s) == expected[j]);
+			}
+			nfsi_free(threading_si);
+			assert(allocated_bytes == 0);
+		}
+	#endif
+	}
+
+#endif
+
+// ## Performance Test
+//
+// Measures the throughput with 1 to 64 threads interning strings from a
+// shared pool, where most of the strings are interned by several threads.
+
+#ifdef NFSI_PERFORMANCE_TEST
+
+	#include <pthread.h>
+	#include <stdio.h>
+	#include <time.h>
+
+	#define NUM_STRINGS (1000*1000)
+	#define OPERATIONS_PER_THREAD (500*1000)
+
+	static char (*pool)[16];
+	static struct nfsi_Interner *si;
+
+	static void *realloc_f(void *ud, void *ptr, int osize, int nsize, const char *file, int line)
+	{
+		return realloc(ptr, nsize);
+	}
+
+	static void *worker(void *arg)
+	{
+		uint32_t x = (uint32_t)(uintptr_t)arg * 2654435761u + 1;
+		for (int i=0; i<OPERATIONS_PER_THREAD; ++i) {
+			x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+			const int sym = nfsi_to_symbol(si, pool[x % NUM_STRINGS]);
+			assert(sym > 0);
+		}
+		return NULL;
+	}
+
+	static double now()
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec + ts.tv_nsec * 1e-9;
+	}
+
+	int main(int argc, char **argv)
+	{
+		pool = malloc(NUM_STRINGS * sizeof(*pool));
+		for (int i=0; i<NUM_STRINGS; ++i)
+			sprintf(pool[i], "asset/%i", i);
+
+		for (int threads = 1; threads <= 64; threads *= 2) {
+			si = nfsi_make(realloc_f, NULL, 64, 0);
+			pthread_t t[64];
+
+			const double start = now();
+			for (int i=0; i<threads; ++i)
+				pthread_create(&t[i], NULL, worker, (void *)(uintptr_t)(i + 1));
+			for (int i=0; i<threads; ++i)
+				pthread_join(t[i], NULL);
+			const double delta = now() - start;
+
+			const double ops = (double)threads * OPERATIONS_PER_THREAD;
+			printf("%2i threads: %8.2f Mops/s\n", threads, ops / delta / 1e6);
+			nfsi_free(si);
+		}
+		free(pool);
+	}
+
+#endif
@@ -10,33 +10,588 @@
 // allocating the buffer. If the buffer runs out of memory you are responsible
 // for resizing it before you can add more strings.
 //
+// ## Hash functions
+//
+// The hash function of a table is chosen when it is created, by passing one
+// of the `NFST_HASH_*` flags to `nfst_init_with_flags()`, and is recorded
+// in the table, so saved tables keep working. The default is a fast 64 bit
+// multiply-rotate hash, folded to 32 bits. `NFST_HASH_WYHASH` is a
+// wyhash-style hash that mixes with a 64x64 to 128 bit multiply,
+// `NFST_HASH_CRC32C` uses the SSE 4.2 CRC instruction if it is available
+// (compile with `-msse4.2`) and `NFST_HASH_LUA` is the hash used by older
+// versions of this file, which is there for comparisons. It clusters badly
+// on strings with numeric suffixes. The `NFST_PERFORMANCE_TEST` reports
+// probe lengths and throughput for the hash functions on a few kinds of
+// strings.
+//
+// Frozen tables use the default 64 bit hash for their perfect hash,
+// whatever the hash function of the table. Growing and wide tables always
+// use the default hash function.
+//
+// ## Folding
+//
+// Tables created with the `NFST_FOLD_CASE` flag treat strings that only
+// differ in ASCII case as the same string. With `NFST_FOLD_PATH`, strings
+// are compared as paths: backslashes are the same as slashes, repeated
+// separators count as one and `.` segments and trailing separators are
+// ignored, so `"Textures/A.png"`, `"textures\\a.png"` and
+// `"./textures//a.png"` get the same symbol (with both flags). The folding
+// is done on the fly while hashing and comparing, without copying the
+// string. The table keeps the spelling that was added first, which is what
+// `nfst_to_string()` returns. `..` segments are not resolved, since that
+// depends on the file system.
+//
+// Folding tables use their own hash function, the `NFST_HASH_*` flags are
+// ignored. They can't be compressed.
+//
+// ## Threading
+//
+// A string table can be shared between one *writer* thread and any number
+// of *reader* threads without locking. The writer may call
+// `nfst_to_symbol()`, readers may call `nfst_to_symbol_const()`,
+// `nfst_to_string()` and `nfst_to_string_len()`. New strings are published
+// with a release store of their hash slot tag, so a reader either doesn't
+// see a string at all or sees it completely written.
+//
+// Growing the table can't be done in place while readers are using it.
+// Instead, the writer grows the table into a new buffer with
+// `nfst_grow_copy()`, publishes the new pointer to the readers (with a
+// release store) and frees the old buffer once no reader can still be using
+// it, for example at the end of the frame or when all workers have passed
+// an epoch counter. Symbols are the same in the old and the new buffer.
+// `nfst_grow()` and `nfst_pack()` must not be called while readers are
+// active.
+//
+// ## Frozen tables
+//
+// A table that won't get any more strings can be *frozen* with
+// `nfst_freeze()`. This replaces the hash table with a minimal perfect hash,
+// so that a lookup is a single probe and a single string compare, and the
+// hash table only needs one slot per string. Strings can't be added to a
+// frozen table, `nfst_to_symbol()` returns `NFST_STRING_TABLE_FULL` for new
+// strings. To add strings again, thaw the table with `nfst_grow()`, which
+// needs at least the size the table had before it was frozen. Symbols are
+// not changed by freezing or thawing.
+//
+// ## Dense indices
+//
+// Symbols are offsets into the string data, so they are sparse and can't be
+// used to index arrays. If the table is created with the `NFST_DENSE_INDEX`
+// flag, each string also gets a *dense index*: the strings are numbered
+// `0, 1, ..., count-1` in the order they were added, and
+// `nfst_symbol_to_index()` and `nfst_index_to_symbol()` convert between the
+// two in O(1). You can use the index to store per-string data in flat
+// arrays. The empty string doesn't have an index. This costs eight extra
+// bytes per string.
+//
+// ## Building from a list
+//
+// If all the strings are known up front, `nfst_build()` builds a packed
+// table from them in one go. `nfst_build_bytes()` returns the exact size of
+// the result (if there are duplicates, the built table is a bit smaller),
+// so no growing or packing is needed and each string is hashed and copied
+// only once. Duplicates get the same symbol, just as with
+// `nfst_to_symbol()`. This is cheaper than adding the strings one by one
+// when a lot of small tables are made, for example one per package in a
+// content build.
+//
+// ## Prefix queries
+//
+// If the table is created with the `NFST_PREFIX_INDEX` flag, `nfst_pack()`
+// (and `nfst_freeze()`) also stores an array of all the symbols, sorted by
+// their strings, in the buffer. With that, `nfst_prefix_range()` finds all
+// the strings that start with a certain prefix in O(log n + k). This is
+// useful for autocompletion and for finding all resources in a directory.
+// The index is dropped when strings are added to the table and rebuilt by
+// the next pack.
+//
+// ## Removing strings
+//
+// `nfst_remove()` removes a string from the table. The owner of the table
+// is responsible for knowing that the string is no longer referenced. The
+// hash slot of the string is replaced by a *tombstone* and the string data
+// stays in place, so removing is O(1) and the other symbols don't change.
+// Until the table is compacted, removed strings still use memory and are
+// included in `nfst_count()`.
+//
+// `nfst_compact()` moves the remaining strings together and returns the
+// new symbols as a remap table, sorted by old symbol, which
+// `nfst_remap_symbol()` looks symbols up in. The owner then rewrites its
+// references with one sweep over its data. Compacting renumbers dense
+// indices too, in the same order.
+//
+// Tables with removed strings can't be frozen or compressed and don't get
+// a prefix index, compact them first. Strings must not be removed while
+// reader threads are active.
+//
+// ## Compressed tables
+//
+// Tables of file paths and dotted identifiers have long shared prefixes.
+// `nfst_compress()` turns a finished table into a *compressed* table that
+// stores the strings sorted and front coded: in each bucket of
+// FRONT_CODING_BUCKET_SIZE strings, the first string is stored in full and
+// the others as the number of characters they share with the previous
+// string and the remaining characters. There is no hash table, lookups
+// binary search the first strings of the buckets and then scan one bucket.
+//
+// Compressing changes the symbols. In a compressed table, the symbol of a
+// string is its position in sorted order plus one, so symbols are dense and
+// `nfst_symbol_to_index()` works without the `NFST_DENSE_INDEX` flag. The
+// strings aren't stored as whole zero terminated strings, so
+// `nfst_to_string()` can't be used, decode them with `nfst_to_string_buf()`
+// instead. Compressed tables are read-only, they can't be grown, packed or
+// frozen. Compressing is meant to be the last step before a table is saved
+// and any data that refers to the strings should be written with the new
+// symbols.
+//
+// ## Saving and loading
+//
+// `nfst_save()` writes a table to a *file image*, which is the table
+// prefixed with a small header that identifies the format and holds a
+// checksum. `nfst_open_mapped()` validates such an image, for example a
+// read-only memory mapped file, and returns the table inside it. The
+// returned table is used directly from the image, without copying. Only
+// the functions that take a `const` table can be used on it, to add
+// strings, open it with `nfst_growing_open()` instead, which copies the
+// table to a writable buffer when the first new string is added.
+//
+// File images are not portable between platforms with different
+// endianness, `nfst_open_mapped()` rejects them.
+//
+// A table embedded in some other format without a file header can be
+// checked with `nfst_validate()`.
+//
+// ## Legacy tables
+//
+// Tables saved by versions of this file from before the format was
+// versioned can still be used. Lookups work directly on them, but
+// `nfst_to_symbol()` returns `NFST_STRING_TABLE_FULL` for new strings.
+// Growing such a table with `nfst_grow()` or `nfst_grow_copy()` upgrades
+// it to the current format, after which strings can be added as usual.
+// The upgrade changes the symbols of the strings that were in the table,
+// so symbols you have stored must be looked up again. (The strings keep
+// their order, so `nfst_next_symbol()` visits them as before.) If `bytes`
+// is too small for the upgraded table, the table stays in the legacy
+// format, and `nfst_to_symbol()` keeps returning `NFST_STRING_TABLE_FULL`
+// until it has been grown enough. Legacy tables can't be packed, frozen or
+// compressed.
+//
+// ## Growing tables
+//
+// If you don't want to manage the memory yourself, you can create a
+// *growing* string table with `nfst_make()`. It owns its buffer and grows
+// it with the supplied allocator according to a `nfst_GrowthPolicy`.
+//
+// Growing is incremental: when the table grows, the strings are copied to
+// the new buffer, but the hash slots are moved over a few at a time on the
+// following calls to `nfst_growing_to_symbol()`. Until that is done,
+// lookups check both the new and the old hash table. This avoids a long
+// stall when a big table grows. Growing tables don't support concurrent
+// readers.
+//
+// ## Wide tables
+//
+// Sizes and offsets in a table are `int`, so a single table is limited to
+// NFST_MAX_TABLE_BYTES (2 GB). For bigger string sets, use a *wide* table
+// created with `nfst_wide_make()`. It splits the strings between
+// NFST_WIDE_PARTITIONS growing tables by their hash and uses `long long`
+// symbols, with the partition in the upper 32 bits and the symbol in the
+// partition in the lower. This scales to hundreds of GB. Since each
+// partition grows on its own, growing only ever copies one partition, so
+// the memory overhead of growing is small too. The partitions are regular
+// tables that can be packed and saved one by one, see
+// `nfst_wide_partition()`.
+//
+// ## Statistics
+//
+// `nfst_stats()` reports how full a table is, how long the probe sequences
+// of its strings are and where its memory goes. The average string length
+// it reports is a good `average_strlen` argument for `nfst_init()` for
+// tables with similar content.
+//
+// If the file is compiled with `NFST_COUNTERS` defined, it also counts
+// lookups, inserts, full tables and rebuilds for all tables together.
+// `nfst_counters()` returns the counts. The counters are updated with
+// atomic adds, so they work with concurrent readers, but they cost some
+// performance and are off by default.
+//
 // See example code in the **Unit Test** section below.
 
 // ## Interface
 
 #define NFST_STRING_TABLE_FULL (-1)
 
+// The maximum size of a string table.
+#define NFST_MAX_TABLE_BYTES (0x7ffffff0)
+
+// The number of partitions of a wide table.
+#define NFST_WIDE_PARTITIONS (256)
+
+// Flags for `nfst_init_with_flags()`.
+#define NFST_DENSE_INDEX (1)
+#define NFST_PREFIX_INDEX (2)
+
+// Hash function flags for `nfst_init_with_flags()`. At most one of these
+// can be used.
+#define NFST_HASH_DEFAULT (0)
+#define NFST_HASH_LUA (1 << 2)
+#define NFST_HASH_WYHASH (2 << 2)
+#define NFST_HASH_CRC32C (3 << 2)
+#define NFST_HASH_MASK (3 << 2)
+
+// Folding flags for `nfst_init_with_flags()`, see **Folding** above.
+#define NFST_FOLD_CASE (1 << 4)
+#define NFST_FOLD_PATH (1 << 5)
+
+// Size of the probe length histogram in `nfst_Stats`.
+#define NFST_PROBE_HISTOGRAM_SIZE (8)
+
 struct nfst_StringTable;
 
+// Statistics returned by `nfst_stats()`.
+struct nfst_Stats
+{
+	// Number of strings in the table, not counting removed strings.
+	int count;
+
+	// Number of removed strings that still take up space in the table.
+	int removed;
+
+	// Number of hash slots and the fraction of them that is used. For frozen
+	// tables this is the size of the perfect hash. Compressed tables have no
+	// hash slots.
+	int num_hash_slots;
+	float load_factor;
+	int uses_16_bit_hash_slots;
+	int frozen;
+	int compressed;
+
+	// Average length of the strings, not counting the terminating zero.
+	float average_string_length;
+
+	// `probe_histogram[i]` is the number of strings that are found after
+	// probing `i + 1` groups of slots, the last entry also counts all longer
+	// probes. Frozen tables always find strings with the first probe.
+	// Compressed and legacy tables have no probe statistics.
+	int probe_histogram[NFST_PROBE_HISTOGRAM_SIZE];
+	int max_probe_length;
+
+	// Where the `allocated_bytes` of the table go: the header, the hash
+	// slots and tags (and displacements of frozen tables), the string data
+	// (of which `record_header_bytes` are the record headers rather than
+	// characters), the dense and prefix index arrays (or the bucket
+	// directory of compressed tables) and free space.
+	int allocated_bytes;
+	int header_bytes;
+	int slot_bytes;
+	int string_bytes;
+	int record_header_bytes;
+	int index_bytes;
+	int free_bytes;
+};
+
+#if defined(NFST_COUNTERS)
+// Operation counts for all tables, returned by `nfst_counters()`.
+struct nfst_Counters
+{
+	// Hash table lookups. A growing table that is migrating its slots looks
+	// in both its old and new hash table.
+	long long lookups;
+
+	// Strings added to a table.
+	long long inserts;
+
+	// Strings that couldn't be added because the table was full.
+	long long full;
+
+	// Tables grown with `nfst_grow()`, `nfst_grow_copy()` or by a growing
+	// table.
+	long long grows;
+
+	// Hash tables rebuilt from the string data, by growing, packing and
+	// compacting.
+	long long rebuilds;
+};
+#endif
+
+// An entry of the remap table returned by `nfst_compact()`.
+struct nfst_SymbolRemap
+{
+	int old_symbol;
+	int new_symbol;
+};
+
 void nfst_init(struct nfst_StringTable *st, int bytes, int average_string_size);
+void nfst_init_with_flags(struct nfst_StringTable *st, int bytes, int average_string_size, unsigned flags);
 void nfst_grow(struct nfst_StringTable *st, int bytes);
+void nfst_grow_copy(struct nfst_StringTable *dst, const struct nfst_StringTable *src, int bytes);
 int  nfst_pack(struct nfst_StringTable *st);
+int nfst_build_bytes(const char **strs, const int *lengths, int n, unsigned flags);
+int nfst_build(struct nfst_StringTable *st, int bytes, const char **strs, const int *lengths, int n, unsigned flags, int *syms);
 int nfst_to_symbol(struct nfst_StringTable *st, const char *s);
 int nfst_to_symbol_const(const struct nfst_StringTable *st, const char *s);
-const char *nfst_to_string(struct nfst_StringTable *, int symbol);
+int nfst_to_symbols(struct nfst_StringTable *st, const char **strs, const int *lengths, int n, int *syms);
+const char *nfst_to_string(const struct nfst_StringTable *, int symbol);
+int nfst_to_string_buf(const struct nfst_StringTable *st, int symbol, char *buffer, int size);
+int nfst_to_string_len(const struct nfst_StringTable *st, int symbol);
+int nfst_next_symbol(struct nfst_StringTable *st, int symbol);
+int nfst_count(const struct nfst_StringTable *st);
+int nfst_symbol_to_index(struct nfst_StringTable *st, int symbol);
+int nfst_index_to_symbol(struct nfst_StringTable *st, int index);
+int nfst_has_prefix_index(const struct nfst_StringTable *st);
+int nfst_prefix_range(struct nfst_StringTable *st, const char *prefix, int *first);
+int nfst_sorted_symbol(struct nfst_StringTable *st, int i);
+int nfst_freeze_scratch_bytes(const struct nfst_StringTable *st);
+int nfst_freeze(struct nfst_StringTable *st, void *scratch, int scratch_bytes);
+int nfst_remove(struct nfst_StringTable *st, int symbol);
+int nfst_compact(struct nfst_StringTable *st, struct nfst_SymbolRemap *remap);
+int nfst_remap_symbol(const struct nfst_SymbolRemap *remap, int n, int old_symbol);
+int nfst_compress_scratch_bytes(const struct nfst_StringTable *st);
+int nfst_compress(struct nfst_StringTable *st, void *scratch, int scratch_bytes);
+void nfst_stats(const struct nfst_StringTable *st, struct nfst_Stats *stats);
+#if defined(NFST_COUNTERS)
+void nfst_counters(struct nfst_Counters *counters);
+void nfst_reset_counters(void);
+#endif
+int nfst_save_bytes(const struct nfst_StringTable *st);
+void nfst_save(const struct nfst_StringTable *st, void *buffer);
+const struct nfst_StringTable *nfst_open_mapped(const void *data, int bytes, int verify_checksum);
+int nfst_validate(const void *data, int bytes);
+
+typedef void * (*nfst_realloc) (void *ud, void *ptr, int osize, int nsize, const char *file, int line);
+
+struct nfst_GrowthPolicy
+{
+	// When the table is full, it grows to `factor` times its current size,
+	// but by at least `min_grow_bytes`.
+	float factor;
+	int min_grow_bytes;
+
+	// The number of old hash slots to migrate on each call to
+	// `nfst_growing_to_symbol()`. If 0, all slots are migrated when the table
+	// grows.
+	int migrate_slots;
+};
+
+struct nfst_GrowingStringTable;
+
+struct nfst_GrowingStringTable *nfst_make(nfst_realloc realloc, void *ud, int bytes, int average_strlen,
+	const struct nfst_GrowthPolicy *policy);
+struct nfst_GrowingStringTable *nfst_growing_open(nfst_realloc realloc, void *ud,
+	const struct nfst_StringTable *st, const struct nfst_GrowthPolicy *policy);
+void nfst_free(struct nfst_GrowingStringTable *gst);
+int nfst_growing_to_symbol(struct nfst_GrowingStringTable *gst, const char *s);
+int nfst_growing_to_symbol_const(struct nfst_GrowingStringTable *gst, const char *s);
+const char *nfst_growing_to_string(struct nfst_GrowingStringTable *gst, int symbol);
+struct nfst_StringTable *nfst_growing_table(struct nfst_GrowingStringTable *gst);
+
+struct nfst_WideStringTable;
+
+struct nfst_WideStringTable *nfst_wide_make(nfst_realloc realloc, void *ud, long long bytes, int average_strlen);
+void nfst_wide_free(struct nfst_WideStringTable *wst);
+long long nfst_wide_to_symbol(struct nfst_WideStringTable *wst, const char *s);
+long long nfst_wide_to_symbol_const(struct nfst_WideStringTable *wst, const char *s);
+const char *nfst_wide_to_string(struct nfst_WideStringTable *wst, long long symbol);
+long long nfst_wide_count(struct nfst_WideStringTable *wst);
+long long nfst_wide_bytes(struct nfst_WideStringTable *wst);
+struct nfst_StringTable *nfst_wide_partition(struct nfst_WideStringTable *wst, int i);
 
 // ## Implementation
 
 #include <assert.h>
 #include <memory.h>
 #include <stdint.h>
+#include <string.h>
+
+// `string_length()` reads past the end of strings, which memory checkers
+// report. With AddressSanitizer or MemorySanitizer, or if NFST_NO_OVERREAD
+// is defined (use that with Valgrind), it uses `strlen()` instead.
+#if defined(__SANITIZE_ADDRESS__)
+	#define NFST_NO_OVERREAD
+#elif defined(__has_feature)
+	#if __has_feature(address_sanitizer) || __has_feature(memory_sanitizer)
+		#define NFST_NO_OVERREAD
+	#endif
+#endif
+
+#if defined(__AVX2__)
+	#define USE_AVX2
+	#include <immintrin.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define USE_SSE2
+	#include <emmintrin.h>
+#endif
+
+#if defined(__SSE4_2__)
+	#define USE_SSE42
+	#include <nmmintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+	#include <intrin.h>
+#endif
+
+// The hash table is divided into groups of GROUP_SIZE slots. A lookup
+// compares the tags of a whole group in one go and only moves on to the
+// next group if the group has no empty slots.
+#define GROUP_SIZE (16)
+
+// Because whole groups are probed at once, the table can be filled up to a
+// load factor of 7/8 before probe sequences get long. HASH_FACTOR is the
+// resulting number of slots per string.
+#define HASH_FACTOR (8.0f/7.0f)
+
+// Each string is stored in the string data block as a *record*: the 32 bit
+// hash of the string, its 16 bit length and then the zero terminated
+// characters. The symbol of the string is the offset of the characters, so
+// the header sits at `symbol - RECORD_HEADER_BYTES`. Tables with a dense
+// index store the 32 bit index of the string before the header.
+//
+// Strings of LONG_STRING_LENGTH characters or more store LONG_STRING_LENGTH
+// as their length. For those, the rest of the length is found by scanning.
+#define RECORD_HEADER_BYTES ((int)(sizeof(uint32_t) + sizeof(uint16_t)))
+#define LONG_STRING_LENGTH (UINT16_MAX)
+
+// The format version is stored in the top bits of `flags`. Tables created
+// before the format was versioned have 0 there (the field used to hold a
+// bool), see the **Legacy tables** section below.
+#define FORMAT_VERSION (2)
+#define VERSION_SHIFT (24)
+
+// Set in `flags` if the hash table uses 16 bit slots.
+#define FLAG_16_BIT_HASH_SLOTS (1u << 0)
+
+// Set in `flags` if the table is frozen, see the **Frozen tables** section
+// below.
+#define FLAG_FROZEN (1u << 1)
+
+// Set in `flags` if the table has a dense index. The index array is stored
+// at the end of the buffer and grows down towards the string data.
+#define FLAG_DENSE_INDEX (1u << 2)
+
+// Set in `flags` if `nfst_pack()` should build a prefix index. The second
+// flag is set when the index has been built and is up to date. The sorted
+// symbol array is stored (4 byte aligned) after the string data.
+#define FLAG_PREFIX_INDEX (1u << 3)
+#define FLAG_PREFIX_INDEX_BUILT (1u << 4)
+
+// Set in `flags` if the table is compressed, see the **Compressed tables**
+// section below. For compressed tables, `num_hash_slots` holds the number
+// of front coding buckets and the bucket directory is stored (4 byte
+// aligned) after the string data.
+#define FLAG_COMPRESSED (1u << 5)
+
+// Set in `flags` if strings have been removed since the table was last
+// compacted.
+#define FLAG_HAS_REMOVED (1u << 6)
+
+// The hash function of the table is stored in these bits of `flags`, as
+// one of the HASH_* values.
+#define HASH_SHIFT (8)
+#define HASH_MASK (3u << HASH_SHIFT)
 
-#define HASH_FACTOR (2.0f)
+// Set in `flags` if the table folds case or paths, see the **Folding**
+// section above.
+#define FLAG_FOLD_CASE (1u << 7)
+#define FLAG_FOLD_PATH (1u << 10)
+#define FLAG_FOLD_MASK (FLAG_FOLD_CASE | FLAG_FOLD_PATH)
 
-// We must have room for at leat one hash slot and one string
-#define MIN_SIZE (sizeof(struct nfst_StringTable) + 1*(uint32_t) + 4)
+#define HASH_DEFAULT (0)
+#define HASH_LUA (1)
+#define HASH_WYHASH (2)
+#define HASH_CRC32C (3)
+
+// The tag of a slot whose string has been removed. It doesn't match any
+// hash tag (those have the high bit set), but isn't empty either, so
+// probing continues past it.
+#define TOMBSTONE_TAG (0x01)
+
+// Average number of strings per bucket of the perfect hash of a frozen
+// table. Larger buckets use less memory for displacements, but take longer
+// to freeze.
+#define CHD_BUCKET_SIZE (4)
+
+// The largest second displacement that `nfst_freeze()` tries before giving
+// up.
+#define CHD_MAX_D1 (256)
+
+// Number of strings per bucket of a compressed table. Larger buckets
+// compress better, but a lookup has to scan a whole bucket.
+#define FRONT_CODING_BUCKET_SIZE (16)
+
+// Identifies file images written by `nfst_save()`. FILE_ENDIAN_MARK reads
+// as a different value on a platform with the other endianness. The file
+// version is independent of the table's FORMAT_VERSION, it describes the
+// layout of the file header.
+#define FILE_MAGIC (0x5453464eu)
+#define FILE_ENDIAN_MARK (0x01020304u)
+#define FILE_VERSION (1)
+
+// We must have room for at least one group of hash slots and the empty
+// string. (A table this small always uses 16 bit slots.)
+#define MIN_SIZE (sizeof(struct nfst_StringTable) + GROUP_SIZE * (sizeof(uint16_t) + 1) + 1)
+
+// Number of strings that `nfst_to_symbols()` hashes and prefetches ahead of
+// resolving them. This should be enough to cover the memory latency, but
+// small enough that the prefetched lines are still in the cache when they
+// are used.
+#define BATCH_SIZE (16)
 
 #define MAX(a,b) ((a) > (b) ? (a) : (b))
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+
+// Publication of new slots to concurrent readers. Tags are accessed
+// atomically as 32 bit words (they are only 4 byte aligned). The writer
+// stores the word with a new tag (`store_tag()`) with release semantics
+// after everything else has been written. Readers load the words of a
+// group (`load_group()`) with acquire semantics before looking at the
+// slots and the string data.
+//
+// With GCC and clang, the loads are acquire loads rather than relaxed
+// loads followed by a fence, since ThreadSanitizer doesn't understand
+// fences. On x86 and x64 both compile to plain loads.
+#if defined(_MSC_VER) && defined(_M_ARM64)
+	// volatile accesses have no ordering on ARM64, so use barriers.
+	#define STORE_TAGS_32(p, v)		(__dmb(_ARM64_BARRIER_ISH), __iso_volatile_store32((volatile __int32 *)(p), (__int32)(v)))
+	#define LOAD_TAGS_32(p)			((uint32_t)__iso_volatile_load32((const volatile __int32 *)(p)))
+	#define TAGS_ACQUIRE_FENCE()	__dmb(_ARM64_BARRIER_ISH)
+#elif defined(_MSC_VER)
+	// x86 and x64 loads and stores have acquire and release semantics, the
+	// barriers only stop the compiler from reordering.
+	#define STORE_TAGS_32(p, v)		(_ReadWriteBarrier(), *(volatile uint32_t *)(p) = (v))
+	#define LOAD_TAGS_32(p)			(*(const volatile uint32_t *)(p))
+	#define TAGS_ACQUIRE_FENCE()	_ReadWriteBarrier()
+#else
+	#define STORE_TAGS_32(p, v)		__atomic_store_n((uint32_t *)(p), (v), __ATOMIC_RELEASE)
+	#define LOAD_TAGS_32(p)			__atomic_load_n((const uint32_t *)(p), __ATOMIC_ACQUIRE)
+	#define TAGS_ACQUIRE_FENCE()	((void)0)
+#endif
+
+// Operation counters, see **Statistics** above.
+#if defined(NFST_COUNTERS)
+	static struct nfst_Counters counters;
+	#if defined(_MSC_VER)
+		#include <intrin.h>
+		#define COUNT(name)			_InterlockedIncrement64(&counters.name)
+		#define LOAD_COUNT(name)	(*(volatile long long *)&counters.name)
+		#define RESET_COUNT(name)	_InterlockedExchange64(&counters.name, 0)
+	#else
+		#define COUNT(name)			__atomic_fetch_add(&counters.name, 1, __ATOMIC_RELAXED)
+		#define LOAD_COUNT(name)	__atomic_load_n(&counters.name, __ATOMIC_RELAXED)
+		#define RESET_COUNT(name)	__atomic_store_n(&counters.name, 0, __ATOMIC_RELAXED)
+	#endif
+#else
+	#define COUNT(name)				((void)0)
+#endif
+
+#if defined(_MSC_VER)
+	#include <xmmintrin.h>
+	#define PREFETCH(p)				_mm_prefetch((const char *)(p), _MM_HINT_T0)
+#else
+	#define PREFETCH(p)				__builtin_prefetch(p)
+#endif
 
 struct HashAndLength
 {
@@ -45,15 +600,101 @@ struct HashAndLength
 };
 
 static inline struct HashAndLength hash_and_length(const char *start);
+static inline int string_length(const char *start);
+static inline int lowest_bit(unsigned mask);
+static inline uint32_t hash_bytes(const char *s, int n);
+static inline uint64_t hash_bytes_64(const char *s, int n);
+static inline uint64_t load_partial_64(const char *p, int n);
+static inline uint8_t hash_tag(uint32_t hash);
+static inline uint32_t table_hash(const struct nfst_StringTable *st, const char *s, int n);
+static inline struct HashAndLength table_hash_and_length(const struct nfst_StringTable *st, const char *s);
+static inline uint32_t legacy_hash(const char *s, int length);
+static inline uint64_t table_hash_64(const struct nfst_StringTable *st, const char *s, int n);
+static inline int strings_equal(const struct nfst_StringTable *st, const char *s, int length, const char *chars);
+static uint64_t fold_hash_64(unsigned fold, const char *s, int n);
+static int fold_equal(unsigned fold, const char *a, int a_length, const char *b, int b_length);
+static inline int round_to_groups(float num_slots);
+static inline int uses_16_bit_hash_slots(const struct nfst_StringTable *st);
+static inline void set_16_bit_hash_slots(struct nfst_StringTable *st, int use);
+static inline int is_legacy(const struct nfst_StringTable *st);
+static int legacy_to_symbol_const(struct nfst_StringTable *st, const char *s, int length);
+static inline char *legacy_strings(struct nfst_StringTable *st);
+static int legacy_upgrade(struct nfst_StringTable *dst, const struct nfst_StringTable *src, int bytes);
+static inline int max_strings(int num_slots);
+// The tags of a group of hash slots, as loaded by `load_group()`.
+#if defined(USE_SSE2)
+	typedef __m128i GroupTags;
+#else
+	typedef struct {uint8_t tag[GROUP_SIZE];} GroupTags;
+#endif
+
+static inline GroupTags load_group(const uint8_t *group);
+static inline void store_tag(uint8_t *tags, int i, uint8_t tag);
+static inline unsigned match_group(GroupTags group, uint8_t tag);
+static inline int is_frozen(const struct nfst_StringTable *st);
+static inline int has_dense_index(const struct nfst_StringTable *st);
+static inline int record_header_bytes(const struct nfst_StringTable *st);
+static inline int index_symbol(struct nfst_StringTable *st, int index);
+static inline void set_index_symbol(struct nfst_StringTable *st, int index, int symbol);
+static inline int index_bytes_per_string(const struct nfst_StringTable *st);
+static inline int prefix_index_offset(struct nfst_StringTable *st);
+static inline uint32_t *prefix_index(struct nfst_StringTable *st);
+static void sort_symbols(const char *strs, uint32_t *a, int n);
+static void build_prefix_index(struct nfst_StringTable *st);
+static inline int chd_buckets(int num_slots);
+static inline int freeze_table_ints(int n);
+static inline int chd_bucket(uint64_t hash, int num_slots);
+static inline void chd_hashes(uint64_t hash, int num_slots, uint32_t *f1, uint32_t *f2);
+static inline int chd_slot(uint32_t f1, uint32_t f2, uint32_t displacement, int num_slots);
+static int frozen_find(struct nfst_StringTable *st, const char *s, int length);
+static inline int is_compressed(const struct nfst_StringTable *st);
+static inline uint32_t *bucket_directory(struct nfst_StringTable *st);
+static int compressed_find(struct nfst_StringTable *st, const char *s, int length);
+static int compressed_decode(struct nfst_StringTable *st, int symbol, char *buffer, int size);
+static inline int write_varint(char *p, unsigned v);
+static inline int is_removed(const char *chars);
+static inline uint32_t *displacements(struct nfst_StringTable *st);
 static inline uint16_t *hashtable_16(struct nfst_StringTable *st);
 static inline uint32_t *hashtable_32(struct nfst_StringTable *st);
+static inline uint8_t *tags(struct nfst_StringTable *st);
 static inline char *strings(struct nfst_StringTable *st);
 static inline int available_string_bytes(struct nfst_StringTable *st);
+static inline int slot_symbol(struct nfst_StringTable *st, int i);
+static inline void set_slot(struct nfst_StringTable *st, int i, uint8_t tag, int symbol);
+static inline int record_length(const char *chars);
+static inline void write_record(char *chars, const char *s, struct HashAndLength hl);
+static inline int find(struct nfst_StringTable *st, const char *s, struct HashAndLength hl, int *slot);
+static inline int insert(struct nfst_StringTable *st, const char *s, struct HashAndLength hl);
+static inline int add(struct nfst_StringTable *st, const char *s, struct HashAndLength hl, int slot);
+static inline void place(struct nfst_StringTable *st, uint32_t hash, int symbol);
+static struct nfst_GrowingStringTable *growing_alloc(nfst_realloc realloc, void *ud,
+	const struct nfst_GrowthPolicy *policy);
+static inline int growing_next_size(struct nfst_GrowingStringTable *gst, int bytes);
+static void growing_promote(struct nfst_GrowingStringTable *gst);
+static int growing_grow(struct nfst_GrowingStringTable *gst);
+static int growing_to_symbol(struct nfst_GrowingStringTable *gst, const char *s, struct HashAndLength hl);
+static int growing_find(struct nfst_GrowingStringTable *gst, const char *s, struct HashAndLength hl);
+static inline int wide_partition(const char *s, struct HashAndLength *hl);
+static void growing_migrate(struct nfst_GrowingStringTable *gst, int num_slots);
+static void grow_layout(struct nfst_StringTable *st, int bytes);
+static void packed_layout(struct nfst_StringTable *st);
+static int packed_bytes(struct nfst_StringTable *st);
+static long long layout_bytes(const struct nfst_StringTable *st);
+static void build_layout(struct nfst_StringTable *st, const char **strs, const int *lengths, int n, unsigned flags);
+static inline int append_record(struct nfst_StringTable *st, const char *s, struct HashAndLength hl, int slot);
+static unsigned table_flags(unsigned flags);
 static void rebuild_hash_table(struct nfst_StringTable *st);
 
 // Structure representing a string table. The data for the table is stored
 // directly after this header in memory and consists of a hash table
 // followed by a string data block.
+//
+// The hash table is made up of two parallel arrays. The first holds the
+// symbols (16 or 32 bit). The second holds one *tag* byte per slot, with
+// the high bit set for used slots and the top seven bits of the string's
+// hash in the rest. Probing compares the tags of a group of slots with a
+// single SIMD compare, so most mismatching slots are rejected without
+// touching the string data.
 struct nfst_StringTable
 {
 	// The total size of the allocated data, including this header.
@@ -62,36 +703,101 @@ struct nfst_StringTable
     // The number of strings in the table.
     int count;
 
-    // Does the hash table use 16 bit slots
-    int uses_16_bit_hash_slots;
+    // Format version and flags (`FLAG_*`) of the table.
+    unsigned flags;
 
-    // Total number of slots in the hash table.
+    // Total number of slots in the hash table. This is always a power of two
+    // number of groups, so that we can probe with masks rather than modulo.
+    // For frozen tables, this is the number of slots of the perfect hash.
     int num_hash_slots;
 
     // The current number of bytes used for string data.
     int string_bytes;
 };
 
+// Header of the file images written by `nfst_save()`. The table follows
+// directly after the header.
+struct FileHeader
+{
+	uint32_t magic;
+	uint32_t endian_mark;
+	uint32_t version;
+
+	// Size of the table in bytes.
+	uint32_t table_bytes;
+
+	// `hash_bytes_64()` of the table.
+	uint64_t checksum;
+};
+
+// A string table that owns its buffer, see **Growing tables** above.
+struct nfst_GrowingStringTable
+{
+	nfst_realloc realloc;
+	void *realloc_user_data;
+	struct nfst_GrowthPolicy policy;
+
+	// The current table. All strings are stored here.
+	struct nfst_StringTable *st;
+
+	// The table that `st` was grown from, while its hash slots are being
+	// migrated to `st`. Otherwise NULL.
+	struct nfst_StringTable *old;
+
+	// True if `st` belongs to someone else (typically a memory mapped file)
+	// and must be copied before strings are added to it.
+	int read_only;
+
+	// The number of slots in `old` that have been migrated.
+	int migrated;
+};
+
+// A string table split into partitions, see **Wide tables** above.
+struct nfst_WideStringTable
+{
+	nfst_realloc realloc;
+	void *realloc_user_data;
+	struct nfst_GrowingStringTable *partitions[NFST_WIDE_PARTITIONS];
+};
+
 // Initializes an empty string table in the specified memory area. `bytes` is
 // the total ammount of memory allocated at the pointer and `average_strlen` is
 // the expected average length of the strings that will be added.
 void nfst_init(struct nfst_StringTable *st, int bytes, int average_strlen)
+{
+	nfst_init_with_flags(st, bytes, average_strlen, 0);
+}
+
+// As `nfst_init()`, but creates a table with the specified `flags`
+// (`NFST_DENSE_INDEX`, `NFST_PREFIX_INDEX`, `NFST_FOLD_CASE`,
+// `NFST_FOLD_PATH` and one of the `NFST_HASH_*` flags).
+void nfst_init_with_flags(struct nfst_StringTable *st, int bytes, int average_strlen, unsigned flags)
 {
 	assert(bytes >= MIN_SIZE);
 
 	st->allocated_bytes = bytes;
 	st->count = 0;
-	
-	float bytes_per_string = average_strlen + 1 + sizeof(uint16_t) * HASH_FACTOR;
+	st->flags = table_flags(flags);
+
+	const int index_bytes = index_bytes_per_string(st) +
+		(has_dense_index(st) ? sizeof(uint32_t) : 0);
+	float bytes_per_string = average_strlen + 1 + RECORD_HEADER_BYTES + index_bytes +
+		(sizeof(uint16_t) + 1) * HASH_FACTOR;
 	float num_strings = (bytes - sizeof(*st)) / bytes_per_string;
-	st->num_hash_slots = MAX(num_strings * HASH_FACTOR, 1);
+	st->num_hash_slots = round_to_groups(num_strings * HASH_FACTOR);
+
+	int bytes_for_strings_32 = bytes - sizeof(*st) - (sizeof(uint32_t) + 1) * st->num_hash_slots;
+	set_16_bit_hash_slots(st, bytes_for_strings_32 <= 64 * 1024);
 
-	int bytes_for_strings_16 = bytes - sizeof(*st) - sizeof(uint16_t) * st->num_hash_slots;
-	int bytes_for_strings_32 = bytes - sizeof(*st) - sizeof(uint32_t) * st->num_hash_slots;
-	st->uses_16_bit_hash_slots = bytes_for_strings_32 <= 64 * 1024;
+	// With 32 bit slots, the slots take more space, so fewer strings fit.
+	if (!uses_16_bit_hash_slots(st)) {
+		bytes_per_string = average_strlen + 1 + RECORD_HEADER_BYTES + index_bytes +
+			(sizeof(uint32_t) + 1) * HASH_FACTOR;
+		num_strings = (bytes - sizeof(*st)) / bytes_per_string;
+		st->num_hash_slots = round_to_groups(num_strings * HASH_FACTOR);
+	}
 
-	memset(hashtable_16(st), 0, st->num_hash_slots * 
-		(st->uses_16_bit_hash_slots ? sizeof(uint16_t) : sizeof(uint32_t)));
+	memset(tags(st), 0, st->num_hash_slots);
 	
 	// Empty string is stored at index 0. This way, we can use 0 as a marker for
 	// empty hash slots.
@@ -101,48 +807,135 @@ void nfst_init(struct nfst_StringTable *st, int bytes, int average_strlen)
 
 // Grows the string table to size `bytes`. You must make sure that this many
 // bytes are available in the pointer `st` (typically by calling realloc before
-// calling this function).
+// calling this function). Growing a frozen table thaws it. Growing a legacy
+// table upgrades it, see **Legacy tables** above.
 void nfst_grow(struct nfst_StringTable *st, int bytes)
 {
 	assert(bytes >= st->allocated_bytes);
+	if (is_legacy(st)) {
+		if (!legacy_upgrade(st, st, bytes))
+			st->allocated_bytes = bytes;
+		return;
+	}
+	assert(!is_compressed(st));
 
 	const char * const old_strings = strings(st);
-
-	st->allocated_bytes = bytes;
-
-	float average_strlen = st->count > 0 ? (float)st->string_bytes / (float)st->count : 15.0f;
-	float bytes_per_string = average_strlen + 1 + sizeof(uint16_t) * HASH_FACTOR;
-	float num_strings = (bytes - sizeof(*st)) / bytes_per_string;
-	st->num_hash_slots = MAX(num_strings * HASH_FACTOR, st->num_hash_slots);
-
-	int bytes_for_strings_16 = bytes - sizeof(*st) - sizeof(uint16_t) * st->num_hash_slots;
-	int bytes_for_strings_32 = bytes - sizeof(*st) - sizeof(uint32_t) * st->num_hash_slots;
-	st->uses_16_bit_hash_slots = bytes_for_strings_32 <= 64*1024;
-
+	grow_layout(st, bytes);
 	char * const new_strings = strings(st);
 	memmove(new_strings, old_strings, st->string_bytes);
 	rebuild_hash_table(st);
 }
 
+// As `nfst_grow()`, but writes the grown table to the `bytes` large buffer
+// at `dst` and leaves `src` untouched. This lets reader threads keep using
+// `src` while the table is grown, see **Threading** above.
+void nfst_grow_copy(struct nfst_StringTable *dst, const struct nfst_StringTable *src, int bytes)
+{
+	assert(bytes >= src->allocated_bytes);
+	if (is_legacy(src)) {
+		if (!legacy_upgrade(dst, src, bytes)) {
+			memcpy(dst, src, src->allocated_bytes);
+			dst->allocated_bytes = bytes;
+		}
+		return;
+	}
+	assert(!is_compressed(src));
+
+	memcpy(dst, src, sizeof(*dst));
+	grow_layout(dst, bytes);
+	memcpy(strings(dst), strings((struct nfst_StringTable *)src), src->string_bytes);
+	rebuild_hash_table(dst);
+}
+
 // Packs the string table so that it uses as little memory as possible while
 // still preserving the content. Updates st->allocated_bytes and returns the
 // new value. You can use that to shrink the buffer with realloc() if so desired.
+// Frozen tables can't be packed, since the packed layout with a regular hash
+// table is bigger than the frozen one. Thaw them with `nfst_grow()` first.
 int nfst_pack(struct nfst_StringTable *st)
 {
+	assert(!is_legacy(st) && !is_frozen(st) && !is_compressed(st));
 	const char *old_strings = strings(st);
 
-	st->num_hash_slots = st->count * HASH_FACTOR;
-	if (st->num_hash_slots < 1)
-		st->num_hash_slots = 1;
-	if (st->num_hash_slots < st->count + 1)
-		st->num_hash_slots = st->count + 1;
-	st->uses_16_bit_hash_slots = st->string_bytes <= 64*1024;
-
-	char * const new_strings = strings(st);
-	memmove(new_strings, old_strings, st->string_bytes);
+	packed_layout(st);
+	memmove(strings(st), old_strings, st->string_bytes);
+	st->allocated_bytes = packed_bytes(st);
 	rebuild_hash_table(st);
+	if ((st->flags & FLAG_PREFIX_INDEX) && !(st->flags & FLAG_HAS_REMOVED))
+		build_prefix_index(st);
 
-	st->allocated_bytes = (new_strings + st->string_bytes) - (char *)st;
+	return st->allocated_bytes;
+}
+
+// Returns the number of bytes `nfst_build()` needs to build a table with the
+// `flags` from the `n` strings in `strs`. The arguments have the same
+// meaning as for `nfst_build()`. This is the size of the packed table if
+// the strings are all different.
+int nfst_build_bytes(const char **strs, const int *lengths, int n, unsigned flags)
+{
+	struct nfst_StringTable st;
+	build_layout(&st, strs, lengths, n, flags);
+	return st.allocated_bytes;
+}
+
+// Builds a packed table with the `flags` (as for `nfst_init_with_flags()`)
+// from the `n` strings in `strs` in the `bytes` large buffer at `st`.
+// `bytes` must be at least `nfst_build_bytes()`. If `lengths` is not NULL
+// it holds the lengths of the strings, which then don't need to be zero
+// terminated. If `syms` is not NULL, the symbol of each string is stored
+// in it.
+//
+// Strings are added in order, so symbols and dense indices are the same as
+// if `nfst_to_symbol()` had been called on each string in turn. The hash
+// table is sized for `n` strings. If the list has a lot of duplicates,
+// `nfst_pack()` gives a smaller table afterwards.
+//
+// Returns the size of the table (`st->allocated_bytes`), which is less
+// than `nfst_build_bytes()` if there were duplicates.
+int nfst_build(struct nfst_StringTable *st, int bytes, const char **strs, const int *lengths, int n, unsigned flags, int *syms)
+{
+	build_layout(st, strs, lengths, n, flags);
+	assert(bytes >= st->allocated_bytes);
+
+	memset(tags(st), 0, st->num_hash_slots);
+	st->count = 0;
+	strings(st)[0] = 0;
+	st->string_bytes = 1;
+
+	// The layout has exactly enough room for all the strings, so they can be
+	// appended without the checks in `add()`.
+	for (int i=0; i<n; ++i) {
+		const char * const s = strs[i];
+		struct HashAndLength hl;
+		if (lengths) {
+			hl.length = lengths[i];
+			hl.hash = table_hash(st, s, hl.length);
+		} else
+			hl = table_hash_and_length(st, s);
+
+		int symbol = 0;
+		if (hl.length) {
+			int slot = 0;
+			symbol = find(st, s, hl, &slot);
+			if (!symbol)
+				symbol = append_record(st, s, hl, slot);
+		}
+		if (syms)
+			syms[i] = symbol;
+	}
+
+	// Duplicates leave space at the end of the string data. Shrink the table
+	// to fit, moving the dense index array down with the end of the buffer.
+	const int new_bytes = packed_bytes(st);
+	if (has_dense_index(st) && new_bytes < st->allocated_bytes) {
+		const int index_bytes = st->count * sizeof(uint32_t);
+		memmove((char *)st + new_bytes - index_bytes,
+			(char *)st + st->allocated_bytes - index_bytes, index_bytes);
+	}
+	st->allocated_bytes = new_bytes;
+
+	if (st->flags & FLAG_PREFIX_INDEX)
+		build_prefix_index(st);
 	return st->allocated_bytes;
 }
 
@@ -156,50 +949,12 @@ int nfst_to_symbol(struct nfst_StringTable *st, const char *s)
 	// "" maps to 0
 	if (!*s) return 0;
 
-	const struct HashAndLength hl = hash_and_length(s);
-	char * const strs = strings(st);
-		
-	int i = 0;
-	if (st->uses_16_bit_hash_slots) {
-		uint16_t * const ht = hashtable_16(st);
-		i = hl.hash % st->num_hash_slots;
-		while (ht[i]) {
-			if (strcmp(s, strs + ht[i]) == 0)
-				return ht[i];
-			i = (i+1) % st->num_hash_slots;
-		}
-	} else {
-		uint32_t * const ht = hashtable_32(st);
-		i = hl.hash % st->num_hash_slots;
-		while (ht[i]) {
-			if (strcmp(s, strs + ht[i]) == 0)
-				return ht[i];
-			i = (i+1) % st->num_hash_slots;
-		}
-	}
-
-	if (st->count + 1 >= st->num_hash_slots)
-		return NFST_STRING_TABLE_FULL;
-
-	if ( (float)st->num_hash_slots / (float)(st->count + 1) < HASH_FACTOR)
-		return NFST_STRING_TABLE_FULL;
-
-	char * const dest = strs + st->string_bytes;
-	if (st->string_bytes + hl.length + 1 > available_string_bytes(st))
-		return NFST_STRING_TABLE_FULL;
+	if (is_legacy(st))
+		return legacy_to_symbol_const(st, s, strlen(s));
+	if (is_frozen(st) || is_compressed(st))
+		return nfst_to_symbol_const(st, s);
 
-	const int symbol = st->string_bytes;
-	if (st->uses_16_bit_hash_slots) {
-		if (symbol > 64 * 1024)
-			return NFST_STRING_TABLE_FULL;
-		hashtable_16(st)[i] = symbol;
-	} else {
-		hashtable_32(st)[i] = symbol;
-	}
-	st->count++;
-	memcpy(dest, s, hl.length + 1);
-	st->string_bytes += hl.length + 1;
-	return symbol;
+	return insert(st, s, table_hash_and_length(st, s));
 }
 
 // As nfst_to_symbol(), but never adds the string to the table.
@@ -212,153 +967,3504 @@ int nfst_to_symbol_const(const struct nfst_StringTable *const_st, const char *s)
 	// "" maps to 0
 	if (!*s) return 0;
 
-	const struct HashAndLength hl = hash_and_length(s);
-	const char * const strs = strings(st);
-		
-	int i = 0;
-	if (st->uses_16_bit_hash_slots) {
-		const uint16_t * const ht = hashtable_16(st);
-		i = hl.hash % st->num_hash_slots;
-		while (ht[i]) {
-			if (strcmp(s, strs + ht[i]) == 0)
-				return ht[i];
-			i = (i+1) % st->num_hash_slots;
-		}
-	} else {
-		const uint32_t * const ht = hashtable_32(st);
-		i = hl.hash % st->num_hash_slots;
-		while (ht[i]) {
-			if (strcmp(s, strs + ht[i]) == 0)
-				return ht[i];
-			i = (i+1) % st->num_hash_slots;
+	if (is_legacy(st))
+		return legacy_to_symbol_const(st, s, strlen(s));
+
+	int found;
+	if (is_frozen(st))
+		found = frozen_find(st, s, string_length(s));
+	else if (is_compressed(st))
+		found = compressed_find(st, s, string_length(s));
+	else {
+		const struct HashAndLength hl = table_hash_and_length(st, s);
+		int i = 0;
+		found = find(st, s, hl, &i);
+	}
+	return found ? found : NFST_STRING_TABLE_FULL;
+}
+
+// Converts the `n` strings in `strs` to symbols, as if by calling
+// `nfst_to_symbol()` on each of them in turn, and stores the symbols in
+// `syms`. If `lengths` is not NULL it holds the lengths of the strings,
+// which then don't need to be zero terminated.
+//
+// The strings are processed in batches. All strings in a batch are hashed
+// and their hash slots and string data are prefetched before any of them is
+// looked up, so the cache misses of the batch overlap.
+//
+// Returns the number of strings that were converted. If the table gets
+// full, this is less than `n`. In that case, grow the table and call the
+// function again for the remaining strings:
+//
+// ```cpp
+// int done = 0;
+// while ((done += nfst_to_symbols(st, strs + done, NULL, n - done, syms + done)) < n)
+//     st = grow(st);
+// ```
+int nfst_to_symbols(struct nfst_StringTable *st, const char **strs, const int *lengths, int n, int *syms)
+{
+	if (is_legacy(st) || is_frozen(st) || is_compressed(st)) {
+		for (int i=0; i<n; ++i) {
+			const int length = lengths ? lengths[i] : (int)strlen(strs[i]);
+			int symbol = 0;
+			if (length && is_legacy(st))
+				symbol = legacy_to_symbol_const(st, strs[i], length);
+			else if (length && is_compressed(st))
+				symbol = compressed_find(st, strs[i], length);
+			else if (length)
+				symbol = frozen_find(st, strs[i], length);
+			if (length && symbol <= 0)
+				return i;
+			syms[i] = symbol;
 		}
+		return n;
 	}
 
-	return NFST_STRING_TABLE_FULL;
+	const uint8_t * const tg = tags(st);
+	const char * const strs_data = strings(st);
+	const int group_mask = st->num_hash_slots / GROUP_SIZE - 1;
+	struct HashAndLength hl[BATCH_SIZE];
+
+	for (int start = 0; start < n; start += BATCH_SIZE) {
+		const int count = MIN(BATCH_SIZE, n - start);
+
+		// Hash the strings and prefetch the groups they start probing at.
+		for (int j=0; j<count; ++j) {
+			const char * const s = strs[start + j];
+			if (lengths) {
+				hl[j].length = lengths[start + j];
+				hl[j].hash = table_hash(st, s, hl[j].length);
+			} else
+				hl[j] = table_hash_and_length(st, s);
+			const int first = (hl[j].hash & group_mask) * GROUP_SIZE;
+			PREFETCH(tg + first);
+			if (uses_16_bit_hash_slots(st))
+				PREFETCH(hashtable_16(st) + first);
+			else
+				PREFETCH(hashtable_32(st) + first);
+		}
+
+		// Prefetch the record of the first candidate in each group.
+		for (int j=0; j<count; ++j) {
+			const int first = (hl[j].hash & group_mask) * GROUP_SIZE;
+			const unsigned m = match_group(load_group(tg + first), hash_tag(hl[j].hash));
+			if (m)
+				PREFETCH(strs_data + slot_symbol(st, first + lowest_bit(m)) - RECORD_HEADER_BYTES);
+		}
+
+		// Look up or add the strings. This is done in order, so a string that
+		// occurs twice in the batch is found the second time.
+		for (int j=0; j<count; ++j) {
+			const int symbol = hl[j].length ? insert(st, strs[start + j], hl[j]) : 0;
+			if (symbol == NFST_STRING_TABLE_FULL)
+				return start + j;
+			syms[start + j] = symbol;
+		}
+	}
+	return n;
 }
 
 // Returns the string corresponding to the `symbol`. Calling this with a
 // value which is not a symbol returned by `nfst_to_symbol()` results in
-// undefined behavior.
-const char *nfst_to_string(struct nfst_StringTable *st, int symbol)
+// undefined behavior. Can't be used with compressed tables, use
+// `nfst_to_string_buf()` for those.
+const char *nfst_to_string(const struct nfst_StringTable *const_st, int symbol)
 {
+	struct nfst_StringTable *st = (struct nfst_StringTable *)const_st;
+
+	if (is_legacy(st))
+		return legacy_strings(st) + symbol;
+	assert(!is_compressed(st));
 	return strings(st) + symbol;
 }
 
-static inline struct HashAndLength hash_and_length(const char *start)
+// Copies the string corresponding to the `symbol` to the `size` bytes large
+// `buffer`. Like `snprintf()`, the string is truncated if it doesn't fit,
+// the buffer is always zero terminated (if `size > 0`) and the full length
+// of the string is returned. This works for all tables, but is mostly
+// needed for compressed tables, where it decodes the string.
+int nfst_to_string_buf(const struct nfst_StringTable *const_st, int symbol, char *buffer, int size)
 {
-	// The hash function is borrowed from Lua.
-	//
-	// Since we need to walk the entire string anyway for finding the
-	// length, this is a decent hash function.
+	struct nfst_StringTable *st = (struct nfst_StringTable *)const_st;
 
-	uint32_t h = 0;
-	const char *s = start;
-	for (; *s; ++s)
-		h = h ^ ((h<<5) + (h>>2) + (unsigned char)*s);
+	if (symbol == 0) {
+		if (size > 0)
+			buffer[0] = 0;
+		return 0;
+	}
+	if (is_compressed(st))
+		return compressed_decode(st, symbol, buffer, size);
 
-	struct HashAndLength result = {h, s-start};
-	return result;
+	const int length = nfst_to_string_len(st, symbol);
+	if (size > 0) {
+		const int n = MIN(length, size - 1);
+		memcpy(buffer, nfst_to_string(st, symbol), n);
+		buffer[n] = 0;
+	}
+	return length;
 }
 
-static inline uint16_t *hashtable_16(struct nfst_StringTable *st)
+// Returns the length of the string corresponding to the `symbol`. This
+// is read from the string table, so it is cheaper than calling `strlen()`
+// on the result of `nfst_to_string()`.
+int nfst_to_string_len(const struct nfst_StringTable *const_st, int symbol)
 {
-	return (uint16_t *)(st + 1);
-}
+	struct nfst_StringTable *st = (struct nfst_StringTable *)const_st;
 
-static inline uint32_t *hashtable_32(struct nfst_StringTable *st)
-{
-	return (uint32_t *)(st + 1);
+	if (symbol == 0)
+		return 0;
+	if (is_legacy(st))
+		return strlen(legacy_strings(st) + symbol);
+	if (is_compressed(st))
+		return compressed_decode(st, symbol, NULL, 0);
+	return record_length(strings(st) + symbol);
 }
 
-static inline char *strings(struct nfst_StringTable *st)
+// Returns the symbol of the string that was added to the table after the
+// string with the `symbol`, or `0` if there are no more strings. Call with
+// `symbol = 0` to get the first string. (In a compressed table, the strings
+// are returned in sorted order.) This lets you iterate over all the
+// strings in the table:
+//
+// ```cpp
+// for (int sym = nfst_next_symbol(st, 0); sym; sym = nfst_next_symbol(st, sym))
+//     puts(nfst_to_string(st, sym));
+// ```
+int nfst_next_symbol(struct nfst_StringTable *st, int symbol)
 {
-	return st->uses_16_bit_hash_slots ?
-		 (char *)(hashtable_16(st) + st->num_hash_slots) :
-		 (char *)(hashtable_32(st) + st->num_hash_slots);
+	if (is_compressed(st))
+		return symbol < st->count ? symbol + 1 : 0;
+
+	if (is_legacy(st)) {
+		const int next = symbol + strlen(legacy_strings(st) + symbol) + 1;
+		return next < st->string_bytes ? next : 0;
+	}
+
+	const char * const strs = strings(st);
+	const int header = record_header_bytes(st);
+	int next = symbol == 0 ? 1 + header : symbol + record_length(strs + symbol) + 1 + header;
+	while (next < st->string_bytes && is_removed(strs + next))
+		next += record_length(strs + next) + 1 + header;
+	return next < st->string_bytes ? next : 0;
 }
 
-static inline int available_string_bytes(struct nfst_StringTable *st)
+// Returns the number of strings in the table (not counting the empty
+// string). This includes removed strings until the table is compacted.
+int nfst_count(const struct nfst_StringTable *st)
 {
-	return st->uses_16_bit_hash_slots ?
-		st->allocated_bytes - sizeof(*st) - st->num_hash_slots * sizeof(uint16_t) :
-		st->allocated_bytes - sizeof(*st) - st->num_hash_slots * sizeof(uint32_t);
+	return st->count;
 }
 
-static void rebuild_hash_table(struct nfst_StringTable *st)
+// Fills in `stats` with statistics for the table, see **Statistics** above.
+// This looks at all the strings and hash slots, so it takes time
+// proportional to the size of the table.
+void nfst_stats(const struct nfst_StringTable *const_st, struct nfst_Stats *stats)
 {
-	const char *strs = strings(st);
-	const char *s = strs + 1;
-	if (st->uses_16_bit_hash_slots) {
-		memset(hashtable_16(st), 0, st->num_hash_slots * sizeof(uint16_t));
+	struct nfst_StringTable *st = (struct nfst_StringTable *)const_st;
+	memset(stats, 0, sizeof(*stats));
 
-		uint16_t * const ht = hashtable_16(st);
-		while (s < strs + st->string_bytes) {
-			const struct HashAndLength hl = hash_and_length(s);
-			int i = hl.hash % st->num_hash_slots;
-			while (ht[i])
-				i = (i + 1) % st->num_hash_slots;
-			ht[i] = s - strs;
-			s = s + hl.length + 1;
-		}
-	} else {
-		memset(hashtable_32(st), 0, st->num_hash_slots * sizeof(uint32_t));
+	long long characters = 0;
+	for (int sym = nfst_next_symbol(st, 0); sym; sym = nfst_next_symbol(st, sym)) {
+		characters += nfst_to_string_len(st, sym);
+		stats->count++;
+	}
+	stats->removed = st->count - stats->count;
+	stats->average_string_length = stats->count ? (float)characters / stats->count : 0.0f;
 
-		uint32_t * const ht = hashtable_32(st);
-		while (s < strs + st->string_bytes) {
-			const struct HashAndLength hl = hash_and_length(s);
-			int i = hl.hash % st->num_hash_slots;
-			while (ht[i])
-				i = (i + 1) % st->num_hash_slots;
-			ht[i] = s - strs;
-			s = s + hl.length + 1;
-		}
+	stats->frozen = !is_legacy(st) && is_frozen(st);
+	stats->compressed = !is_legacy(st) && is_compressed(st);
+	stats->uses_16_bit_hash_slots = is_legacy(st) || uses_16_bit_hash_slots(st);
+	if (!stats->compressed) {
+		stats->num_hash_slots = st->num_hash_slots;
+		stats->load_factor = (float)st->count / st->num_hash_slots;
 	}
-}
 
-// ## Unit Test
+	const char * const data = is_legacy(st) ? legacy_strings(st) : strings(st);
+	stats->allocated_bytes = st->allocated_bytes;
+	stats->header_bytes = sizeof(*st);
+	stats->slot_bytes = data - (char *)(st + 1);
+	stats->string_bytes = st->string_bytes;
+	if (stats->compressed)
+		stats->index_bytes = st->num_hash_slots * sizeof(uint32_t);
+	else if (!is_legacy(st)) {
+		stats->record_header_bytes = st->count * record_header_bytes(st);
+		if (has_dense_index(st))
+			stats->index_bytes += st->count * sizeof(uint32_t);
+		if (st->flags & FLAG_PREFIX_INDEX_BUILT)
+			stats->index_bytes += st->count * sizeof(uint32_t);
+	}
+	stats->free_bytes = stats->allocated_bytes - stats->header_bytes - stats->slot_bytes -
+		stats->string_bytes - stats->index_bytes;
 
-#ifdef NFST_UNIT_TEST
+	if (is_legacy(st) || stats->compressed)
+		return;
+	if (stats->frozen) {
+		stats->probe_histogram[0] = stats->count;
+		stats->max_probe_length = stats->count ? 1 : 0;
+		return;
+	}
 
-	#include <stdio.h>
-	#include <assert.h>
-	#include <stdlib.h>
+	// Probe lengths follow from the distance between the group of a slot
+	// and the group where the probing for its string starts.
+	const uint8_t * const tg = tags(st);
+	const int group_mask = st->num_hash_slots / GROUP_SIZE - 1;
+	for (int i=0; i<st->num_hash_slots; ++i) {
+		if (!(tg[i] & 0x80))
+			continue;
+		uint32_t hash;
+		memcpy(&hash, data + slot_symbol(st, i) - RECORD_HEADER_BYTES, sizeof(hash));
+		const int probes = ((i / GROUP_SIZE - (int)(hash & group_mask)) & group_mask) + 1;
+		stats->probe_histogram[MIN(probes, NFST_PROBE_HISTOGRAM_SIZE) - 1]++;
+		stats->max_probe_length = MAX(stats->max_probe_length, probes);
+	}
+}
+
+#if defined(NFST_COUNTERS)
+// Copies the operation counts for all tables to `c`, see **Statistics**
+// above.
+void nfst_counters(struct nfst_Counters *c)
+{
+	c->lookups = LOAD_COUNT(lookups);
+	c->inserts = LOAD_COUNT(inserts);
+	c->full = LOAD_COUNT(full);
+	c->grows = LOAD_COUNT(grows);
+	c->rebuilds = LOAD_COUNT(rebuilds);
+}
+
+// Sets all the operation counts to zero.
+void nfst_reset_counters(void)
+{
+	RESET_COUNT(lookups);
+	RESET_COUNT(inserts);
+	RESET_COUNT(full);
+	RESET_COUNT(grows);
+	RESET_COUNT(rebuilds);
+}
+#endif
+
+// Returns the dense index of the string with the `symbol`. The table must
+// have been created with `NFST_DENSE_INDEX` or be compressed. Returns -1
+// for the empty string.
+int nfst_symbol_to_index(struct nfst_StringTable *st, int symbol)
+{
+	if (is_compressed(st))
+		return symbol - 1;
+	assert(has_dense_index(st));
+	if (symbol == 0)
+		return -1;
+	uint32_t index;
+	memcpy(&index, strings(st) + symbol - RECORD_HEADER_BYTES - sizeof(index), sizeof(index));
+	return (int)index;
+}
+
+// Returns the symbol of the string with the dense `index`, which must be in
+// the range `[0, nfst_count())`. The table must have been created with
+// `NFST_DENSE_INDEX` or be compressed.
+int nfst_index_to_symbol(struct nfst_StringTable *st, int index)
+{
+	assert(index >= 0 && index < st->count);
+	if (is_compressed(st))
+		return index + 1;
+	assert(has_dense_index(st));
+	return index_symbol(st, index);
+}
+
+// Returns true if the table has an up to date prefix index.
+int nfst_has_prefix_index(const struct nfst_StringTable *st)
+{
+	return (st->flags & FLAG_PREFIX_INDEX_BUILT) != 0;
+}
+
+// Finds the strings that start with `prefix`. Returns the number of such
+// strings and stores the position of the first one in the sorted order in
+// `*first`. Use `nfst_sorted_symbol()` to get their symbols:
+//
+// ```cpp
+// int first;
+// int n = nfst_prefix_range(st, "textures/", &first);
+// for (int i=first; i<first+n; ++i)
+//     puts(nfst_to_string(st, nfst_sorted_symbol(st, i)));
+// ```
+//
+// The table must have a prefix index, see **Prefix queries** above. The
+// empty string is never returned.
+int nfst_prefix_range(struct nfst_StringTable *st, const char *prefix, int *first)
+{
+	assert(nfst_has_prefix_index(st));
+	const uint32_t * const sorted = prefix_index(st);
+	const char * const strs = strings(st);
+	const int length = strlen(prefix);
+
+	// First string >= prefix
+	int lo = 0, hi = st->count;
+	while (lo < hi) {
+		const int mid = lo + (hi - lo) / 2;
+		if (strcmp(strs + sorted[mid], prefix) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*first = lo;
+
+	// First string that doesn't start with the prefix
+	hi = st->count;
+	while (lo < hi) {
+		const int mid = lo + (hi - lo) / 2;
+		if (strncmp(strs + sorted[mid], prefix, length) == 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo - *first;
+}
+
+// Returns the symbol of the `i`th string in sorted order. The table must
+// have a prefix index.
+int nfst_sorted_symbol(struct nfst_StringTable *st, int i)
+{
+	assert(nfst_has_prefix_index(st));
+	assert(i >= 0 && i < st->count);
+	return prefix_index(st)[i];
+}
+
+// Returns the number of bytes of scratch memory that `nfst_freeze()` needs
+// to freeze the table.
+int nfst_freeze_scratch_bytes(const struct nfst_StringTable *st)
+{
+	const int n = st->count;
+	const int m = MAX(n, 1);
+	const int r = chd_buckets(m);
+	return n * (sizeof(uint64_t) + 4 * sizeof(int)) + (2 * r + 1) * sizeof(int)
+		+ r * sizeof(uint32_t) + freeze_table_ints(n) * sizeof(int);
+}
+
+// Freezes the table, see **Frozen tables** above. `scratch` is temporary
+// memory of at least `nfst_freeze_scratch_bytes()` bytes, aligned for
+// `uint64_t`.
+//
+// Like `nfst_pack()`, this makes the table use as little memory as
+// possible. It returns the new `st->allocated_bytes`, which you can use to
+// shrink the buffer. If the perfect hash can't be built (which requires two
+// strings with the same 64 bit hash) the table is left unchanged and `0` is
+// returned.
+int nfst_freeze(struct nfst_StringTable *st, void *scratch, int scratch_bytes)
+{
+	assert(!is_legacy(st) && !is_frozen(st) && !is_compressed(st));
+	assert(!(st->flags & FLAG_HAS_REMOVED));
+	assert(scratch_bytes >= nfst_freeze_scratch_bytes(st));
+
+	const int n = st->count;
+	const int m = MAX(n, 1);
+	const int r = chd_buckets(m);
+
+	uint64_t * const hashes = scratch;
+	int * const symbols = (int *)(hashes + n);
+	int * const sorted = symbols + n;
+	int * const bucket_start = sorted + n;
+	int * const order = bucket_start + r + 1;
+	int * const positions = order + r;
+	int * const bases = positions + n;
+	int * const table = bases + n;
+	uint32_t * const disp = (uint32_t *)(table + freeze_table_ints(n));
+
+	// Hash the strings with the 64 bit hash and sort them by bucket.
+	const char * const strs = strings(st);
+	memset(bucket_start, 0, (r + 1) * sizeof(int));
+	for (int i = 0, sym = nfst_next_symbol(st, 0); sym; ++i, sym = nfst_next_symbol(st, sym)) {
+		symbols[i] = sym;
+		hashes[i] = table_hash_64(st, strs + sym, record_length(strs + sym));
+		bucket_start[chd_bucket(hashes[i], m) + 1]++;
+	}
+	int max_bucket = 0;
+	for (int b=0; b<r; ++b) {
+		max_bucket = MAX(max_bucket, bucket_start[b + 1]);
+		bucket_start[b + 1] += bucket_start[b];
+	}
+	for (int i=0; i<n; ++i)
+		sorted[bucket_start[chd_bucket(hashes[i], m)]++] = i;
+	for (int b=r; b>0; --b)
+		bucket_start[b] = bucket_start[b - 1];
+	bucket_start[0] = 0;
+
+	// Process the buckets from largest to smallest, since the large buckets
+	// are the hardest to place. The buckets are sorted by size with a
+	// counting sort that uses `table` for the counts. No bucket has more
+	// than `n` strings, so the counts fit in `freeze_table_ints()`.
+	memset(table, 0, (max_bucket + 2) * sizeof(int));
+	for (int b=0; b<r; ++b)
+		table[max_bucket - (bucket_start[b + 1] - bucket_start[b]) + 1]++;
+	for (int k=0; k<=max_bucket; ++k)
+		table[k + 1] += table[k];
+	for (int b=0; b<r; ++b)
+		order[table[max_bucket - (bucket_start[b + 1] - bucket_start[b])]++] = b;
+
+	// Find a displacement for each bucket that puts all its strings in empty
+	// slots.
+	memset(table, 0, m * sizeof(int));
+	for (int o=0; o<r; ++o) {
+		const int b = order[o];
+		const int *keys = sorted + bucket_start[b];
+		const int k = bucket_start[b + 1] - bucket_start[b];
+		disp[b] = 0;
+		if (k == 0)
+			continue;
+
+		for (int i=0; i<k; ++i) {
+			for (int j=0; j<i; ++j) {
+				if (hashes[keys[i]] == hashes[keys[j]])
+					return 0;
+			}
+		}
+
+		// For each `d1`, the slots for all `d0` are the slots for `d0 = 0`
+		// rotated by `d0`, so we compute those once and step from there.
+		int placed = 0;
+		const uint32_t max_d1 = MIN(CHD_MAX_D1, UINT32_MAX / m);
+		for (uint32_t d1 = 0; !placed && d1 < max_d1; ++d1) {
+			for (int i=0; i<k; ++i) {
+				uint32_t f1, f2;
+				chd_hashes(hashes[keys[i]], m, &f1, &f2);
+				bases[i] = chd_slot(f1, f2, d1 * m, m);
+			}
+			for (int d0 = 0; !placed && d0 < m; ++d0) {
+				placed = 1;
+				for (int i=0; placed && i<k; ++i) {
+					positions[i] = bases[i] + d0 < m ? bases[i] + d0 : bases[i] + d0 - m;
+					placed = !table[positions[i]];
+					for (int j=0; placed && j<i; ++j)
+						placed = positions[i] != positions[j];
+				}
+				if (placed) {
+					disp[b] = d1 * m + d0;
+					for (int i=0; i<k; ++i)
+						table[positions[i]] = symbols[keys[i]];
+				}
+			}
+		}
+		if (!placed)
+			return 0;
+	}
+
+	// Replace the hash table with the displacements and the perfect hash
+	// slots. These take less space than the old hash table, so the strings
+	// (and the prefix index after them) move down.
+	const int has_prefix_index = nfst_has_prefix_index(st);
+	const uint32_t * const old_prefix_index = has_prefix_index ? prefix_index(st) : NULL;
+	st->flags |= FLAG_FROZEN;
+	st->num_hash_slots = m;
+	char * const new_strings = strings(st);
+	memmove(new_strings, strs, st->string_bytes);
+	if (has_prefix_index)
+		memmove(prefix_index(st), old_prefix_index, n * sizeof(uint32_t));
+	memcpy(displacements(st), disp, r * sizeof(uint32_t));
+	for (int i=0; i<m; ++i) {
+		if (uses_16_bit_hash_slots(st))
+			hashtable_16(st)[i] = table[i];
+		else
+			hashtable_32(st)[i] = table[i];
+	}
+
+	st->allocated_bytes = (new_strings + st->string_bytes) - (char *)st;
+	if (has_prefix_index)
+		st->allocated_bytes = prefix_index_offset(st) + n * sizeof(uint32_t);
+	if (has_dense_index(st)) {
+		st->allocated_bytes += n * sizeof(uint32_t);
+		for (int i=0; i<n; ++i)
+			set_index_symbol(st, i, symbols[i]);
+	}
+	return st->allocated_bytes;
+}
+
+// Removes the string with the `symbol` from the table, see **Removing
+// strings** above. The symbol must not be used afterwards. Returns false
+// if the string was already removed. The empty string can't be removed.
+int nfst_remove(struct nfst_StringTable *st, int symbol)
+{
+	assert(!is_legacy(st) && !is_frozen(st) && !is_compressed(st));
+	if (symbol == 0)
+		return 0;
+
+	char * const chars = strings(st) + symbol;
+	uint32_t hash;
+	memcpy(&hash, chars - RECORD_HEADER_BYTES, sizeof(hash));
+	const uint8_t tag = hash_tag(hash);
+	const uint8_t * const tg = tags(st);
+	const int group_mask = st->num_hash_slots / GROUP_SIZE - 1;
+
+	int g = hash & group_mask;
+	while (1) {
+		const int first = g * GROUP_SIZE;
+		const GroupTags group = load_group(tg + first);
+		for (unsigned m = match_group(group, tag); m; m &= m - 1) {
+			const int i = first + lowest_bit(m);
+			if (slot_symbol(st, i) == symbol) {
+				store_tag(tags(st), i, TOMBSTONE_TAG);
+				chars[0] = 0;
+				// Only write the flags when they change, since lock-free
+				// readers load them.
+				const unsigned flags = (st->flags | FLAG_HAS_REMOVED) & ~FLAG_PREFIX_INDEX_BUILT;
+				if (flags != st->flags)
+					st->flags = flags;
+				return 1;
+			}
+		}
+		if (match_group(group, 0))
+			return 0;
+		g = (g + 1) & group_mask;
+	}
+}
+
+// Compacts the table, see **Removing strings** above. For each remaining
+// string, an entry is written to `remap`, which must have room for
+// `nfst_count()` entries. Returns the number of entries written, which is
+// the new `nfst_count()`.
+//
+// The table uses less string data afterwards, but keeps its allocated
+// size. Call `nfst_pack()` to shrink it.
+int nfst_compact(struct nfst_StringTable *st, struct nfst_SymbolRemap *remap)
+{
+	assert(!is_legacy(st) && !is_frozen(st) && !is_compressed(st));
+
+	char * const strs = strings(st);
+	const int header = record_header_bytes(st);
+	int read = 1, write = 1, n = 0;
+	while (read < st->string_bytes) {
+		const char * const chars = strs + read + header;
+		const int bytes = header + record_length(chars) + 1;
+		if (!is_removed(chars)) {
+			remap[n].old_symbol = read + header;
+			remap[n].new_symbol = write + header;
+			memmove(strs + write, strs + read, bytes);
+			if (has_dense_index(st)) {
+				const uint32_t index = n;
+				memcpy(strs + write, &index, sizeof(index));
+			}
+			write += bytes;
+			++n;
+		}
+		read += bytes;
+	}
+
+	st->count = n;
+	st->string_bytes = write;
+	st->flags &= ~(FLAG_HAS_REMOVED | FLAG_PREFIX_INDEX_BUILT);
+	rebuild_hash_table(st);
+	return n;
+}
+
+// Returns the new symbol for `old_symbol` from the `n` entries `remap`
+// table returned by `nfst_compact()`, or `NFST_STRING_TABLE_FULL` if the
+// string was removed.
+int nfst_remap_symbol(const struct nfst_SymbolRemap *remap, int n, int old_symbol)
+{
+	if (old_symbol == 0)
+		return 0;
+	int lo = 0, hi = n;
+	while (lo < hi) {
+		const int mid = lo + (hi - lo) / 2;
+		if (remap[mid].old_symbol < old_symbol)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < n && remap[lo].old_symbol == old_symbol ? remap[lo].new_symbol : NFST_STRING_TABLE_FULL;
+}
+
+// Returns the number of bytes of scratch memory that `nfst_compress()`
+// needs to compress the table.
+int nfst_compress_scratch_bytes(const struct nfst_StringTable *st)
+{
+	const int buckets = (st->count + FRONT_CODING_BUCKET_SIZE - 1) / FRONT_CODING_BUCKET_SIZE;
+	return (st->count + buckets) * sizeof(uint32_t) + st->string_bytes;
+}
+
+// Compresses the table, see **Compressed tables** above. `scratch` is
+// temporary memory of at least `nfst_compress_scratch_bytes()` bytes,
+// aligned for `uint32_t`. The dense index, prefix index and perfect hash of
+// the table are dropped.
+//
+// Returns the new `st->allocated_bytes`, which you can use to shrink the
+// buffer.
+int nfst_compress(struct nfst_StringTable *st, void *scratch, int scratch_bytes)
+{
+	assert(!is_legacy(st) && !is_compressed(st));
+	assert(!(st->flags & (FLAG_HAS_REMOVED | FLAG_FOLD_MASK)));
+	assert(scratch_bytes >= nfst_compress_scratch_bytes(st));
+
+	const int n = st->count;
+	const int buckets = (n + FRONT_CODING_BUCKET_SIZE - 1) / FRONT_CODING_BUCKET_SIZE;
+	uint32_t * const sorted = scratch;
+	uint32_t * const directory = sorted + n;
+	char * const strs = (char *)(directory + buckets);
+
+	// Sort a copy of the strings, since the compressed strings overwrite
+	// them.
+	memcpy(strs, strings(st), st->string_bytes);
+	int i = 0;
+	for (int sym = nfst_next_symbol(st, 0); sym; sym = nfst_next_symbol(st, sym))
+		sorted[i++] = sym;
+	sort_symbols(strs, sorted, n);
+
+	st->flags = (FORMAT_VERSION << VERSION_SHIFT) | FLAG_COMPRESSED;
+	st->num_hash_slots = buckets;
+	char * const out = strings(st);
+	int bytes = 0;
+	const char *prev = "";
+	for (i = 0; i < n; ++i) {
+		const char * const s = strs + sorted[i];
+		int shared = 0;
+		if (i % FRONT_CODING_BUCKET_SIZE == 0)
+			directory[i / FRONT_CODING_BUCKET_SIZE] = bytes;
+		else {
+			while (s[shared] && s[shared] == prev[shared])
+				++shared;
+			bytes += write_varint(out + bytes, shared);
+		}
+		const int rest = string_length(s + shared) + 1;
+		memcpy(out + bytes, s + shared, rest);
+		bytes += rest;
+		prev = s;
+	}
+
+	st->string_bytes = bytes;
+	memcpy(bucket_directory(st), directory, buckets * sizeof(uint32_t));
+	st->allocated_bytes = prefix_index_offset(st) + buckets * sizeof(uint32_t);
+	return st->allocated_bytes;
+}
+
+// Returns the size of the file image that `nfst_save()` writes for the
+// table. You may want to pack or freeze the table before saving it.
+int nfst_save_bytes(const struct nfst_StringTable *st)
+{
+	return sizeof(struct FileHeader) + st->allocated_bytes;
+}
+
+// Writes a file image of the table to `buffer`, which must have room for
+// `nfst_save_bytes()` bytes.
+void nfst_save(const struct nfst_StringTable *st, void *buffer)
+{
+	struct FileHeader header;
+	header.magic = FILE_MAGIC;
+	header.endian_mark = FILE_ENDIAN_MARK;
+	header.version = FILE_VERSION;
+	header.table_bytes = st->allocated_bytes;
+	header.checksum = hash_bytes_64((const char *)st, st->allocated_bytes);
+	memcpy(buffer, &header, sizeof(header));
+	memcpy((char *)buffer + sizeof(header), st, st->allocated_bytes);
+}
+
+// Validates the `bytes` large file image at `data` and returns the table
+// stored in it, or NULL if it isn't a valid image for this platform. The
+// image must stay in memory while the table is used. `data` must be aligned
+// to 8 bytes, which memory mapped files and allocations always are.
+//
+// If `verify_checksum` is true, the whole image is read to check that it
+// isn't corrupted. Otherwise only the header is checked, so that pages of
+// a memory mapped file are only loaded as they are used.
+const struct nfst_StringTable *nfst_open_mapped(const void *data, int bytes, int verify_checksum)
+{
+	struct FileHeader header;
+	if (bytes < (int)sizeof(header) + (int)sizeof(struct nfst_StringTable))
+		return NULL;
+	memcpy(&header, data, sizeof(header));
+	if (header.magic != FILE_MAGIC || header.endian_mark != FILE_ENDIAN_MARK || header.version != FILE_VERSION)
+		return NULL;
+	if (header.table_bytes > (uint32_t)bytes - sizeof(header))
+		return NULL;
+
+	const struct nfst_StringTable * const st = (const struct nfst_StringTable *)((const char *)data + sizeof(header));
+	if (!nfst_validate(st, header.table_bytes))
+		return NULL;
+	if (verify_checksum && hash_bytes_64((const char *)st, header.table_bytes) != header.checksum)
+		return NULL;
+	return st;
+}
+
+// Returns true if the `bytes` large buffer at `data` holds the header of a
+// table of exactly that size, in a format version this code can read, and
+// the hash table, string data and indices described by the header fit in
+// the buffer. This is the check `nfst_open_mapped()` does on the table in
+// an image, for tables that are stored without a file header. Like
+// `nfst_open_mapped()` without checksum verification, it doesn't read the
+// table's contents.
+int nfst_validate(const void *data, int bytes)
+{
+	if (bytes < (int)sizeof(struct nfst_StringTable))
+		return 0;
+	const struct nfst_StringTable * const st = data;
+	const unsigned version = st->flags >> VERSION_SHIFT;
+	if (version != 0 && version != FORMAT_VERSION)
+		return 0;
+	if (st->allocated_bytes != bytes)
+		return 0;
+	const long long needed = layout_bytes(st);
+	return needed >= 0 && needed <= bytes;
+}
+
+// Creates a growing string table with an initial size of `bytes`. If
+// `policy` is NULL, the table doubles in size when it is full and migrates
+// 16 hash slots per insert.
+struct nfst_GrowingStringTable *nfst_make(nfst_realloc realloc, void *ud, int bytes, int average_strlen,
+	const struct nfst_GrowthPolicy *policy)
+{
+	struct nfst_GrowingStringTable *gst = growing_alloc(realloc, ud, policy);
+	bytes = MAX(bytes, (int)MIN_SIZE);
+	gst->st = realloc(ud, NULL, 0, bytes, __FILE__, __LINE__);
+	nfst_init(gst->st, bytes, average_strlen);
+	return gst;
+}
+
+// Creates a growing string table that uses the table `st`, typically from
+// `nfst_open_mapped()`, without copying it. `st` is never written to. When
+// the first string that isn't in `st` is added, the table is copied to a
+// buffer allocated with `realloc`. `st` must stay in memory until
+// `nfst_free()` is called.
+struct nfst_GrowingStringTable *nfst_growing_open(nfst_realloc realloc, void *ud,
+	const struct nfst_StringTable *st, const struct nfst_GrowthPolicy *policy)
+{
+	assert(!is_legacy(st) && !is_compressed(st));
+
+	struct nfst_GrowingStringTable *gst = growing_alloc(realloc, ud, policy);
+	gst->st = (struct nfst_StringTable *)st;
+	gst->read_only = 1;
+	return gst;
+}
+
+// Frees a growing string table created by `nfst_make()` or
+// `nfst_growing_open()`.
+void nfst_free(struct nfst_GrowingStringTable *gst)
+{
+	if (gst->old)
+		gst->realloc(gst->realloc_user_data, gst->old, gst->old->allocated_bytes, 0, __FILE__, __LINE__);
+	if (!gst->read_only)
+		gst->realloc(gst->realloc_user_data, gst->st, gst->st->allocated_bytes, 0, __FILE__, __LINE__);
+	gst->realloc(gst->realloc_user_data, gst, sizeof(*gst), 0, __FILE__, __LINE__);
+}
+
+// As `nfst_to_symbol()`, but grows the table instead of returning
+// `NFST_STRING_TABLE_FULL`. (It is still returned if the table has reached
+// NFST_MAX_TABLE_BYTES.)
+int nfst_growing_to_symbol(struct nfst_GrowingStringTable *gst, const char *s)
+{
+	// "" maps to 0
+	if (!*s) return 0;
+
+	return growing_to_symbol(gst, s, table_hash_and_length(gst->st, s));
+}
+
+// As `nfst_to_symbol_const()` for a growing string table.
+int nfst_growing_to_symbol_const(struct nfst_GrowingStringTable *gst, const char *s)
+{
+	// "" maps to 0
+	if (!*s) return 0;
+
+	return growing_find(gst, s, table_hash_and_length(gst->st, s));
+}
+
+// As `nfst_to_string()` for a growing string table.
+const char *nfst_growing_to_string(struct nfst_GrowingStringTable *gst, int symbol)
+{
+	return strings(gst->st) + symbol;
+}
+
+// Finishes any ongoing migration and returns the table. You can use all
+// the regular `nfst_*` functions that don't add strings on the result. It
+// stays valid until the next call to `nfst_growing_to_symbol()`. For a
+// table opened with `nfst_growing_open()` that hasn't been copied yet,
+// this is the table that it was opened with.
+struct nfst_StringTable *nfst_growing_table(struct nfst_GrowingStringTable *gst)
+{
+	if (gst->old)
+		growing_migrate(gst, gst->old->num_hash_slots);
+	return gst->st;
+}
+
+// Creates a wide string table, see **Wide tables** above. `bytes` is the
+// expected total size, which is split evenly between the partitions.
+struct nfst_WideStringTable *nfst_wide_make(nfst_realloc realloc, void *ud, long long bytes, int average_strlen)
+{
+	struct nfst_WideStringTable *wst = realloc(ud, NULL, 0, sizeof(*wst), __FILE__, __LINE__);
+	wst->realloc = realloc;
+	wst->realloc_user_data = ud;
+	const long long partition_bytes = MIN(bytes / NFST_WIDE_PARTITIONS, NFST_MAX_TABLE_BYTES);
+	for (int i=0; i<NFST_WIDE_PARTITIONS; ++i)
+		wst->partitions[i] = nfst_make(realloc, ud, (int)partition_bytes, average_strlen, NULL);
+	return wst;
+}
+
+// Frees a wide string table created by `nfst_wide_make()`.
+void nfst_wide_free(struct nfst_WideStringTable *wst)
+{
+	for (int i=0; i<NFST_WIDE_PARTITIONS; ++i)
+		nfst_free(wst->partitions[i]);
+	wst->realloc(wst->realloc_user_data, wst, sizeof(*wst), 0, __FILE__, __LINE__);
+}
+
+// As `nfst_growing_to_symbol()` for a wide string table. Returns
+// `NFST_STRING_TABLE_FULL` only if the partition of `s` has reached
+// NFST_MAX_TABLE_BYTES.
+long long nfst_wide_to_symbol(struct nfst_WideStringTable *wst, const char *s)
+{
+	// "" maps to 0
+	if (!*s) return 0;
+
+	struct HashAndLength hl;
+	const int p = wide_partition(s, &hl);
+	const int symbol = growing_to_symbol(wst->partitions[p], s, hl);
+	if (symbol == NFST_STRING_TABLE_FULL)
+		return NFST_STRING_TABLE_FULL;
+	return (long long)p << 32 | symbol;
+}
+
+// As `nfst_growing_to_symbol_const()` for a wide string table.
+long long nfst_wide_to_symbol_const(struct nfst_WideStringTable *wst, const char *s)
+{
+	// "" maps to 0
+	if (!*s) return 0;
+
+	struct HashAndLength hl;
+	const int p = wide_partition(s, &hl);
+	const int symbol = growing_find(wst->partitions[p], s, hl);
+	if (symbol == NFST_STRING_TABLE_FULL)
+		return NFST_STRING_TABLE_FULL;
+	return (long long)p << 32 | symbol;
+}
+
+// As `nfst_growing_to_string()` for a wide string table.
+const char *nfst_wide_to_string(struct nfst_WideStringTable *wst, long long symbol)
+{
+	return nfst_growing_to_string(wst->partitions[symbol >> 32], (int)(symbol & 0xffffffff));
+}
+
+// Returns the number of strings in the table (not counting the empty
+// string).
+long long nfst_wide_count(struct nfst_WideStringTable *wst)
+{
+	long long count = 0;
+	for (int i=0; i<NFST_WIDE_PARTITIONS; ++i)
+		count += wst->partitions[i]->st->count;
+	return count;
+}
+
+// Returns the total number of bytes allocated for the partitions.
+long long nfst_wide_bytes(struct nfst_WideStringTable *wst)
+{
+	long long bytes = 0;
+	for (int i=0; i<NFST_WIDE_PARTITIONS; ++i) {
+		const struct nfst_GrowingStringTable * const gst = wst->partitions[i];
+		bytes += gst->st->allocated_bytes + (gst->old ? gst->old->allocated_bytes : 0);
+	}
+	return bytes;
+}
+
+// Returns partition `i` of the table, as for `nfst_growing_table()`. The
+// symbol of a string in the partition is the lower 32 bits of its wide
+// symbol.
+struct nfst_StringTable *nfst_wide_partition(struct nfst_WideStringTable *wst, int i)
+{
+	assert(i >= 0 && i < NFST_WIDE_PARTITIONS);
+	return nfst_growing_table(wst->partitions[i]);
+}
+
+static inline struct HashAndLength hash_and_length(const char *start)
+{
+	// Since we need to walk the entire string anyway for finding the length,
+	// we do that first with a vectorized scan and then hash the string in
+	// blocks, now that we know where it ends.
+	const int length = string_length(start);
+	struct HashAndLength result = {hash_bytes(start, length), length};
+	return result;
+}
+
+// Returns the index of the lowest set bit in the non-zero `mask`.
+static inline int lowest_bit(unsigned mask)
+{
+#if defined(_MSC_VER)
+	unsigned long i;
+	_BitScanForward(&i, mask);
+	return (int)i;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+// Returns the length of the string `start`.
+//
+// The string is scanned in aligned blocks of 32 (AVX2) or 16 (SSE2) bytes.
+// An aligned block never straddles a page boundary, so reading past the
+// terminating zero can't fault, but memory checkers complain about it, see
+// NFST_NO_OVERREAD. Without SIMD, the C library `strlen()` is used.
+static inline int string_length(const char *start)
+{
+#if defined(NFST_NO_OVERREAD)
+	return (int)strlen(start);
+#elif defined(USE_AVX2)
+	const int misalign = (int)((uintptr_t)start & 31);
+	const char *p = start - misalign;
+	const __m256i zero = _mm256_setzero_si256();
+	unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+		_mm256_load_si256((const __m256i *)p), zero)) >> misalign;
+	if (mask)
+		return lowest_bit(mask);
+	while (1) {
+		p += 32;
+		mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+			_mm256_load_si256((const __m256i *)p), zero));
+		if (mask)
+			return (int)(p - start) + lowest_bit(mask);
+	}
+#elif defined(USE_SSE2)
+	const int misalign = (int)((uintptr_t)start & 15);
+	const char *p = start - misalign;
+	const __m128i zero = _mm_setzero_si128();
+	unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(
+		_mm_load_si128((const __m128i *)p), zero)) >> misalign;
+	if (mask)
+		return lowest_bit(mask);
+	while (1) {
+		p += 16;
+		mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(
+			_mm_load_si128((const __m128i *)p), zero));
+		if (mask)
+			return (int)(p - start) + lowest_bit(mask);
+	}
+#else
+	return (int)strlen(start);
+#endif
+}
+
+static inline uint64_t load_64(const char *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t rotl_64(uint64_t v, int n)
+{
+	return (v << n) | (v >> (64 - n));
+}
+
+// Loads the `n < 8` bytes at `p` zero extended to 64 bits, as if they were
+// copied to a zeroed buffer that is then loaded. Copying the bytes to a
+// buffer on the stack would be simpler, but the load can't be forwarded
+// from the smaller stores of the copy, so it waits for them to retire, and
+// that stops consecutive lookups from overlapping their cache misses.
+static inline uint64_t load_partial_64(const char *p, int n)
+{
+#if defined(_MSC_VER) || (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+	if (n >= 4) {
+		uint32_t a, b;
+		memcpy(&a, p, sizeof(a));
+		memcpy(&b, p + n - 4, sizeof(b));
+		return (uint64_t)a | (uint64_t)b << (8 * (n - 4));
+	}
+	if (n > 0) {
+		const uint64_t first = (unsigned char)p[0];
+		const uint64_t mid = (unsigned char)p[n >> 1];
+		const uint64_t last = (unsigned char)p[n - 1];
+		return first | mid << (8 * (n >> 1)) | last << (8 * (n - 1));
+	}
+	return 0;
+#else
+	char buffer[8] = {0};
+	memcpy(buffer, p, n);
+	return load_64(buffer);
+#endif
+}
+
+// Hashes the `n` bytes at `s`.
+//
+// The string is consumed 16 bytes per step in two independent 64-bit lanes,
+// so the multiplies can execute in parallel. The tail is zero-padded into a
+// final block. A final avalanche step makes sure that both the low bits
+// (used for finding the slot) and the high bits depend on every input byte.
+static inline uint32_t hash_bytes(const char *s, int n)
+{
+	const uint64_t h = hash_bytes_64(s, n);
+	return (uint32_t)(h >> 32) ^ (uint32_t)h;
+}
+
+// The 64 bit hash that `hash_bytes()` is folded from. This is used by the
+// perfect hash of frozen tables, since 32 bit hashes are likely to collide
+// in large tables.
+static inline uint64_t hash_bytes_64(const char *s, int n)
+{
+	const uint64_t k1 = 0x9e3779b97f4a7c15ull;
+	const uint64_t k2 = 0xc2b2ae3d27d4eb4full;
+
+	uint64_t h1 = (uint64_t)n * k1;
+	uint64_t h2 = (uint64_t)n ^ k2;
+	const char *p = s;
+	int left = n;
+	for (; left >= 16; p += 16, left -= 16) {
+		h1 = rotl_64((h1 ^ load_64(p)) * k1, 31);
+		h2 = rotl_64((h2 ^ load_64(p + 8)) * k2, 29);
+	}
+	if (left > 0) {
+		const uint64_t lo = left >= 8 ? load_64(p) : load_partial_64(p, left);
+		const uint64_t hi = left > 8 ? load_partial_64(p + 8, left - 8) : 0;
+		h1 = rotl_64((h1 ^ lo) * k1, 31);
+		h2 = rotl_64((h2 ^ hi) * k2, 29);
+	}
+
+	uint64_t h = h1 ^ rotl_64(h2, 32);
+	h ^= h >> 33;
+	h *= k2;
+	h ^= h >> 29;
+	return h;
+}
+
+// Folds the 128 bit product of `a` and `b` to 64 bits.
+static inline uint64_t mul_fold_64(uint64_t a, uint64_t b)
+{
+#if defined(__SIZEOF_INT128__)
+	__extension__ typedef unsigned __int128 uint128;
+	const uint128 r = (uint128)a * b;
+	return (uint64_t)r ^ (uint64_t)(r >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+	uint64_t hi;
+	const uint64_t lo = _umul128(a, b, &hi);
+	return lo ^ hi;
+#else
+	const uint64_t a_lo = (uint32_t)a, a_hi = a >> 32, b_lo = (uint32_t)b, b_hi = b >> 32;
+	const uint64_t ll = a_lo * b_lo, lh = a_lo * b_hi, hl = a_hi * b_lo, hh = a_hi * b_hi;
+	const uint64_t mid = (ll >> 32) + (uint32_t)lh + (uint32_t)hl;
+	const uint64_t lo = (mid << 32) | (uint32_t)ll;
+	const uint64_t hi = hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+	return lo ^ hi;
+#endif
+}
+
+static inline uint64_t load_32(const char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+// Hashes the `n` bytes at `s` in the style of wyhash: the input is read in
+// 16 byte blocks (short strings with overlapping reads) and mixed with
+// 64x64 to 128 bit multiplies.
+static inline uint32_t wyhash_bytes(const char *s, int n)
+{
+	const uint64_t p0 = 0xa0761d6478bd642full;
+	const uint64_t p1 = 0xe7037ed1a0b428dbull;
+	const uint64_t p2 = 0x8ebc6af09c88c6e3ull;
+
+	uint64_t seed = p0;
+	uint64_t a, b;
+	if (n <= 16) {
+		if (n >= 4) {
+			const int k = (n >> 3) << 2;
+			a = load_32(s) << 32 | load_32(s + k);
+			b = load_32(s + n - 4) << 32 | load_32(s + n - 4 - k);
+		} else if (n > 0) {
+			a = (uint64_t)(unsigned char)s[0] << 16 | (uint64_t)(unsigned char)s[n >> 1] << 8 |
+				(unsigned char)s[n - 1];
+			b = 0;
+		} else
+			a = b = 0;
+	} else {
+		const char *p = s;
+		int left = n;
+		for (; left > 16; p += 16, left -= 16)
+			seed = mul_fold_64(load_64(p) ^ p1, load_64(p + 8) ^ seed);
+		a = load_64(p + left - 16);
+		b = load_64(p + left - 8);
+	}
+	const uint64_t h = mul_fold_64(mul_fold_64(a ^ p1, b ^ seed) ^ p0 ^ (uint64_t)n, p2);
+	return (uint32_t)(h >> 32) ^ (uint32_t)h;
+}
+
+// Hashes the `n` bytes at `s` with CRC32C, eight bytes at a time with the
+// SSE 4.2 instruction or bitwise without it. CRC32C mixes the high bits
+// poorly for short strings, so the result is finished with a multiply.
+static inline uint32_t crc32c_bytes(const char *s, int n)
+{
+	uint32_t crc = 0xffffffffu;
+	const char *p = s;
+	int left = n;
+#if defined(USE_SSE42)
+	uint64_t crc64 = crc;
+	for (; left >= 8; p += 8, left -= 8)
+		crc64 = _mm_crc32_u64(crc64, load_64(p));
+	crc = (uint32_t)crc64;
+	for (; left > 0; ++p, --left)
+		crc = _mm_crc32_u8(crc, (unsigned char)*p);
+#else
+	for (; left > 0; ++p, --left) {
+		crc ^= (unsigned char)*p;
+		for (int k=0; k<8; ++k)
+			crc = (crc >> 1) ^ (0x82f63b78u & (0u - (crc & 1)));
+	}
+#endif
+	crc = ~crc * 0x9e3779b1u;
+	return crc ^ (crc >> 15);
+}
+
+// Hashes the `n` bytes at `s` with the hash function of the table.
+static inline uint32_t table_hash(const struct nfst_StringTable *st, const char *s, int n)
+{
+	if (st->flags & FLAG_FOLD_MASK) {
+		const uint64_t h = fold_hash_64(st->flags, s, n);
+		return (uint32_t)(h >> 32) ^ (uint32_t)h;
+	}
+	switch ((st->flags & HASH_MASK) >> HASH_SHIFT) {
+	case HASH_LUA: return legacy_hash(s, n);
+	case HASH_WYHASH: return wyhash_bytes(s, n);
+	case HASH_CRC32C: return crc32c_bytes(s, n);
+	default: return hash_bytes(s, n);
+	}
+}
+
+// As `hash_and_length()`, but with the hash function of the table.
+static inline struct HashAndLength table_hash_and_length(const struct nfst_StringTable *st, const char *s)
+{
+	if (!(st->flags & (HASH_MASK | FLAG_FOLD_MASK)))
+		return hash_and_length(s);
+	const int length = string_length(s);
+	struct HashAndLength result = {table_hash(st, s, length), length};
+	return result;
+}
+
+// The 64 bit hash used for the perfect hash of a frozen table.
+static inline uint64_t table_hash_64(const struct nfst_StringTable *st, const char *s, int n)
+{
+	return st->flags & FLAG_FOLD_MASK ? fold_hash_64(st->flags, s, n) : hash_bytes_64(s, n);
+}
+
+// Returns true if the `length` characters at `s` are the same string as the
+// record at `chars`, with the folding of the table.
+static inline int strings_equal(const struct nfst_StringTable *st, const char *s, int length, const char *chars)
+{
+	if (st->flags & FLAG_FOLD_MASK)
+		return fold_equal(st->flags, s, length, chars, record_length(chars));
+	return record_length(chars) == length && memcmp(s, chars, length) == 0;
+}
+
+// Returns the tag stored in the tag array for a string with the `hash`.
+static inline uint8_t hash_tag(uint32_t hash)
+{
+	return 0x80 | (hash >> 25);
+}
+
+// Rounds the desired number of hash slots down to a power of two number of
+// groups. Rounding down (rather than up) means the slots never use more
+// memory than was budgeted for them.
+static inline int round_to_groups(float num_slots)
+{
+	int groups = 1;
+	while (groups * 2 * GROUP_SIZE <= num_slots)
+		groups *= 2;
+	return groups * GROUP_SIZE;
+}
+
+static inline int uses_16_bit_hash_slots(const struct nfst_StringTable *st)
+{
+	return (st->flags & FLAG_16_BIT_HASH_SLOTS) != 0;
+}
+
+static inline void set_16_bit_hash_slots(struct nfst_StringTable *st, int use)
+{
+	st->flags = use ? st->flags | FLAG_16_BIT_HASH_SLOTS : st->flags & ~FLAG_16_BIT_HASH_SLOTS;
+}
+
+static inline int is_frozen(const struct nfst_StringTable *st)
+{
+	return (st->flags & FLAG_FROZEN) != 0;
+}
+
+static inline int has_dense_index(const struct nfst_StringTable *st)
+{
+	return (st->flags & FLAG_DENSE_INDEX) != 0;
+}
+
+// Returns the number of bytes before the characters of a record.
+static inline int record_header_bytes(const struct nfst_StringTable *st)
+{
+	return RECORD_HEADER_BYTES + (has_dense_index(st) ? sizeof(uint32_t) : 0);
+}
+
+// Entry `index` of the dense index array is stored `index + 1` entries from
+// the end of the buffer.
+static inline int index_symbol(struct nfst_StringTable *st, int index)
+{
+	uint32_t symbol;
+	memcpy(&symbol, (char *)st + st->allocated_bytes - (index + 1) * sizeof(symbol), sizeof(symbol));
+	return (int)symbol;
+}
+
+static inline void set_index_symbol(struct nfst_StringTable *st, int index, int symbol)
+{
+	const uint32_t v = symbol;
+	memcpy((char *)st + st->allocated_bytes - (index + 1) * sizeof(v), &v, sizeof(v));
+}
+
+// Returns the number of bytes per string used by the dense index array and
+// the prefix index array, which are stored outside the string data. Room
+// for them is always reserved, so that `nfst_pack()` can build them.
+static inline int index_bytes_per_string(const struct nfst_StringTable *st)
+{
+	return (has_dense_index(st) ? sizeof(uint32_t) : 0) +
+		(st->flags & FLAG_PREFIX_INDEX ? sizeof(uint32_t) : 0);
+}
+
+// Returns the offset from `st` of the sorted symbol array of the prefix
+// index, which is the end of the string data rounded up to 4 bytes.
+static inline int prefix_index_offset(struct nfst_StringTable *st)
+{
+	const int end = (strings(st) + st->string_bytes) - (char *)st;
+	return (end + 3) & ~3;
+}
+
+static inline uint32_t *prefix_index(struct nfst_StringTable *st)
+{
+	return (uint32_t *)((char *)st + prefix_index_offset(st));
+}
+
+static inline int is_legacy(const struct nfst_StringTable *st)
+{
+	const unsigned version = st->flags >> VERSION_SHIFT;
+	assert(version == 0 || version == FORMAT_VERSION);
+	return version == 0;
+}
+
+// Returns the maximum number of strings that can be stored with
+// `num_slots` hash slots.
+static inline int max_strings(int num_slots)
+{
+	return num_slots / 8 * 7;
+}
+
+// Loads the tags of the group starting at `group`, with acquire semantics,
+// see STORE_TAGS_32.
+static inline GroupTags load_group(const uint8_t *group)
+{
+	const uint32_t w0 = LOAD_TAGS_32(group), w1 = LOAD_TAGS_32(group + 4);
+	const uint32_t w2 = LOAD_TAGS_32(group + 8), w3 = LOAD_TAGS_32(group + 12);
+	TAGS_ACQUIRE_FENCE();
+#if defined(USE_SSE2)
+	// Combine in registers, going through memory would stall on store
+	// forwarding.
+	const __m128i lo = _mm_unpacklo_epi32(_mm_cvtsi32_si128((int)w0), _mm_cvtsi32_si128((int)w1));
+	const __m128i hi = _mm_unpacklo_epi32(_mm_cvtsi32_si128((int)w2), _mm_cvtsi32_si128((int)w3));
+	return _mm_unpacklo_epi64(lo, hi);
+#else
+	GroupTags tags;
+	memcpy(tags.tag, &w0, 4);
+	memcpy(tags.tag + 4, &w1, 4);
+	memcpy(tags.tag + 8, &w2, 4);
+	memcpy(tags.tag + 12, &w3, 4);
+	return tags;
+#endif
+}
+
+// Sets the `i`th of the `tags` to `tag`, with release semantics. The word
+// holding the tag is stored as a whole, so that it pairs with the loads of
+// `load_group()`. Only the writer stores tags, so the other tags of the
+// word can't change under us.
+static inline void store_tag(uint8_t *tags, int i, uint8_t tag)
+{
+	uint8_t * const word = tags + (i & ~3);
+	uint32_t w;
+	memcpy(&w, word, sizeof(w));
+	memcpy((uint8_t *)&w + (i & 3), &tag, 1);
+	STORE_TAGS_32(word, w);
+}
+
+// Returns a bit mask with bit `i` set if the `i`th tag in the `group` is
+// equal to `tag`.
+static inline unsigned match_group(GroupTags group, uint8_t tag)
+{
+#if defined(USE_SSE2)
+	return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)tag)));
+#else
+	unsigned mask = 0;
+	for (int i=0; i<GROUP_SIZE; ++i)
+		mask |= (unsigned)(group.tag[i] == tag) << i;
+	return mask;
+#endif
+}
+
+// Frozen tables store the displacements of the perfect hash before the
+// slots.
+static inline uint32_t *displacements(struct nfst_StringTable *st)
+{
+	return (uint32_t *)(st + 1);
+}
+
+static inline uint16_t *hashtable_16(struct nfst_StringTable *st)
+{
+	return is_frozen(st) ?
+		(uint16_t *)(displacements(st) + chd_buckets(st->num_hash_slots)) :
+		(uint16_t *)(st + 1);
+}
+
+static inline uint32_t *hashtable_32(struct nfst_StringTable *st)
+{
+	return is_frozen(st) ?
+		(uint32_t *)(displacements(st) + chd_buckets(st->num_hash_slots)) :
+		(uint32_t *)(st + 1);
+}
+
+static inline uint8_t *tags(struct nfst_StringTable *st)
+{
+	return uses_16_bit_hash_slots(st) ?
+		 (uint8_t *)(hashtable_16(st) + st->num_hash_slots) :
+		 (uint8_t *)(hashtable_32(st) + st->num_hash_slots);
+}
+
+// Frozen tables have no tags, so the strings start directly after the
+// slots. Compressed tables have no hash table at all.
+static inline char *strings(struct nfst_StringTable *st)
+{
+	if (is_compressed(st))
+		return (char *)(st + 1);
+	return (char *)(tags(st) + (is_frozen(st) ? 0 : st->num_hash_slots));
+}
+
+// Returns the number of bytes available for the string data and for new
+// entries in the dense and prefix index arrays.
+static inline int available_string_bytes(struct nfst_StringTable *st)
+{
+	const int index_bytes = st->count * index_bytes_per_string(st) +
+		(st->flags & FLAG_PREFIX_INDEX ? 3 : 0);
+	return uses_16_bit_hash_slots(st) ?
+		st->allocated_bytes - sizeof(*st) - st->num_hash_slots * (sizeof(uint16_t) + 1) - index_bytes :
+		st->allocated_bytes - sizeof(*st) - st->num_hash_slots * (sizeof(uint32_t) + 1) - index_bytes;
+}
+
+static inline int slot_symbol(struct nfst_StringTable *st, int i)
+{
+	return uses_16_bit_hash_slots(st) ? hashtable_16(st)[i] : (int)hashtable_32(st)[i];
+}
+
+static inline void set_slot(struct nfst_StringTable *st, int i, uint8_t tag, int symbol)
+{
+	if (uses_16_bit_hash_slots(st))
+		hashtable_16(st)[i] = symbol;
+	else
+		hashtable_32(st)[i] = symbol;
+	store_tag(tags(st), i, tag);
+}
+
+// Computes a new layout for `st` when it is grown to `bytes`. Only the header
+// is updated, the caller must move the strings and rebuild the hash table.
+static void grow_layout(struct nfst_StringTable *st, int bytes)
+{
+	COUNT(grows);
+	st->allocated_bytes = bytes;
+	st->flags &= ~FLAG_PREFIX_INDEX_BUILT;
+	if (is_frozen(st)) {
+		st->flags &= ~FLAG_FROZEN;
+		st->num_hash_slots = GROUP_SIZE;
+	}
+
+	float average_strlen = st->count > 0 ? (float)st->string_bytes / (float)st->count : 15.0f;
+	float bytes_per_string = average_strlen + 1 + (sizeof(uint16_t) + 1) * HASH_FACTOR +
+		index_bytes_per_string(st);
+	float num_strings = (bytes - sizeof(*st)) / bytes_per_string;
+	st->num_hash_slots = MAX(round_to_groups(num_strings * HASH_FACTOR), st->num_hash_slots);
+
+	int bytes_for_strings_32 = bytes - sizeof(*st) - (sizeof(uint32_t) + 1) * st->num_hash_slots;
+	set_16_bit_hash_slots(st, bytes_for_strings_32 <= 64*1024);
+}
+
+// Computes the smallest hash table that holds `st->count` strings with
+// `st->string_bytes` of string data. Only the header is updated.
+static void packed_layout(struct nfst_StringTable *st)
+{
+	st->num_hash_slots = round_to_groups(st->count * HASH_FACTOR);
+	while (max_strings(st->num_hash_slots) < st->count)
+		st->num_hash_slots *= 2;
+	set_16_bit_hash_slots(st, st->string_bytes <= 64*1024);
+}
+
+// Returns the size of the table `st` with no free space after the string
+// data.
+static int packed_bytes(struct nfst_StringTable *st)
+{
+	int bytes = (strings(st) + st->string_bytes) - (char *)st;
+	if (st->flags & FLAG_PREFIX_INDEX)
+		bytes = prefix_index_offset(st) + st->count * sizeof(uint32_t);
+	if (has_dense_index(st))
+		bytes += st->count * sizeof(uint32_t);
+	return bytes;
+}
+
+// Returns the number of bytes needed by the layout that the header of `st`
+// describes, or -1 if the header fields are inconsistent. Only the header
+// is read, this is used to validate tables from untrusted buffers.
+static long long layout_bytes(const struct nfst_StringTable *st)
+{
+	const long long n = st->num_hash_slots;
+	if (st->count < 0 || st->string_bytes < 0 || n <= 0)
+		return -1;
+	const int slot_bytes = uses_16_bit_hash_slots(st) ? sizeof(uint16_t) : sizeof(uint32_t);
+	long long bytes = sizeof(*st);
+
+	if (is_legacy(st))
+		return bytes + n * slot_bytes + st->string_bytes;
+
+	if (is_compressed(st)) {
+		// `num_hash_slots` is the number of front coding buckets.
+		if (st->flags & (FLAG_FROZEN | FLAG_DENSE_INDEX | FLAG_PREFIX_INDEX))
+			return -1;
+		bytes += st->string_bytes;
+		return ((bytes + 3) & ~3) + n * sizeof(uint32_t);
+	}
+
+	if (is_frozen(st)) {
+		// The displacements and one slot per string, but no tags.
+		if (n < st->count)
+			return -1;
+		bytes += chd_buckets(n) * sizeof(uint32_t) + n * slot_bytes;
+	} else {
+		// A power of two number of groups, with one tag per slot.
+		if (n % GROUP_SIZE != 0 || ((n / GROUP_SIZE) & (n / GROUP_SIZE - 1)) != 0)
+			return -1;
+		if (st->count > max_strings(n))
+			return -1;
+		bytes += n * (slot_bytes + 1);
+	}
+	bytes += st->string_bytes;
+	if (st->flags & FLAG_PREFIX_INDEX)
+		bytes = ((bytes + 3) & ~3) + (long long)st->count * sizeof(uint32_t);
+	if (has_dense_index(st))
+		bytes += (long long)st->count * sizeof(uint32_t);
+	return bytes;
+}
+
+// Sets up the header of `st` for `nfst_build()` of the `n` strings in
+// `strs`, as if they had all been added and the table packed.
+static void build_layout(struct nfst_StringTable *st, const char **strs, const int *lengths, int n, unsigned flags)
+{
+	st->flags = table_flags(flags);
+	st->count = n;
+	long long string_bytes = 1;
+	for (int i=0; i<n; ++i) {
+		const int length = lengths ? lengths[i] : string_length(strs[i]);
+		if (length)
+			string_bytes += record_header_bytes(st) + length + 1;
+	}
+	assert(string_bytes <= NFST_MAX_TABLE_BYTES);
+	st->string_bytes = (int)string_bytes;
+	packed_layout(st);
+	st->allocated_bytes = packed_bytes(st);
+}
+
+// Converts the public `NFST_*` creation flags to table flags.
+static unsigned table_flags(unsigned flags)
+{
+	unsigned table_flags = FORMAT_VERSION << VERSION_SHIFT;
+	if (flags & NFST_DENSE_INDEX)
+		table_flags |= FLAG_DENSE_INDEX;
+	if (flags & NFST_PREFIX_INDEX)
+		table_flags |= FLAG_PREFIX_INDEX;
+	table_flags |= ((flags & NFST_HASH_MASK) >> 2) << HASH_SHIFT;
+	if (flags & NFST_FOLD_CASE)
+		table_flags |= FLAG_FOLD_CASE;
+	if (flags & NFST_FOLD_PATH)
+		table_flags |= FLAG_FOLD_PATH;
+	return table_flags;
+}
+
+// Returns true if the string of the record at `chars` has been removed.
+// Removing a string clears its first character, no other string in the
+// string data is empty.
+static inline int is_removed(const char *chars)
+{
+	return chars[0] == 0;
+}
+
+// Returns the length of the string whose characters start at `chars`.
+static inline int record_length(const char *chars)
+{
+	uint16_t length;
+	memcpy(&length, chars - sizeof(length), sizeof(length));
+	if (length < LONG_STRING_LENGTH)
+		return length;
+	return LONG_STRING_LENGTH + string_length(chars + LONG_STRING_LENGTH);
+}
+
+// Writes the record header and the characters of the string `s` so that
+// the characters start at `chars`.
+static inline void write_record(char *chars, const char *s, struct HashAndLength hl)
+{
+	const uint16_t length = hl.length < LONG_STRING_LENGTH ? hl.length : LONG_STRING_LENGTH;
+	memcpy(chars - RECORD_HEADER_BYTES, &hl.hash, sizeof(hl.hash));
+	memcpy(chars - sizeof(length), &length, sizeof(length));
+	memcpy(chars, s, hl.length);
+	chars[hl.length] = 0;
+}
+
+// Looks for the string `s` with hash and length `hl` in the hash table. If
+// it is found, its symbol is returned. Otherwise, 0 is returned and `*slot`
+// is set to the empty slot where the string should be inserted.
+//
+// Candidate slots are first filtered on their tag and then compared with
+// `strings_equal()`.
+static inline int find(struct nfst_StringTable *st, const char *s, struct HashAndLength hl, int *slot)
+{
+	COUNT(lookups);
+	const uint8_t tag = hash_tag(hl.hash);
+	const uint8_t * const tg = tags(st);
+	const char * const strs = strings(st);
+	const int group_mask = st->num_hash_slots / GROUP_SIZE - 1;
+
+	int g = hl.hash & group_mask;
+	while (1) {
+		const int first = g * GROUP_SIZE;
+		const GroupTags group = load_group(tg + first);
+		for (unsigned m = match_group(group, tag); m; m &= m - 1) {
+			const int symbol = slot_symbol(st, first + lowest_bit(m));
+			if (strings_equal(st, s, hl.length, strs + symbol))
+				return symbol;
+		}
+		const unsigned empty = match_group(group, 0);
+		if (empty) {
+			*slot = first + lowest_bit(empty);
+			return 0;
+		}
+		g = (g + 1) & group_mask;
+	}
+}
+
+// Returns the symbol for the string `s` with hash and length `hl`, adding it
+// to the table if it isn't already there. Returns `NFST_STRING_TABLE_FULL` if
+// the table doesn't have room for it.
+static inline int insert(struct nfst_StringTable *st, const char *s, struct HashAndLength hl)
+{
+	int i = 0;
+	const int found = find(st, s, hl, &i);
+	if (found)
+		return found;
+	const int symbol = add(st, s, hl, i);
+	if (symbol == NFST_STRING_TABLE_FULL)
+		COUNT(full);
+	return symbol;
+}
+
+// Adds the string `s`, which is known not to be in the table, using the
+// empty hash `slot` found by `find()`. Returns its symbol or
+// `NFST_STRING_TABLE_FULL` if the table doesn't have room for it.
+static inline int add(struct nfst_StringTable *st, const char *s, struct HashAndLength hl, int slot)
+{
+	if (st->count + 1 > max_strings(st->num_hash_slots))
+		return NFST_STRING_TABLE_FULL;
+
+	const int record_bytes = record_header_bytes(st) + hl.length + 1;
+	if (st->string_bytes + record_bytes + index_bytes_per_string(st) > available_string_bytes(st))
+		return NFST_STRING_TABLE_FULL;
+
+	const int symbol = st->string_bytes + record_header_bytes(st);
+	if (uses_16_bit_hash_slots(st) && symbol > UINT16_MAX)
+		return NFST_STRING_TABLE_FULL;
+
+	// The prefix index doesn't have the new string. The flags are only
+	// written if the index was built, since lock-free readers load them.
+	if (st->flags & FLAG_PREFIX_INDEX_BUILT)
+		st->flags &= ~FLAG_PREFIX_INDEX_BUILT;
+
+	return append_record(st, s, hl, slot);
+}
+
+// Writes the record for the string `s` at the end of the string data and
+// stores its symbol in the empty `slot`. The caller must have checked that
+// there is room for it.
+static inline int append_record(struct nfst_StringTable *st, const char *s, struct HashAndLength hl, int slot)
+{
+	const int symbol = st->string_bytes + record_header_bytes(st);
+	const int record_bytes = record_header_bytes(st) + hl.length + 1;
+	char * const chars = strings(st) + symbol;
+	COUNT(inserts);
+	write_record(chars, s, hl);
+	if (has_dense_index(st)) {
+		const uint32_t index = st->count;
+		memcpy(chars - RECORD_HEADER_BYTES - sizeof(index), &index, sizeof(index));
+		set_index_symbol(st, index, symbol);
+	}
+	set_slot(st, slot, hash_tag(hl.hash), symbol);
+	st->count++;
+	st->string_bytes += record_bytes;
+	return symbol;
+}
+
+// Rebuilds the hash table and the dense index array (which is at the end of
+// the buffer, so it moves when the buffer changes size) from the records in
+// the string data block. Since the records store the hashes, no strings
+// need to be rehashed. Removed strings don't get hash slots, so this
+// clears all tombstones.
+static void rebuild_hash_table(struct nfst_StringTable *st)
+{
+	COUNT(rebuilds);
+	memset(tags(st), 0, st->num_hash_slots);
+
+	const int dense = has_dense_index(st);
+	const char * const strs = strings(st);
+	const char *s = strs + 1;
+	for (int index = 0; s < strs + st->string_bytes; ++index) {
+		const char * const chars = s + record_header_bytes(st);
+		uint32_t hash;
+		memcpy(&hash, chars - RECORD_HEADER_BYTES, sizeof(hash));
+		if (!is_removed(chars))
+			place(st, hash, chars - strs);
+		if (dense)
+			set_index_symbol(st, index, chars - strs);
+		s = chars + record_length(chars) + 1;
+	}
+}
+
+// Puts the `symbol` with the `hash` in the first empty slot of its probe
+// sequence. The string must not already be in the hash table.
+static inline void place(struct nfst_StringTable *st, uint32_t hash, int symbol)
+{
+	const uint8_t * const tg = tags(st);
+	const int group_mask = st->num_hash_slots / GROUP_SIZE - 1;
+	int g = hash & group_mask;
+	unsigned empty;
+	while (!(empty = match_group(load_group(tg + g * GROUP_SIZE), 0)))
+		g = (g + 1) & group_mask;
+	set_slot(st, g * GROUP_SIZE + lowest_bit(empty), hash_tag(hash), symbol);
+}
+
+// Allocates a growing string table without a table. The caller sets `st`.
+static struct nfst_GrowingStringTable *growing_alloc(nfst_realloc realloc, void *ud,
+	const struct nfst_GrowthPolicy *policy)
+{
+	static const struct nfst_GrowthPolicy default_policy = {2.0f, 1024, 16};
+
+	struct nfst_GrowingStringTable *gst = realloc(ud, NULL, 0, sizeof(*gst), __FILE__, __LINE__);
+	gst->realloc = realloc;
+	gst->realloc_user_data = ud;
+	gst->policy = policy ? *policy : default_policy;
+	assert(gst->policy.factor > 1.0f || gst->policy.min_grow_bytes > 0);
+	gst->st = NULL;
+	gst->old = NULL;
+	gst->read_only = 0;
+	gst->migrated = 0;
+	return gst;
+}
+
+// Returns the size that a growing table of `bytes` bytes should grow to.
+// This is at most NFST_MAX_TABLE_BYTES.
+static inline int growing_next_size(struct nfst_GrowingStringTable *gst, int bytes)
+{
+	const double next = MAX((double)bytes * gst->policy.factor, (double)bytes + gst->policy.min_grow_bytes);
+	return next < NFST_MAX_TABLE_BYTES ? (int)next : NFST_MAX_TABLE_BYTES;
+}
+
+// Looks up or adds the string `s` with the hash and length `hl` in a
+// growing table.
+static int growing_to_symbol(struct nfst_GrowingStringTable *gst, const char *s, struct HashAndLength hl)
+{
+	if (gst->read_only) {
+		const int symbol = nfst_to_symbol_const(gst->st, s);
+		if (symbol != NFST_STRING_TABLE_FULL)
+			return symbol;
+		growing_promote(gst);
+	}
+
+	if (gst->old)
+		growing_migrate(gst, gst->policy.migrate_slots);
+
+	while (1) {
+		int i = 0, unused = 0;
+		int symbol = find(gst->st, s, hl, &i);
+		if (!symbol && gst->old)
+			symbol = find(gst->old, s, hl, &unused);
+		if (symbol)
+			return symbol;
+
+		symbol = add(gst->st, s, hl, i);
+		if (symbol != NFST_STRING_TABLE_FULL)
+			return symbol;
+		if (!growing_grow(gst))
+			return NFST_STRING_TABLE_FULL;
+	}
+}
+
+// Looks up the string `s` with the hash and length `hl` in a growing
+// table. Returns `NFST_STRING_TABLE_FULL` if it isn't there.
+static int growing_find(struct nfst_GrowingStringTable *gst, const char *s, struct HashAndLength hl)
+{
+	if (gst->read_only)
+		return nfst_to_symbol_const(gst->st, s);
+
+	int i = 0;
+	int symbol = find(gst->st, s, hl, &i);
+	if (!symbol && gst->old)
+		symbol = find(gst->old, s, hl, &i);
+	return symbol ? symbol : NFST_STRING_TABLE_FULL;
+}
+
+// Copies the read-only table of a growing table opened with
+// `nfst_growing_open()` to a buffer of its own, so that strings can be
+// added to it. This also thaws frozen tables.
+static void growing_promote(struct nfst_GrowingStringTable *gst)
+{
+	const struct nfst_StringTable * const src = gst->st;
+	const int bytes = growing_next_size(gst, src->allocated_bytes);
+	struct nfst_StringTable * const st = gst->realloc(gst->realloc_user_data, NULL, 0, bytes, __FILE__, __LINE__);
+	nfst_grow_copy(st, src, bytes);
+	gst->st = st;
+	gst->read_only = 0;
+}
+
+// Grows a growing string table according to its policy. The strings are
+// copied to the new buffer, but its hash table starts out empty and is
+// filled in by `growing_migrate()`. Returns false if the table already has
+// the maximum size.
+static int growing_grow(struct nfst_GrowingStringTable *gst)
+{
+	// Only one migration can be in progress at a time.
+	if (gst->old)
+		growing_migrate(gst, gst->old->num_hash_slots);
+
+	struct nfst_StringTable * const old = gst->st;
+	const int bytes = growing_next_size(gst, old->allocated_bytes);
+	if (bytes <= old->allocated_bytes)
+		return 0;
+	struct nfst_StringTable * const st = gst->realloc(gst->realloc_user_data, NULL, 0, bytes, __FILE__, __LINE__);
+	memcpy(st, old, sizeof(*st));
+	grow_layout(st, bytes);
+	memcpy(strings(st), strings(old), old->string_bytes);
+	memset(tags(st), 0, st->num_hash_slots);
+	if (has_dense_index(st)) {
+		const int index_bytes = st->count * sizeof(uint32_t);
+		memcpy((char *)st + bytes - index_bytes, (char *)old + old->allocated_bytes - index_bytes, index_bytes);
+	}
+
+	gst->st = st;
+	gst->old = old;
+	gst->migrated = 0;
+	if (gst->policy.migrate_slots <= 0)
+		growing_migrate(gst, old->num_hash_slots);
+	return 1;
+}
+
+// Computes the hash and length of `s` for a wide table and returns the
+// partition of `s`. The partition is taken from the top bits of the 64 bit
+// hash, which are independent of the bits of the folded 32 bit hash that
+// select the hash slot in the partition.
+static inline int wide_partition(const char *s, struct HashAndLength *hl)
+{
+	hl->length = string_length(s);
+	const uint64_t h = hash_bytes_64(s, hl->length);
+	hl->hash = (uint32_t)(h >> 32) ^ (uint32_t)h;
+	return (int)(h >> 56) & (NFST_WIDE_PARTITIONS - 1);
+}
+
+// Moves the next `num_slots` hash slots of the old table to the new one.
+// When all slots have been moved, the old table is freed.
+static void growing_migrate(struct nfst_GrowingStringTable *gst, int num_slots)
+{
+	struct nfst_StringTable * const old = gst->old;
+	const int end = num_slots >= old->num_hash_slots - gst->migrated ?
+		old->num_hash_slots : gst->migrated + num_slots;
+
+	const uint8_t * const tg = tags(old);
+	const char * const strs = strings(gst->st);
+	for (int i = gst->migrated; i < end; ++i) {
+		if (!(tg[i] & 0x80))
+			continue;
+		const int symbol = slot_symbol(old, i);
+		uint32_t hash;
+		memcpy(&hash, strs + symbol - RECORD_HEADER_BYTES, sizeof(hash));
+		place(gst->st, hash, symbol);
+	}
+	gst->migrated = end;
+
+	if (gst->migrated == old->num_hash_slots) {
+		gst->realloc(gst->realloc_user_data, old, old->allocated_bytes, 0, __FILE__, __LINE__);
+		gst->old = NULL;
+	}
+}
+
+// ### Prefix index
+//
+// The prefix index is sorted in place with a quicksort that compares the
+// strings with `strcmp()`, so no extra memory is needed.
+
+static inline int compare_symbols(const char *strs, uint32_t a, uint32_t b)
+{
+	return strcmp(strs + a, strs + b);
+}
+
+static void sort_symbols(const char *strs, uint32_t *a, int n)
+{
+	while (n > 16) {
+		// Median of three pivot, moved to a[0].
+		uint32_t t;
+		const int mid = n / 2;
+		if (compare_symbols(strs, a[mid], a[0]) < 0) { t = a[mid]; a[mid] = a[0]; a[0] = t; }
+		if (compare_symbols(strs, a[n-1], a[0]) < 0) { t = a[n-1]; a[n-1] = a[0]; a[0] = t; }
+		if (compare_symbols(strs, a[n-1], a[mid]) < 0) { t = a[n-1]; a[n-1] = a[mid]; a[mid] = t; }
+		t = a[mid]; a[mid] = a[0]; a[0] = t;
+		const uint32_t pivot = a[0];
+
+		int i = 0, j = n;
+		while (1) {
+			do ++i; while (i < n && compare_symbols(strs, a[i], pivot) < 0);
+			do --j; while (compare_symbols(strs, a[j], pivot) > 0);
+			if (i >= j)
+				break;
+			t = a[i]; a[i] = a[j]; a[j] = t;
+		}
+		t = a[0]; a[0] = a[j]; a[j] = t;
+
+		// Recurse into the smaller half, loop on the larger one, to bound the
+		// stack depth.
+		if (j < n - j - 1) {
+			sort_symbols(strs, a, j);
+			a += j + 1;
+			n -= j + 1;
+		} else {
+			sort_symbols(strs, a + j + 1, n - j - 1);
+			n = j;
+		}
+	}
+
+	for (int i=1; i<n; ++i) {
+		const uint32_t v = a[i];
+		int j = i;
+		for (; j > 0 && compare_symbols(strs, a[j-1], v) > 0; --j)
+			a[j] = a[j-1];
+		a[j] = v;
+	}
+}
+
+// Fills in and sorts the prefix index. There must be room for it after the
+// string data.
+static void build_prefix_index(struct nfst_StringTable *st)
+{
+	uint32_t * const sorted = prefix_index(st);
+	int i = 0;
+	for (int sym = nfst_next_symbol(st, 0); sym; sym = nfst_next_symbol(st, sym))
+		sorted[i++] = sym;
+	sort_symbols(strings(st), sorted, st->count);
+	st->flags |= FLAG_PREFIX_INDEX_BUILT;
+}
+
+// ### Frozen tables
+//
+// The perfect hash is built with the CHD (*compress, hash and displace*)
+// algorithm. The strings are split into buckets by their hash, and for
+// each bucket a displacement is stored that moves all its strings to empty
+// slots. The displacements are found when freezing, starting with the
+// largest buckets.
+
+static inline int chd_buckets(int num_slots)
+{
+	return (num_slots + CHD_BUCKET_SIZE - 1) / CHD_BUCKET_SIZE;
+}
+
+// Number of ints of the `table` scratch array when freezing `n` strings.
+// It holds the `max(n, 1)` perfect hash slots, but is first used for the
+// counting sort of the buckets, which needs up to `n + 2` counts.
+static inline int freeze_table_ints(int n)
+{
+	return n + 2;
+}
+
+// Maps the 32 bit value `x` to the range `[0, n)` with a multiply rather
+// than a modulo.
+static inline uint32_t reduce(uint32_t x, uint32_t n)
+{
+	return (uint32_t)(((uint64_t)x * n) >> 32);
+}
+
+// Returns the bucket of a string with the 64 bit `hash`.
+static inline int chd_bucket(uint64_t hash, int num_slots)
+{
+	return reduce((uint32_t)(hash >> 32), chd_buckets(num_slots));
+}
+
+// Computes the two slot hashes `f1` and `f2` in `[0, num_slots)` from the
+// 64 bit `hash`.
+static inline void chd_hashes(uint64_t hash, int num_slots, uint32_t *f1, uint32_t *f2)
+{
+	*f1 = reduce((uint32_t)hash, num_slots);
+	*f2 = reduce((uint32_t)((hash * 0x9e3779b97f4a7c15ull) >> 32), num_slots);
+}
+
+// Returns the slot of a string with the slot hashes `f1` and `f2` in a
+// bucket with the `displacement`. The displacement is `d1*num_slots + d0`
+// and the slot is `f1 + d1*f2 + d0` modulo the number of slots. Most
+// buckets have `d1 = 0`, which needs no division.
+static inline int chd_slot(uint32_t f1, uint32_t f2, uint32_t displacement, int num_slots)
+{
+	const uint32_t m = (uint32_t)num_slots;
+	if (displacement < m) {
+		const uint32_t slot = f1 + displacement;
+		return (int)(slot < m ? slot : slot - m);
+	}
+	const uint64_t d0 = displacement % m;
+	const uint64_t d1 = displacement / m;
+	return (int)((f1 + d1 * f2 + d0) % m);
+}
+
+// Looks up the string `s` of `length` characters in a frozen table. Returns
+// its symbol or 0 if it isn't in the table.
+static int frozen_find(struct nfst_StringTable *st, const char *s, int length)
+{
+	COUNT(lookups);
+	const uint64_t hash = table_hash_64(st, s, length);
+	const int m = st->num_hash_slots;
+	uint32_t f1, f2;
+	chd_hashes(hash, m, &f1, &f2);
+	const uint32_t displacement = displacements(st)[chd_bucket(hash, m)];
+	const int symbol = slot_symbol(st, chd_slot(f1, f2, displacement, m));
+	if (!symbol)
+		return 0;
+	return strings_equal(st, s, length, strings(st) + symbol) ? symbol : 0;
+}
+
+// ### Compressed tables
+//
+// The bucket directory holds the offset of the first string of each bucket
+// in the string data. The shared prefix lengths are stored as LEB128
+// varints. They are always the full length of the common prefix, which
+// lets `compressed_find()` compare a bucket with the searched string
+// without decoding it.
+
+static inline int is_compressed(const struct nfst_StringTable *st)
+{
+	return (st->flags & FLAG_COMPRESSED) != 0;
+}
+
+static inline uint32_t *bucket_directory(struct nfst_StringTable *st)
+{
+	return (uint32_t *)((char *)st + prefix_index_offset(st));
+}
+
+// Writes `v` as a varint to `p` and returns the number of bytes written.
+static inline int write_varint(char *p, unsigned v)
+{
+	int n = 0;
+	for (; v >= 0x80; v >>= 7)
+		p[n++] = (char)(0x80 | (v & 0x7f));
+	p[n++] = (char)v;
+	return n;
+}
+
+// Reads a varint from `*p` and advances `*p` past it.
+static inline unsigned read_varint(const char **p)
+{
+	unsigned v = 0;
+	int shift = 0;
+	const unsigned char *q = (const unsigned char *)*p;
+	for (; *q & 0x80; ++q, shift += 7)
+		v |= (unsigned)(*q & 0x7f) << shift;
+	v |= (unsigned)*q << shift;
+	*p = (const char *)(q + 1);
+	return v;
+}
+
+// Returns the number of leading characters that the `length` characters at
+// `s` have in common with the zero terminated string `z`.
+static inline int common_prefix(const char *s, int length, const char *z)
+{
+	int i = 0;
+	while (i < length && z[i] && s[i] == z[i])
+		++i;
+	return i;
+}
+
+// Looks up the string `s` of `length` characters in a compressed table.
+// Returns its symbol or 0 if it isn't in the table.
+static int compressed_find(struct nfst_StringTable *st, const char *s, int length)
+{
+	COUNT(lookups);
+	const uint32_t * const directory = bucket_directory(st);
+	const char * const data = strings(st);
+
+	// Find the last bucket whose first string is <= s.
+	int lo = 0, hi = st->num_hash_slots;
+	while (lo < hi) {
+		const int mid = lo + (hi - lo) / 2;
+		const char * const first = data + directory[mid];
+		const int k = common_prefix(s, length, first);
+		const int less = k < length && (!first[k] || (unsigned char)first[k] < (unsigned char)s[k]);
+		if (less || (k == length && !first[k]))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return 0;
+
+	// Scan the bucket. `matched` is the length of the common prefix of `s`
+	// and the previous string, which is smaller than `s`. A string that
+	// shares more than that with the previous string is also smaller than
+	// `s` and one that shares less is larger, so only strings that share
+	// exactly `matched` characters need to be compared.
+	const int bucket = lo - 1;
+	const int first = bucket * FRONT_CODING_BUCKET_SIZE;
+	const int last = MIN(first + FRONT_CODING_BUCKET_SIZE, st->count);
+	const char *p = data + directory[bucket];
+	int matched = 0;
+	for (int i = first; i < last; ++i) {
+		const int shared = i > first ? (int)read_varint(&p) : 0;
+		if (shared < matched)
+			return 0;
+		if (shared == matched) {
+			const int k = matched + common_prefix(s + matched, length - matched, p);
+			const unsigned char c = (unsigned char)p[k - matched];
+			if (k == length)
+				return c ? 0 : i + 1;
+			if (c > (unsigned char)s[k])
+				return 0;
+			matched = k;
+		}
+		p += string_length(p) + 1;
+	}
+	return 0;
+}
+
+// Decodes the string with the non-zero `symbol` from a compressed table, as
+// described for `nfst_to_string_buf()`. Only the length is computed if
+// `size` is 0.
+static int compressed_decode(struct nfst_StringTable *st, int symbol, char *buffer, int size)
+{
+	const int index = symbol - 1;
+	const int bucket = index / FRONT_CODING_BUCKET_SIZE;
+	const int first = bucket * FRONT_CODING_BUCKET_SIZE;
+	const char *p = strings(st) + bucket_directory(st)[bucket];
+
+	// Characters beyond `size - 1` are never output, so the shared prefix
+	// that is still in the buffer from the previous string is always
+	// enough.
+	int length = 0;
+	for (int i = first; i <= index; ++i) {
+		length = i > first ? (int)read_varint(&p) : 0;
+		for (; *p; ++p, ++length) {
+			if (length < size - 1)
+				buffer[length] = *p;
+		}
+		++p;
+	}
+	if (size > 0)
+		buffer[MIN(length, size - 1)] = 0;
+	return length;
+}
+
+// ### Folding
+//
+// A `FoldReader` returns the characters of a string as they are after
+// folding, one at a time, so that strings can be hashed and compared
+// without making a folded copy.
+
+struct FoldReader
+{
+	const char *p;
+	const char *end;
+	unsigned fold;
+
+	// True at the start of a path segment, where a `.` segment can begin.
+	int segment_start;
+
+	// True when anything but a separator has been read. A separator before
+	// that makes the path absolute and is returned right away.
+	int started;
+
+	// True if a character that isn't a separator has been returned.
+	int any;
+
+	// True if the last character returned was a separator.
+	int last_separator;
+
+	// True if a separator has been read that hasn't been returned yet.
+	// Separators are only returned when they are followed by something, so
+	// that trailing separators are ignored.
+	int pending_separator;
+};
+
+static inline struct FoldReader fold_reader(unsigned fold, const char *s, int n)
+{
+	struct FoldReader r = {s, s + n, fold, 1, 0, 0, 0, 0};
+	return r;
+}
+
+static inline int is_separator(char c)
+{
+	return c == '/' || c == '\\';
+}
+
+// Returns the next folded character or -1 at the end of the string.
+static inline int fold_next(struct FoldReader *r)
+{
+	while (r->p < r->end) {
+		unsigned char c = (unsigned char)*r->p++;
+		if (r->fold & FLAG_FOLD_PATH) {
+			if (is_separator(c)) {
+				r->segment_start = 1;
+				if (!r->started) {
+					r->started = r->last_separator = 1;
+					return '/';
+				}
+				r->pending_separator = r->any && !r->last_separator;
+				continue;
+			}
+			r->started = 1;
+			if (c == '.' && r->segment_start && (r->p == r->end || is_separator(*r->p)))
+				continue;
+			r->segment_start = 0;
+			if (r->pending_separator) {
+				// Return the separator and read `c` again on the next call.
+				r->pending_separator = 0;
+				r->last_separator = 1;
+				--r->p;
+				return '/';
+			}
+			r->last_separator = 0;
+			r->any = 1;
+		}
+		if ((r->fold & FLAG_FOLD_CASE) && c >= 'A' && c <= 'Z')
+			c += 'a' - 'A';
+		return c;
+	}
+	return -1;
+}
+
+// Hashes the folded version of the `n` characters at `s`. The folded
+// characters are collected in two 64 bit lanes, like in `hash_bytes_64()`,
+// but since the folded length isn't known up front, it is mixed in at the
+// end.
+static uint64_t fold_hash_64(unsigned fold, const char *s, int n)
+{
+	const uint64_t k1 = 0x9e3779b97f4a7c15ull;
+	const uint64_t k2 = 0xc2b2ae3d27d4eb4full;
+
+	struct FoldReader r = fold_reader(fold, s, n);
+	uint64_t h1 = k1, h2 = k2;
+	uint64_t lanes[2] = {0, 0};
+	int length = 0, c;
+	while ((c = fold_next(&r)) >= 0) {
+		const int i = length++ & 15;
+		lanes[i >> 3] |= (uint64_t)c << (8 * (i & 7));
+		if (i == 15) {
+			h1 = rotl_64((h1 ^ lanes[0]) * k1, 31);
+			h2 = rotl_64((h2 ^ lanes[1]) * k2, 29);
+			lanes[0] = lanes[1] = 0;
+		}
+	}
+	if (length & 15) {
+		h1 = rotl_64((h1 ^ lanes[0]) * k1, 31);
+		h2 = rotl_64((h2 ^ lanes[1]) * k2, 29);
+	}
+
+	uint64_t h = h1 ^ rotl_64(h2, 32) ^ (uint64_t)length * k2;
+	h ^= h >> 33;
+	h *= k2;
+	h ^= h >> 29;
+	return h;
+}
+
+// Returns true if the `a_length` characters at `a` and the `b_length`
+// characters at `b` are equal after folding.
+static int fold_equal(unsigned fold, const char *a, int a_length, const char *b, int b_length)
+{
+	struct FoldReader ra = fold_reader(fold, a, a_length);
+	struct FoldReader rb = fold_reader(fold, b, b_length);
+	while (1) {
+		const int ca = fold_next(&ra);
+		if (ca != fold_next(&rb))
+			return 0;
+		if (ca < 0)
+			return 1;
+	}
+}
+
+// ### Legacy tables
+//
+// Tables created before the format was versioned used a Lua derived hash
+// function and linear probing with one 16 or 32 bit slot per step (and no
+// tags). The strings were stored back-to-back without any record headers.
+//
+// Such tables can still be loaded and used with `nfst_to_symbol_const()`,
+// `nfst_to_string()` and `nfst_to_symbol()`, but new strings can't be added
+// to them (`nfst_to_symbol()` returns `NFST_STRING_TABLE_FULL`). Growing
+// them re-inserts the strings in the current format with
+// `legacy_upgrade()`, so that the usual grow and retry loop works.
+
+static inline uint32_t legacy_hash(const char *s, int length)
+{
+	uint32_t h = 0;
+	for (int i=0; i<length; ++i)
+		h = h ^ ((h<<5) + (h>>2) + (unsigned char)s[i]);
+	return h;
+}
+
+static inline char *legacy_strings(struct nfst_StringTable *st)
+{
+	return uses_16_bit_hash_slots(st) ?
+		 (char *)(hashtable_16(st) + st->num_hash_slots) :
+		 (char *)(hashtable_32(st) + st->num_hash_slots);
+}
+
+static int legacy_to_symbol_const(struct nfst_StringTable *st, const char *s, int length)
+{
+	COUNT(lookups);
+	const char * const strs = legacy_strings(st);
+	int i = legacy_hash(s, length) % st->num_hash_slots;
+	int symbol;
+	while ((symbol = uses_16_bit_hash_slots(st) ? hashtable_16(st)[i] : (int)hashtable_32(st)[i])) {
+		if (strncmp(s, strs + symbol, length) == 0 && strs[symbol + length] == 0)
+			return symbol;
+		i = (i+1) % st->num_hash_slots;
+	}
+	return NFST_STRING_TABLE_FULL;
+}
+
+// Upgrades the legacy table `src` to the current format in the `bytes`
+// large buffer at `dst`, which may be the same as `src`. The strings are
+// re-inserted in the same order with record headers, so their symbols
+// change. When upgrading in place, the old string data is first moved to
+// the end of the buffer, so it needs room there too. Returns false, and
+// leaves `dst` untouched, if the upgraded table doesn't fit.
+static int legacy_upgrade(struct nfst_StringTable *dst, const struct nfst_StringTable *src, int bytes)
+{
+	struct nfst_StringTable st = {0};
+	st.count = src->count;
+	st.flags = table_flags(0);
+	st.num_hash_slots = GROUP_SIZE;
+	st.string_bytes = src->string_bytes + src->count * RECORD_HEADER_BYTES;
+	grow_layout(&st, bytes);
+	while (max_strings(st.num_hash_slots) < st.count)
+		st.num_hash_slots *= 2;
+	if (st.string_bytes > UINT16_MAX)
+		set_16_bit_hash_slots(&st, 0);
+
+	const int slot_bytes = uses_16_bit_hash_slots(&st) ? sizeof(uint16_t) : sizeof(uint32_t);
+	const int old_string_bytes = src->string_bytes;
+	const long long needed = sizeof(st) + (long long)st.num_hash_slots * (slot_bytes + 1) +
+		st.string_bytes + (dst == src ? old_string_bytes : 0);
+	if (needed > bytes)
+		return 0;
+
+	const char *old_strings = legacy_strings((struct nfst_StringTable *)src);
+	if (dst == src) {
+		char * const parked = (char *)dst + bytes - old_string_bytes;
+		memmove(parked, old_strings, old_string_bytes);
+		old_strings = parked;
+	}
+
+	memcpy(dst, &st, sizeof(st));
+	char * const strs = strings(dst);
+	strs[0] = 0;
+	dst->string_bytes = 1;
+	dst->count = 0;
+	for (const char *s = old_strings + 1; s < old_strings + old_string_bytes; ) {
+		const int length = strlen(s);
+		const struct HashAndLength hl = {table_hash(dst, s, length), length};
+		write_record(strs + dst->string_bytes + RECORD_HEADER_BYTES, s, hl);
+		dst->string_bytes += RECORD_HEADER_BYTES + length + 1;
+		dst->count++;
+		s += length + 1;
+	}
+	rebuild_hash_table(dst);
+	return 1;
+}
+
+// ## Unit Test
+
+#ifdef NFST_UNIT_TEST
+
+	#include <stdio.h>
+	#include <assert.h>
+	#include <stdlib.h>
 
 	#define assert_strequal(a,b)	assert(strcmp((a), (b)) == 0)
 
-	static struct nfst_StringTable *grow(struct nfst_StringTable *st)
-	{
-		st = realloc(st, st->allocated_bytes * 2);
-		nfst_grow(st, st->allocated_bytes * 2);
-		return st;
-	}
+	static struct nfst_StringTable *grow(struct nfst_StringTable *st)
+	{
+		st = realloc(st, st->allocated_bytes * 2);
+		nfst_grow(st, st->allocated_bytes * 2);
+		return st;
+	}
+
+	// Creates a table in the legacy format, the way unversioned versions of
+	// this file did, with 16 bit slots.
+	static void legacy_create(struct nfst_StringTable *st, int bytes, int num_hash_slots,
+		const char **strs, int n)
+	{
+		st->allocated_bytes = bytes;
+		st->count = n;
+		st->flags = 1;
+		st->num_hash_slots = num_hash_slots;
+		uint16_t *ht = hashtable_16(st);
+		memset(ht, 0, num_hash_slots * sizeof(uint16_t));
+		char *strings = legacy_strings(st);
+		strings[0] = 0;
+		st->string_bytes = 1;
+		for (int j=0; j<n; ++j) {
+			int i = legacy_hash(strs[j], strlen(strs[j])) % num_hash_slots;
+			while (ht[i])
+				i = (i+1) % num_hash_slots;
+			ht[i] = st->string_bytes;
+			strcpy(strings + st->string_bytes, strs[j]);
+			st->string_bytes += strlen(strs[j]) + 1;
+		}
+	}
+
+	static int allocated_bytes;
+
+	static void *counting_realloc(void *ud, void *ptr, int osize, int nsize, const char *file, int line)
+	{
+		allocated_bytes += nsize - osize;
+		return realloc(ptr, nsize);
+	}
+
+	#if !defined(_WIN32)
+		#include <pthread.h>
+
+		// Shared state of the threading test. The writer adds the strings
+		// "t0", "t1", ... to `threading_st` and publishes how many it has
+		// added in `threading_published`.
+		#define THREADING_STRINGS (20000)
+		static struct nfst_StringTable *threading_st;
+		static int threading_published;
+
+		// Reader thread of the threading test. Strings that have been
+		// published must be found. Strings beyond that may or may not have
+		// been added yet, but if they are found, they must be complete.
+		static void *threading_reader(void *arg)
+		{
+			unsigned r = (unsigned)(uintptr_t)arg;
+			int n = 0;
+			while (n < THREADING_STRINGS) {
+				n = __atomic_load_n(&threading_published, __ATOMIC_ACQUIRE);
+				for (int k=0; k<64; ++k) {
+					r = r * 1103515245u + 12345u;
+					const int i = (int)((r >> 8) % (unsigned)(n + 64));
+					char s[16];
+					sprintf(s, "t%i", i);
+					const int sym = nfst_to_symbol_const(threading_st, s);
+					assert(i >= n || sym > 0);
+					if (sym != NFST_STRING_TABLE_FULL)
+						assert_strequal(nfst_to_string(threading_st, sym), s);
+				}
+			}
+			return NULL;
+		}
+	#endif
+
+	int main(int argc, char **argv)
+	{
+		struct HashAndLength hl = hash_and_length("niklas frykholm");
+		assert(hl.length == 15);
+
+		// Hash and length test. Checks all lengths and alignments around the
+		// block sizes used by the vectorized scan.
+		{
+			char reference[128];
+			char buffer[256];
+			for (int len = 0; len < 100; ++len) {
+				memset(reference, 'x', len);
+				reference[len] = 0;
+				const struct HashAndLength expected = hash_and_length(reference);
+				assert(expected.length == len);
+				for (int align = 0; align < 32; ++align) {
+					char *s = buffer + align;
+					memcpy(s, reference, len + 1);
+					const struct HashAndLength h = hash_and_length(s);
+					assert(h.length == len);
+					assert(h.hash == expected.hash);
+				}
+			}
+			// Partial loads give the same hashes as zero padding the tail.
+			for (int len = 0; len < 40; ++len) {
+				for (int align = 0; align < 8; ++align) {
+					const char *text = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJ" + align;
+					const uint64_t k1 = 0x9e3779b97f4a7c15ull, k2 = 0xc2b2ae3d27d4eb4full;
+					uint64_t h1 = (uint64_t)len * k1, h2 = (uint64_t)len ^ k2;
+					int i = 0;
+					for (; i + 16 <= len; i += 16) {
+						h1 = rotl_64((h1 ^ load_64(text + i)) * k1, 31);
+						h2 = rotl_64((h2 ^ load_64(text + i + 8)) * k2, 29);
+					}
+					if (i < len) {
+						char tail[16] = {0};
+						memcpy(tail, text + i, len - i);
+						h1 = rotl_64((h1 ^ load_64(tail)) * k1, 31);
+						h2 = rotl_64((h2 ^ load_64(tail + 8)) * k2, 29);
+					}
+					uint64_t h = h1 ^ rotl_64(h2, 32);
+					h ^= h >> 33;
+					h *= k2;
+					h ^= h >> 29;
+					assert(hash_bytes_64(text, len) == h);
+				}
+			}
+			assert(hash_and_length("abc").hash != hash_and_length("abd").hash);
+			assert(hash_and_length("x").hash != hash_and_length("xx").hash);
+		}
+
+		// Basic test
+		{
+			char buffer[1024];
+			struct nfst_StringTable * const st = (struct nfst_StringTable *)buffer;
+			nfst_init(st, 1024, 10);
+
+			assert(nfst_to_symbol(st, "") == 0);
+			assert_strequal("", nfst_to_string(st, 0));
+
+			int sym_niklas = nfst_to_symbol(st, "niklas");
+			int sym_frykholm = nfst_to_symbol(st, "frykholm");
+
+			assert(sym_niklas == nfst_to_symbol(st, "niklas"));
+			assert(sym_frykholm == nfst_to_symbol(st, "frykholm"));
+			assert(sym_niklas != sym_frykholm);
+
+			assert(sym_niklas == nfst_to_symbol_const(st, "niklas"));
+			assert(NFST_STRING_TABLE_FULL == nfst_to_symbol_const(st, "lax"));
+
+			assert_strequal("niklas", nfst_to_string(st, sym_niklas));
+			assert_strequal("frykholm", nfst_to_string(st, sym_frykholm));
+			assert(nfst_to_string_len(st, sym_niklas) == 6);
+			assert(nfst_to_string_len(st, 0) == 0);
+
+			assert(nfst_next_symbol(st, 0) == sym_niklas);
+			assert(nfst_next_symbol(st, sym_niklas) == sym_frykholm);
+			assert(nfst_next_symbol(st, sym_frykholm) == 0);
+		}
+
+		// Long string test
+		{
+			const int n = 100*1000;
+			char *s = malloc(n + 1);
+			memset(s, 'x', n);
+			s[n] = 0;
+
+			struct nfst_StringTable * const st = malloc(4*n);
+			nfst_init(st, 4*n, n);
+			int sym_long = nfst_to_symbol(st, s);
+			assert(sym_long > 0);
+			assert(nfst_to_string_len(st, sym_long) == n);
+			assert(nfst_to_symbol(st, "x") != sym_long);
+			assert(nfst_to_symbol_const(st, s) == sym_long);
+			s[n-1] = 'y';
+			assert(nfst_to_symbol_const(st, s) == NFST_STRING_TABLE_FULL);
+			nfst_pack(st);
+			s[n-1] = 'x';
+			assert(nfst_to_symbol_const(st, s) == sym_long);
+			assert_strequal(s, nfst_to_string(st, sym_long));
+
+			free(st);
+			free(s);
+		}
+
+		// Grow copy test
+		{
+			char buffer[1024];
+			struct nfst_StringTable * const st = (struct nfst_StringTable *)buffer;
+			nfst_init(st, 256, 4);
+
+			int syms[100];
+			int n = 0;
+			for (; n < 100; ++n) {
+				char s[10];
+				sprintf(s, "%i", n);
+				syms[n] = nfst_to_symbol(st, s);
+				if (syms[n] == NFST_STRING_TABLE_FULL)
+					break;
+			}
+			assert(n > 0 && n < 100);
+
+			char copy_buffer[4096];
+			struct nfst_StringTable * const copy = (struct nfst_StringTable *)copy_buffer;
+			nfst_grow_copy(copy, st, 4096);
+			for (int i=0; i<100; ++i) {
+				char s[10];
+				sprintf(s, "%i", i);
+				int sym = nfst_to_symbol(copy, s);
+				if (i < n) {
+					assert(sym == syms[i]);
+					assert(nfst_to_symbol_const(st, s) == sym);
+				} else {
+					assert(nfst_to_symbol_const(st, s) == NFST_STRING_TABLE_FULL);
+				}
+				assert_strequal(s, nfst_to_string(copy, sym));
+			}
+		}
+
+		// Legacy test
+		{
+			char buffer[1024];
+			struct nfst_StringTable * const st = (struct nfst_StringTable *)buffer;
+			const char *strs[] = {"niklas", "frykholm", "lax"};
+			legacy_create(st, 1024, 7, strs, 3);
+
+			assert(nfst_to_symbol_const(st, "") == 0);
+			int sym_niklas = nfst_to_symbol_const(st, "niklas");
+			int sym_lax = nfst_to_symbol_const(st, "lax");
+			assert(sym_niklas == 1);
+			assert(sym_lax == 1 + 7 + 9);
+			assert(nfst_to_symbol(st, "frykholm") == 1 + 7);
+			assert_strequal("lax", nfst_to_string(st, sym_lax));
+			assert(nfst_to_string_len(st, sym_lax) == 3);
+			assert(nfst_next_symbol(st, 0) == sym_niklas);
+			assert(nfst_next_symbol(st, sym_niklas) == 1 + 7);
+			assert(nfst_next_symbol(st, sym_lax) == 0);
+			assert(nfst_to_symbol_const(st, "salmon") == NFST_STRING_TABLE_FULL);
+			assert(nfst_to_symbol(st, "salmon") == NFST_STRING_TABLE_FULL);
+
+			const char *batch[] = {"lax", "", "niklas", "salmon"};
+			const int lengths[] = {3, 0, 3, 6};
+			int syms[4];
+			assert(nfst_to_symbols(st, batch, NULL, 4, syms) == 3);
+			assert(syms[0] == sym_lax && syms[1] == 0 && syms[2] == sym_niklas);
+			assert(nfst_to_symbols(st, batch, lengths, 4, syms) == 2);
+
+			// Growing upgrades the table, so strings can be added. The old
+			// strings get new symbols, but keep their order.
+			for (int copy = 0; copy < 2; ++copy) {
+				struct nfst_StringTable *up = realloc(NULL, copy ? 1024 : 64);
+				if (copy) {
+					nfst_grow_copy(up, st, 1024);
+					assert(nfst_to_symbol_const(st, "lax") == sym_lax);
+				} else {
+					legacy_create(up, 64, 7, strs, 3);
+				}
+				while (nfst_to_symbol(up, "salmon") == NFST_STRING_TABLE_FULL)
+					up = grow(up);
+				assert(!is_legacy(up));
+				assert(nfst_count(up) == 4);
+				int sym = 0;
+				for (int i=0; i<3; ++i) {
+					sym = nfst_next_symbol(up, sym);
+					assert_strequal(strs[i], nfst_to_string(up, sym));
+					assert(nfst_to_symbol_const(up, strs[i]) == sym);
+					assert(nfst_to_string_len(up, sym) == (int)strlen(strs[i]));
+				}
+				sym = nfst_next_symbol(up, sym);
+				assert(sym == nfst_to_symbol_const(up, "salmon"));
+				assert_strequal("salmon", nfst_to_string(up, sym));
+				assert(nfst_next_symbol(up, sym) == 0);
+				free(up);
+			}
+
+			// A table that is too small for the upgrade stays legacy.
+			char small[64];
+			struct nfst_StringTable * const legacy = (struct nfst_StringTable *)small;
+			legacy_create(legacy, 48, 7, strs, 3);
+			nfst_grow(legacy, 64);
+			assert(is_legacy(legacy) && legacy->allocated_bytes == 64);
+			assert(nfst_to_symbol_const(legacy, "lax") == sym_lax);
+			assert(nfst_to_symbol(legacy, "salmon") == NFST_STRING_TABLE_FULL);
+		}
+
+		// Batch test
+		{
+			struct nfst_StringTable * st = realloc(NULL, MIN_SIZE);
+			nfst_init(st, MIN_SIZE, 4);
+
+			const int n = 10000;
+			char (*s)[10] = malloc(n * sizeof(*s));
+			const char **strs = malloc(n * sizeof(*strs));
+			int *syms = malloc(n * sizeof(*syms));
+			for (int i=0; i<n; ++i) {
+				sprintf(s[i], "%i", i % 5000);
+				strs[i] = s[i];
+			}
+			strs[17] = "";
+
+			int done = 0;
+			while ((done += nfst_to_symbols(st, strs + done, NULL, n - done, syms + done)) < n)
+				st = grow(st);
+
+			assert(st->count == 5000);
+			assert(syms[17] == 0);
+			for (int i=0; i<n; ++i) {
+				assert(syms[i] == nfst_to_symbol_const(st, strs[i]));
+				assert_strequal(strs[i], nfst_to_string(st, syms[i]));
+			}
+
+			// Strings given by length don't have to be zero terminated.
+			const char *text = "niklas frykholm";
+			const char *words[] = {text, text + 7, text};
+			const int lengths[] = {6, 8, 3};
+			int word_syms[3];
+			assert(nfst_to_symbols(st, words, lengths, 3, word_syms) == 3);
+			assert_strequal("niklas", nfst_to_string(st, word_syms[0]));
+			assert_strequal("frykholm", nfst_to_string(st, word_syms[1]));
+			assert_strequal("nik", nfst_to_string(st, word_syms[2]));
+
+			free(syms);
+			free(strs);
+			free(s);
+			free(st);
+		}
+
+		// Freeze test
+		{
+			struct nfst_StringTable * st = realloc(NULL, MIN_SIZE);
+			nfst_init(st, MIN_SIZE, 4);
+			int syms[10000];
+			for (int i=0; i<10000; ++i) {
+				char s[10];
+				sprintf(s, "%i", i);
+				while ((syms[i] = nfst_to_symbol(st, s)) == NFST_STRING_TABLE_FULL)
+					st = grow(st);
+			}
+			const int packed_bytes = nfst_pack(st);
+
+			const int scratch_bytes = nfst_freeze_scratch_bytes(st);
+			void *scratch = malloc(scratch_bytes);
+			const int frozen_bytes = nfst_freeze(st, scratch, scratch_bytes);
+			free(scratch);
+			assert(frozen_bytes > 0 && frozen_bytes < packed_bytes);
+			assert(is_frozen(st));
+			st = realloc(st, frozen_bytes);
+
+			for (int i=0; i<10000; ++i) {
+				char s[10];
+				sprintf(s, "%i", i);
+				assert(nfst_to_symbol_const(st, s) == syms[i]);
+				assert(nfst_to_symbol(st, s) == syms[i]);
+				assert_strequal(s, nfst_to_string(st, syms[i]));
+			}
+			assert(nfst_to_symbol_const(st, "") == 0);
+			assert(nfst_to_symbol_const(st, "10000") == NFST_STRING_TABLE_FULL);
+			assert(nfst_to_symbol_const(st, "x") == NFST_STRING_TABLE_FULL);
+			assert(nfst_to_symbol(st, "10000") == NFST_STRING_TABLE_FULL);
+			assert(nfst_next_symbol(st, 0) == syms[0]);
+
+			const char *batch[] = {"17", "", "x"};
+			int batch_syms[3];
+			assert(nfst_to_symbols(st, batch, NULL, 3, batch_syms) == 2);
+			assert(batch_syms[0] == syms[17] && batch_syms[1] == 0);
+
+			// Thaw
+			st = grow(st);
+			assert(!is_frozen(st));
+			assert(nfst_to_symbol_const(st, "9999") == syms[9999]);
+			assert(nfst_to_symbol(st, "10000") > 0);
+
+			// Freezing an empty table
+			char buffer[256];
+			struct nfst_StringTable * const empty = (struct nfst_StringTable *)buffer;
+			nfst_init(empty, 256, 4);
+			uint64_t small_scratch[8];
+			assert(nfst_freeze_scratch_bytes(empty) <= sizeof(small_scratch));
+			assert(nfst_freeze(empty, small_scratch, sizeof(small_scratch)) > 0);
+			assert(nfst_to_symbol_const(empty, "x") == NFST_STRING_TABLE_FULL);
+			assert(nfst_to_symbol_const(empty, "") == 0);
+
+			// Freezing small tables, with scratch memory of exactly the
+			// required size.
+			static const int small_counts[] = {1, 2, 5};
+			for (int c=0; c<3; ++c) {
+				const int n = small_counts[c];
+				struct nfst_StringTable *small = realloc(NULL, 256);
+				nfst_init(small, 256, 4);
+				int small_syms[5];
+				for (int i=0; i<n; ++i) {
+					char s[10];
+					sprintf(s, "s%i", i);
+					small_syms[i] = nfst_to_symbol(small, s);
+					assert(small_syms[i] > 0);
+				}
+				const int small_bytes = nfst_pack(small);
+				const int scratch_bytes = nfst_freeze_scratch_bytes(small);
+				void *scratch = malloc(scratch_bytes);
+				const int frozen_bytes = nfst_freeze(small, scratch, scratch_bytes);
+				free(scratch);
+				assert(frozen_bytes > 0);
+				small = realloc(small, frozen_bytes);
+				for (int i=0; i<n; ++i) {
+					char s[10];
+					sprintf(s, "s%i", i);
+					assert(nfst_to_symbol_const(small, s) == small_syms[i]);
+				}
+				assert(nfst_to_symbol_const(small, "x") == NFST_STRING_TABLE_FULL);
+
+				// Thawing needs at least the size the table had before it was
+				// frozen.
+				small = realloc(small, small_bytes);
+				nfst_grow(small, small_bytes);
+				assert(!is_frozen(small));
+				assert(nfst_to_symbol_const(small, "s0") == small_syms[0]);
+				free(small);
+			}
+
+			free(st);
+		}
+
+		// Growing test
+		{
+			const struct nfst_GrowthPolicy policy = {1.5f, 0, 4};
+			struct nfst_GrowingStringTable *gst = nfst_make(counting_realloc, NULL, 0, 4, &policy);
+
+			int syms[10000];
+			int migrating = 0;
+			for (int i=0; i<10000; ++i) {
+				char s[10];
+				sprintf(s, "%i", i);
+				syms[i] = nfst_growing_to_symbol(gst, s);
+				assert(syms[i] > 0);
+				migrating += gst->old != NULL;
+
+				// Every third string is looked up again right away, so that some
+				// lookups hit strings that are still in the old hash table.
+				sprintf(s, "%i", i / 3);
+				assert(nfst_growing_to_symbol(gst, s) == syms[i / 3]);
+			}
+			assert(migrating > 0);
+			assert(nfst_growing_to_symbol_const(gst, "10000") == NFST_STRING_TABLE_FULL);
+
+			for (int i=0; i<10000; ++i) {
+				char s[10];
+				sprintf(s, "%i", i);
+				assert(nfst_growing_to_symbol_const(gst, s) == syms[i]);
+				assert_strequal(s, nfst_growing_to_string(gst, syms[i]));
+			}
+
+			struct nfst_StringTable *st = nfst_growing_table(gst);
+			assert(gst->old == NULL);
+			assert(st->count == 10000);
+			for (int i=0; i<10000; ++i) {
+				char s[10];
+				sprintf(s, "%i", i);
+				assert(nfst_to_symbol_const(st, s) == syms[i]);
+			}
+
+			nfst_free(gst);
+			assert(allocated_bytes == 0);
+		}
+
+		// Dense index test
+		{
+			struct nfst_StringTable *st = realloc(NULL, MIN_SIZE);
+			nfst_init_with_flags(st, MIN_SIZE, 4, NFST_DENSE_INDEX);
+			int syms[1000];
+			for (int i=0; i<1000; ++i) {
+				char s[10];
+				sprintf(s, "%i", i);
+				while ((syms[i] = nfst_to_symbol(st, s)) == NFST_STRING_TABLE_FULL)
+					st = grow(st);
+				assert(nfst_symbol_to_index(st, syms[i]) == i);
+				assert(nfst_to_symbol(st, "0") == syms[0]);
+			}
+			assert(nfst_count(st) == 1000);
+			assert(nfst_symbol_to_index(st, 0) == -1);
+			assert(nfst_next_symbol(st, syms[998]) == syms[999]);
+
+			for (int pass = 0; pass < 3; ++pass) {
+				if (pass == 1) {
+					st = realloc(st, nfst_pack(st));
+				} else if (pass == 2) {
+					uint64_t *scratch = malloc(nfst_freeze_scratch_bytes(st));
+					st = realloc(st, nfst_freeze(st, scratch, nfst_freeze_scratch_bytes(st)));
+					free(scratch);
+				}
+				for (int i=0; i<1000; ++i) {
+					char s[10];
+					sprintf(s, "%i", i);
+					assert(nfst_to_symbol_const(st, s) == syms[i]);
+					assert(nfst_index_to_symbol(st, i) == syms[i]);
+					assert(nfst_symbol_to_index(st, syms[i]) == i);
+				}
+			}
+
+			// Thaw and continue adding
+			st = grow(st);
+			assert(nfst_symbol_to_index(st, nfst_to_symbol(st, "1000")) == 1000);
+			assert(nfst_index_to_symbol(st, 17) == syms[17]);
+			free(st);
+		}
 
-	int main(int argc, char **argv)
-	{
-		struct HashAndLength hl = hash_and_length("niklas frykholm");
-		assert(hl.length == 15);
-		
-		// Basic test
+		// Prefix index test
 		{
-			char buffer[1024];
-			struct nfst_StringTable * const st = (struct nfst_StringTable *)buffer;
-			nfst_init(st, 1024, 10);
+			static const char *paths[] = {
+				"textures/rock.png", "textures/grass.png", "sounds/step.wav",
+				"textures/sky/day.png", "texture.png", "sounds/jump.wav", "t",
+			};
+			const int n = sizeof(paths) / sizeof(paths[0]);
 
-			assert(nfst_to_symbol(st, "") == 0);
-			assert_strequal("", nfst_to_string(st, 0));
+			for (int dense = 0; dense < 2; ++dense) {
+				struct nfst_StringTable *st = realloc(NULL, 1024);
+				nfst_init_with_flags(st, 1024, 10, NFST_PREFIX_INDEX | (dense ? NFST_DENSE_INDEX : 0));
+				for (int i=0; i<n; ++i)
+					nfst_to_symbol(st, paths[i]);
+				assert(!nfst_has_prefix_index(st));
+				st = realloc(st, nfst_pack(st));
+				assert(nfst_has_prefix_index(st));
 
-			int sym_niklas = nfst_to_symbol(st, "niklas");
-			int sym_frykholm = nfst_to_symbol(st, "frykholm");
+				for (int frozen = 0; frozen < 2; ++frozen) {
+					if (frozen) {
+						uint64_t scratch[64];
+						assert(nfst_freeze_scratch_bytes(st) <= sizeof(scratch));
+						st = realloc(st, nfst_freeze(st, scratch, sizeof(scratch)));
+						assert(nfst_has_prefix_index(st));
+					}
 
-			assert(sym_niklas == nfst_to_symbol(st, "niklas"));
-			assert(sym_frykholm == nfst_to_symbol(st, "frykholm"));
-			assert(sym_niklas != sym_frykholm);
+					int first;
+					assert(nfst_prefix_range(st, "textures/", &first) == 3);
+					assert_strequal("textures/grass.png", nfst_to_string(st, nfst_sorted_symbol(st, first)));
+					assert_strequal("textures/rock.png", nfst_to_string(st, nfst_sorted_symbol(st, first + 1)));
+					assert_strequal("textures/sky/day.png", nfst_to_string(st, nfst_sorted_symbol(st, first + 2)));
+					assert(nfst_prefix_range(st, "sounds/", &first) == 2);
+					assert(nfst_prefix_range(st, "t", &first) == 5);
+					assert(nfst_prefix_range(st, "", &first) == n && first == 0);
+					assert(nfst_prefix_range(st, "textures/sky/day.png", &first) == 1);
+					assert(nfst_prefix_range(st, "textures/sky/day.png2", &first) == 0);
+					assert(nfst_prefix_range(st, "zzz", &first) == 0 && first == n);
+					for (int i=1; i<n; ++i)
+						assert(strcmp(nfst_to_string(st, nfst_sorted_symbol(st, i-1)),
+							nfst_to_string(st, nfst_sorted_symbol(st, i))) < 0);
+					for (int i=0; i<n; ++i)
+						assert_strequal(paths[i], nfst_to_string(st, nfst_to_symbol_const(st, paths[i])));
+					if (dense)
+						assert(nfst_symbol_to_index(st, nfst_index_to_symbol(st, 3)) == 3);
+				}
 
-			assert(sym_niklas == nfst_to_symbol_const(st, "niklas"));
-			assert(NFST_STRING_TABLE_FULL == nfst_to_symbol_const(st, "lax"));
+				// Adding strings drops the index until the next pack.
+				st = grow(st);
+				assert(!nfst_has_prefix_index(st));
+				nfst_to_symbol(st, "textures/water.png");
+				nfst_pack(st);
+				int first;
+				assert(nfst_prefix_range(st, "textures/", &first) == 4);
+				free(st);
+			}
 
-			assert_strequal("niklas", nfst_to_string(st, sym_niklas));
-			assert_strequal("frykholm", nfst_to_string(st, sym_frykholm));
+			// Sort a larger table.
+			struct nfst_StringTable *st = realloc(NULL, MIN_SIZE);
+			nfst_init_with_flags(st, MIN_SIZE, 4, NFST_PREFIX_INDEX);
+			for (int i=0; i<5000; ++i) {
+				char s[10];
+				sprintf(s, "%i", (i * 7919) % 5000);
+				while (nfst_to_symbol(st, s) == NFST_STRING_TABLE_FULL)
+					st = grow(st);
+			}
+			nfst_pack(st);
+			for (int i=1; i<5000; ++i)
+				assert(strcmp(nfst_to_string(st, nfst_sorted_symbol(st, i-1)),
+					nfst_to_string(st, nfst_sorted_symbol(st, i))) < 0);
+			int first;
+			assert(nfst_prefix_range(st, "42", &first) == 1 + 10 + 100);
+			free(st);
+		}
+
+		// Hash function test
+		{
+			static const unsigned hashes[] = {NFST_HASH_DEFAULT, NFST_HASH_LUA, NFST_HASH_WYHASH, NFST_HASH_CRC32C};
+			for (int h = 0; h < 4; ++h) {
+				struct nfst_StringTable *st = realloc(NULL, MIN_SIZE);
+				nfst_init_with_flags(st, MIN_SIZE, 4, hashes[h]);
+				assert(table_hash(st, "abc", 3) != table_hash(st, "abd", 3));
+				int syms[2000];
+				for (int i=0; i<2000; ++i) {
+					char s[40];
+					snprintf(s, sizeof(s), i % 2 ? "%i" : "a_fairly_long_prefix_%i", i);
+					while ((syms[i] = nfst_to_symbol(st, s)) == NFST_STRING_TABLE_FULL)
+						st = grow(st);
+				}
+				nfst_pack(st);
+
+				// The hash function is kept when the table is saved and loaded
+				// or frozen.
+				for (int frozen = 0; frozen < 2; ++frozen) {
+					if (frozen) {
+						uint64_t *scratch = malloc(nfst_freeze_scratch_bytes(st));
+						assert(nfst_freeze(st, scratch, nfst_freeze_scratch_bytes(st)));
+						free(scratch);
+					}
+					const int bytes = nfst_save_bytes(st);
+					uint64_t *image = malloc(bytes);
+					nfst_save(st, image);
+					const struct nfst_StringTable *mapped = nfst_open_mapped(image, bytes, 1);
+					for (int i=0; i<2000; ++i) {
+						char s[40];
+						snprintf(s, sizeof(s), i % 2 ? "%i" : "a_fairly_long_prefix_%i", i);
+						assert(nfst_to_symbol_const(mapped, s) == syms[i]);
+						const char *strs[1] = {s};
+						int sym;
+						assert(nfst_to_symbols(st, strs, NULL, 1, &sym) == 1 && sym == syms[i]);
+					}
+					assert(nfst_to_symbol_const(mapped, "2000") == NFST_STRING_TABLE_FULL);
+					free(image);
+				}
+				free(st);
+			}
+
+			// Different hash functions give different hashes.
+			struct nfst_StringTable st[4];
+			for (int h = 0; h < 4; ++h)
+				st[h].flags = (FORMAT_VERSION << VERSION_SHIFT) | (h << HASH_SHIFT);
+			for (int h = 1; h < 4; ++h) {
+				assert(table_hash(&st[h], "niklas frykholm", 15) != table_hash(&st[0], "niklas frykholm", 15));
+				for (int len = 0; len < 40; ++len) {
+					const char *text = "the quick brown fox jumps over the lazy dog";
+					assert(table_hash(&st[h], text, len) == table_hash(&st[h], text, len));
+					if (len)
+						assert(table_hash(&st[h], text, len) != table_hash(&st[h], text, len - 1));
+				}
+			}
+		}
+
+		// Folding test
+		{
+			struct nfst_StringTable *st = realloc(NULL, 4096);
+			nfst_init_with_flags(st, 4096, 10, NFST_FOLD_CASE | NFST_FOLD_PATH);
+			const int sym = nfst_to_symbol(st, "Textures/A.png");
+			assert(sym > 0);
+			static const char *same[] = {
+				"textures/a.png", "textures\\a.png", "./textures/a.png", "TEXTURES//A.PNG",
+				"textures/./a.png", ".\\Textures\\.\\a.png", "textures/a.png/.", "textures/a.png/",
+			};
+			for (int i=0; i<sizeof(same)/sizeof(same[0]); ++i) {
+				assert(nfst_to_symbol_const(st, same[i]) == sym);
+				assert(nfst_to_symbol(st, same[i]) == sym);
+			}
+			assert_strequal("Textures/A.png", nfst_to_string(st, sym));
+			assert(nfst_count(st) == 1);
+
+			static const char *different[] = {
+				"textures/b.png", "/textures/a.png", "textures/a.pn", "textures/a.png2", "textures/../a.png",
+				"textures/.a.png", "textures/a..png", "texturesa.png",
+			};
+			for (int i=0; i<sizeof(different)/sizeof(different[0]); ++i)
+				assert(nfst_to_symbol_const(st, different[i]) == NFST_STRING_TABLE_FULL);
+			assert(nfst_to_symbol_const(st, "/Textures/a.png") == NFST_STRING_TABLE_FULL);
+			const int abs = nfst_to_symbol(st, "/Textures/a.png");
+			assert(abs > 0 && abs != sym);
+			assert(nfst_to_symbol_const(st, "//textures\\a.png") == abs);
+
+			// Batch lookups with lengths fold too.
+			const char *strs[2] = {"TEXTURES/A.PNG-and-more", "x"};
+			const int lengths[2] = {14, 1};
+			int syms[2];
+			assert(nfst_to_symbols(st, strs, lengths, 2, syms) == 2);
+			assert(syms[0] == sym && syms[1] > 0);
+
+			// Frozen
+			nfst_pack(st);
+			uint64_t scratch[64];
+			assert(nfst_freeze_scratch_bytes(st) <= sizeof(scratch));
+			assert(nfst_freeze(st, scratch, sizeof(scratch)));
+			for (int i=0; i<sizeof(same)/sizeof(same[0]); ++i)
+				assert(nfst_to_symbol_const(st, same[i]) == sym);
+			assert(nfst_to_symbol_const(st, "x") == syms[1]);
+			assert(nfst_to_symbol_const(st, "textures/b.png") == NFST_STRING_TABLE_FULL);
+			free(st);
+
+			// Only case folding: paths are compared exactly.
+			st = realloc(NULL, 4096);
+			nfst_init_with_flags(st, 4096, 10, NFST_FOLD_CASE);
+			const int case_sym = nfst_to_symbol(st, "Gui.Menu");
+			assert(nfst_to_symbol(st, "gui.menu") == case_sym);
+			assert(nfst_to_symbol_const(st, "./gui.menu") == NFST_STRING_TABLE_FULL);
+			assert(nfst_to_symbol_const(st, "gui.menv") == NFST_STRING_TABLE_FULL);
+
+			// Many strings, to exercise probing and long strings.
+			for (int i=0; i<3000; ++i) {
+				char s[64];
+				sprintf(s, "Dir%i/Some/Longer/Path/Name_%i", i % 10, i);
+				while (nfst_to_symbol(st, s) == NFST_STRING_TABLE_FULL)
+					st = grow(st);
+			}
+			for (int i=0; i<3000; ++i) {
+				char s[64], upper[64];
+				sprintf(s, "Dir%i/Some/Longer/Path/Name_%i", i % 10, i);
+				for (int k=0; (upper[k] = s[k]); ++k)
+					if (upper[k] >= 'a' && upper[k] <= 'z') upper[k] -= 'a' - 'A';
+				const int sym = nfst_to_symbol_const(st, upper);
+				assert(sym > 0);
+				assert_strequal(s, nfst_to_string(st, sym));
+			}
+			assert(nfst_count(st) == 3001);
+			free(st);
+		}
+
+		// Build test
+		{
+			const unsigned flag_sets[] = {0, NFST_DENSE_INDEX, NFST_PREFIX_INDEX,
+				NFST_DENSE_INDEX | NFST_PREFIX_INDEX, NFST_FOLD_CASE | NFST_HASH_WYHASH};
+			const int sizes[] = {0, 1, 100, 20000};
+			for (int f = 0; f < 5; ++f) for (int z = 0; z < 4; ++z) for (int dups = 0; dups < 2; ++dups) {
+				const unsigned flags = flag_sets[f];
+				const int n = sizes[z];
+				char *data = malloc(n * 16 + 1);
+				const char **strs = malloc((n + 1) * sizeof(*strs));
+				int *lengths = malloc((n + 1) * sizeof(*lengths));
+				for (int i=0; i<n; ++i) {
+					strs[i] = data + i * 16;
+					lengths[i] = sprintf(data + i * 16, "item_%i", dups ? i % 37 : i);
+				}
+				int *syms = malloc((n + 1) * sizeof(*syms));
+				const int bytes = nfst_build_bytes(strs, lengths, n, flags);
+				struct nfst_StringTable *st = malloc(bytes);
+				const int built = nfst_build(st, bytes, strs, NULL, n, flags, syms);
+				assert(built == st->allocated_bytes);
+				assert(dups && n > 37 ? built < bytes : built == bytes);
+
+				// Same symbols and size as adding the strings one by one and
+				// packing.
+				struct nfst_StringTable *ref = realloc(NULL, MIN_SIZE);
+				nfst_init_with_flags(ref, MIN_SIZE, 8, flags);
+				for (int i=0; i<n; ++i) {
+					int sym;
+					while ((sym = nfst_to_symbol(ref, strs[i])) == NFST_STRING_TABLE_FULL)
+						ref = grow(ref);
+					assert(sym == syms[i]);
+					assert_strequal(strs[i], nfst_to_string(st, syms[i]));
+				}
+				const int packed = nfst_pack(ref);
+				assert(dups || packed == built);
+				assert(nfst_count(st) == nfst_count(ref));
+				for (int i=0; i<n; ++i)
+					assert(nfst_to_symbol_const(st, strs[i]) == syms[i]);
+				if (flags & NFST_DENSE_INDEX)
+					for (int i=0; i<nfst_count(st); ++i)
+						assert(nfst_index_to_symbol(st, i) == nfst_index_to_symbol(ref, i));
+				if (flags & NFST_PREFIX_INDEX && n > 1) {
+					int first;
+					assert(nfst_prefix_range(st, "item_1", &first) == nfst_prefix_range(ref, "item_1", &first));
+					assert(nfst_prefix_range(st, "item_", &first) == nfst_count(st));
+				}
+				if (flags & NFST_FOLD_CASE && n > 1)
+					assert(nfst_to_symbol_const(st, "ITEM_1") == syms[1]);
+
+				// Lengths and an empty string.
+				strs[n] = "";
+				lengths[n] = 0;
+				if (n)
+					lengths[0] = 4;
+				const int bytes_2 = nfst_build_bytes(strs, lengths, n + 1, flags);
+				st = realloc(st, bytes_2);
+				nfst_build(st, bytes_2, strs, lengths, n + 1, flags, syms);
+				assert(syms[n] == 0);
+				if (n)
+					assert_strequal("item", nfst_to_string(st, syms[0]));
+
+				free(ref);
+				free(st);
+				free(syms);
+				free(lengths);
+				free(strs);
+				free(data);
+			}
+		}
+
+		// Stats test
+		{
+			struct nfst_StringTable *st = realloc(NULL, MIN_SIZE);
+			nfst_init_with_flags(st, MIN_SIZE, 4, NFST_DENSE_INDEX | NFST_PREFIX_INDEX);
+			long long characters = 0;
+			for (int i=0; i<5000; ++i) {
+				char s[16];
+				characters += sprintf(s, "stat_%i", i);
+				while (nfst_to_symbol(st, s) == NFST_STRING_TABLE_FULL)
+					st = grow(st);
+			}
+			nfst_pack(st);
+
+			struct nfst_Stats stats;
+			for (int kind = 0; kind < 3; ++kind) {
+				if (kind == 1) {
+					const int scratch_bytes = nfst_freeze_scratch_bytes(st);
+					void *scratch = malloc(scratch_bytes);
+					nfst_freeze(st, scratch, scratch_bytes);
+					free(scratch);
+				} else if (kind == 2) {
+					const int scratch_bytes = nfst_compress_scratch_bytes(st);
+					void *scratch = malloc(scratch_bytes);
+					nfst_compress(st, scratch, scratch_bytes);
+					free(scratch);
+				}
+				nfst_stats(st, &stats);
+				assert(stats.count == 5000 && stats.removed == 0);
+				assert(stats.frozen == (kind == 1) && stats.compressed == (kind == 2));
+				assert(stats.average_string_length == (float)characters / 5000);
+				assert(stats.free_bytes >= 0 && stats.free_bytes < 4);
+				assert(stats.header_bytes + stats.slot_bytes + stats.string_bytes +
+					stats.index_bytes + stats.free_bytes == st->allocated_bytes);
+				int probed = 0;
+				for (int i=0; i<NFST_PROBE_HISTOGRAM_SIZE; ++i)
+					probed += stats.probe_histogram[i];
+				if (kind == 2) {
+					assert(stats.num_hash_slots == 0 && probed == 0);
+				} else {
+					assert(probed == 5000 && stats.max_probe_length >= 1);
+					assert(stats.load_factor == 5000.0f / st->num_hash_slots);
+					assert(stats.record_header_bytes > 0 && stats.index_bytes == 2 * 5000 * 4);
+					assert(!stats.uses_16_bit_hash_slots);
+				}
+				if (kind == 1)
+					assert(stats.probe_histogram[0] == 5000 && stats.max_probe_length == 1);
+			}
+			free(st);
+
+			// Removed strings and free space.
+			st = realloc(NULL, 4096);
+			nfst_init(st, 4096, 4);
+			const int sym = nfst_to_symbol(st, "abc");
+			nfst_to_symbol(st, "de");
+			nfst_remove(st, sym);
+			nfst_stats(st, &stats);
+			assert(stats.count == 1 && stats.removed == 1 && stats.average_string_length == 2.0f);
+			assert(stats.uses_16_bit_hash_slots && stats.probe_histogram[0] == 1);
+			assert(stats.free_bytes == available_string_bytes(st) - st->string_bytes);
+			free(st);
+
+		#if defined(NFST_COUNTERS)
+			// Counters test
+			{
+				struct nfst_Counters c;
+				st = realloc(NULL, 1024);
+				nfst_init(st, 1024, 4);
+				nfst_reset_counters();
+				nfst_to_symbol(st, "a");
+				nfst_to_symbol(st, "a");
+				nfst_counters(&c);
+				assert(c.lookups == 2 && c.inserts == 1 && c.full == 0);
+				char s[16];
+				int i = 0;
+				do sprintf(s, "%i", i++);
+				while (nfst_to_symbol(st, s) != NFST_STRING_TABLE_FULL);
+				st = grow(st);
+				nfst_counters(&c);
+				assert(c.inserts == i && c.full == 1 && c.grows == 1 && c.rebuilds == 1);
+				free(st);
+			}
+		#endif
+		}
+
+		// Remove and compact test
+		{
+			for (int dense = 0; dense < 2; ++dense) {
+				struct nfst_StringTable *st = realloc(NULL, MIN_SIZE);
+				nfst_init_with_flags(st, MIN_SIZE, 4, dense ? NFST_DENSE_INDEX : 0);
+				int syms[1000];
+				for (int i=0; i<1000; ++i) {
+					char s[10];
+					sprintf(s, "%i", i);
+					while ((syms[i] = nfst_to_symbol(st, s)) == NFST_STRING_TABLE_FULL)
+						st = grow(st);
+				}
+
+				// Remove every third string.
+				for (int i=0; i<1000; i += 3)
+					assert(nfst_remove(st, syms[i]));
+				assert(!nfst_remove(st, syms[0]));
+				assert(!nfst_remove(st, 0));
+				assert(nfst_count(st) == 1000);
+				int count = 0;
+				for (int sym = nfst_next_symbol(st, 0); sym; sym = nfst_next_symbol(st, sym)) {
+					assert(atoi(nfst_to_string(st, sym)) % 3 != 0);
+					++count;
+				}
+				assert(count == 666);
+				for (int i=0; i<1000; ++i) {
+					char s[10];
+					sprintf(s, "%i", i);
+					assert(nfst_to_symbol_const(st, s) == (i % 3 ? syms[i] : NFST_STRING_TABLE_FULL));
+				}
+
+				// Removed strings can be added again, they get new symbols.
+				int readded = nfst_to_symbol(st, "3");
+				while (readded == NFST_STRING_TABLE_FULL) {
+					st = grow(st);
+					readded = nfst_to_symbol(st, "3");
+				}
+				assert(readded != syms[3]);
+				assert(nfst_to_symbol(st, "1") == syms[1]);
+				nfst_remove(st, readded);
+
+				// Growing and packing keep removed strings removed.
+				st = grow(st);
+				assert(nfst_to_symbol_const(st, "6") == NFST_STRING_TABLE_FULL);
+				nfst_pack(st);
+				assert(nfst_to_symbol_const(st, "6") == NFST_STRING_TABLE_FULL);
+				assert(nfst_to_symbol_const(st, "7") == syms[7]);
+
+				struct nfst_SymbolRemap *remap = malloc(nfst_count(st) * sizeof(*remap));
+				const int n = nfst_compact(st, remap);
+				assert(n == 666 && nfst_count(st) == 666);
+				for (int i=0; i<1000; ++i) {
+					char s[10];
+					sprintf(s, "%i", i);
+					const int sym = nfst_remap_symbol(remap, n, syms[i]);
+					if (i % 3 == 0)
+						assert(sym == NFST_STRING_TABLE_FULL);
+					else {
+						assert(sym > 0 && sym <= syms[i]);
+						assert_strequal(s, nfst_to_string(st, sym));
+						assert(nfst_to_symbol_const(st, s) == sym);
+					}
+				}
+				assert(nfst_remap_symbol(remap, n, 0) == 0);
+				if (dense) {
+					for (int i=0; i<n; ++i)
+						assert(nfst_symbol_to_index(st, nfst_index_to_symbol(st, i)) == i);
+					assert(nfst_index_to_symbol(st, 0) == nfst_remap_symbol(remap, n, syms[1]));
+				}
+				free(remap);
+
+				// The string data has shrunk.
+				const int bytes = st->allocated_bytes;
+				assert(nfst_pack(st) < bytes);
+				free(st);
+			}
+
+			// Adding and removing strings over and over only needs the table to
+			// grow once in a while.
+			struct nfst_StringTable *st = realloc(NULL, 4096);
+			nfst_init(st, 4096, 4);
+			for (int i=0; i<10000; ++i) {
+				char s[10];
+				sprintf(s, "%i", i);
+				int sym = nfst_to_symbol(st, s);
+				if (sym == NFST_STRING_TABLE_FULL) {
+					struct nfst_SymbolRemap remap[4096];
+					assert(nfst_count(st) <= 4096);
+					nfst_compact(st, remap);
+					sym = nfst_to_symbol(st, s);
+				}
+				assert(sym > 0);
+				nfst_remove(st, sym);
+			}
+			assert(st->allocated_bytes == 4096);
+			free(st);
+		}
+
+		// Compressed table test
+		{
+			struct nfst_StringTable *st = realloc(NULL, MIN_SIZE);
+			nfst_init_with_flags(st, MIN_SIZE, 20, NFST_DENSE_INDEX);
+			const int n = 1000;
+			for (int i=0; i<n; ++i) {
+				char s[40];
+				sprintf(s, "textures/level%i/rock_%i.png", i % 7, i);
+				while (nfst_to_symbol(st, s) == NFST_STRING_TABLE_FULL)
+					st = grow(st);
+			}
+			while (nfst_to_symbol(st, "textures/level1") == NFST_STRING_TABLE_FULL)
+				st = grow(st);
+			const int packed_bytes = nfst_pack(st);
+
+			uint32_t *scratch = malloc(nfst_compress_scratch_bytes(st));
+			const int bytes = nfst_compress(st, scratch, nfst_compress_scratch_bytes(st));
+			free(scratch);
+			assert(bytes < packed_bytes / 2);
+			st = realloc(st, bytes);
+			assert(nfst_count(st) == n + 1);
+
+			// Symbols are the positions in sorted order.
+			char prev[40] = "", buf[40];
+			int count = 0;
+			for (int sym = nfst_next_symbol(st, 0); sym; sym = nfst_next_symbol(st, sym)) {
+				const int len = nfst_to_string_buf(st, sym, buf, sizeof(buf));
+				assert(len == (int)strlen(buf) && len == nfst_to_string_len(st, sym));
+				assert(strcmp(prev, buf) < 0);
+				assert(nfst_to_symbol_const(st, buf) == sym);
+				assert(nfst_to_symbol(st, buf) == sym);
+				assert(nfst_symbol_to_index(st, sym) == count);
+				assert(nfst_index_to_symbol(st, count) == sym);
+				strcpy(prev, buf);
+				++count;
+			}
+			assert(count == n + 1);
+			assert(nfst_to_symbol_const(st, "textures/level1") == 1 + (n + 6) / 7);
+
+			for (int i=0; i<n; ++i) {
+				char s[40];
+				sprintf(s, "textures/level%i/rock_%i.png", i % 7, i);
+				const int sym = nfst_to_symbol_const(st, s);
+				assert(sym > 0);
+				assert(nfst_to_string_buf(st, sym, buf, sizeof(buf)) == (int)strlen(s));
+				assert_strequal(s, buf);
+				const char *strs[1] = {s};
+				int syms[1];
+				assert(nfst_to_symbols(st, strs, NULL, 1, syms) == 1 && syms[0] == sym);
+			}
+
+			// Truncated decoding
+			const int sym = nfst_to_symbol_const(st, "textures/level3/rock_10.png");
+			assert(nfst_to_string_buf(st, sym, buf, 12) == 27);
+			assert_strequal("textures/le", buf);
+			assert(nfst_to_string_buf(st, sym, NULL, 0) == 27);
+			assert(nfst_to_string_buf(st, 0, buf, sizeof(buf)) == 0 && buf[0] == 0);
+
+			// Strings that are not in the table, before, between and after the
+			// stored ones.
+			static const char *missing[] = {
+				"a", "textures", "textures/level", "textures/level1/", "textures/level3/rock_10.pn",
+				"textures/level3/rock_10.png2", "textures/level3/rock_100.png", "textures/level6/rock_999.png",
+				"textures/level7", "zzz",
+			};
+			for (int i=0; i<sizeof(missing)/sizeof(missing[0]); ++i)
+				assert(nfst_to_symbol(st, missing[i]) == NFST_STRING_TABLE_FULL);
+
+			// Compressed tables can be saved and mapped.
+			const int image_bytes = nfst_save_bytes(st);
+			uint64_t *image = malloc(image_bytes);
+			nfst_save(st, image);
+			const struct nfst_StringTable *mapped = nfst_open_mapped(image, image_bytes, 1);
+			assert(nfst_to_symbol_const(mapped, "textures/level3/rock_10.png") == sym);
+			free(image);
+			free(st);
+
+			// Empty table
+			st = realloc(NULL, MIN_SIZE);
+			nfst_init(st, MIN_SIZE, 4);
+			uint32_t small_scratch[4];
+			assert(nfst_compress_scratch_bytes(st) <= sizeof(small_scratch));
+			nfst_compress(st, small_scratch, sizeof(small_scratch));
+			assert(nfst_to_symbol_const(st, "a") == NFST_STRING_TABLE_FULL);
+			assert(nfst_to_symbol_const(st, "") == 0);
+			assert(nfst_next_symbol(st, 0) == 0);
+			free(st);
+		}
+
+		// Save and load test
+		{
+			struct nfst_StringTable *st = realloc(NULL, MIN_SIZE);
+			nfst_init(st, MIN_SIZE, 4);
+			int syms[1000];
+			for (int i=0; i<1000; ++i) {
+				char s[10];
+				sprintf(s, "%i", i);
+				while ((syms[i] = nfst_to_symbol(st, s)) == NFST_STRING_TABLE_FULL)
+					st = grow(st);
+			}
+			nfst_pack(st);
+
+			for (int frozen = 0; frozen < 2; ++frozen) {
+				if (frozen) {
+					uint64_t *scratch = malloc(nfst_freeze_scratch_bytes(st));
+					assert(nfst_freeze(st, scratch, nfst_freeze_scratch_bytes(st)));
+					free(scratch);
+				}
+
+				const int bytes = nfst_save_bytes(st);
+				uint64_t *image = malloc(bytes);
+				nfst_save(st, image);
+
+				const struct nfst_StringTable *mapped = nfst_open_mapped(image, bytes, 1);
+				assert(mapped == (const struct nfst_StringTable *)((char *)image + sizeof(struct FileHeader)));
+				for (int i=0; i<1000; ++i) {
+					char s[10];
+					sprintf(s, "%i", i);
+					assert(nfst_to_symbol_const(mapped, s) == syms[i]);
+				}
+				assert(nfst_to_symbol_const(mapped, "1000") == NFST_STRING_TABLE_FULL);
+
+				// Adding strings copies the table, the image isn't touched.
+				uint64_t *copy = malloc(bytes);
+				memcpy(copy, image, bytes);
+				struct nfst_GrowingStringTable *gst = nfst_growing_open(counting_realloc, NULL, mapped, NULL);
+				assert(nfst_growing_to_symbol(gst, "17") == syms[17]);
+				assert(nfst_growing_to_symbol_const(gst, "1000") == NFST_STRING_TABLE_FULL);
+				assert(nfst_growing_table(gst) == mapped);
+				const int sym_new = nfst_growing_to_symbol(gst, "1000");
+				assert(sym_new > 0);
+				assert(nfst_growing_table(gst) != mapped);
+				assert(nfst_growing_to_symbol(gst, "999") == syms[999]);
+				assert_strequal("1000", nfst_growing_to_string(gst, sym_new));
+				assert(memcmp(copy, image, bytes) == 0);
+				nfst_free(gst);
+				assert(allocated_bytes == 0);
+				free(copy);
+
+				// Headers with a layout that doesn't fit the image are rejected,
+				// even without verifying the checksum.
+				struct nfst_StringTable * const header = (struct nfst_StringTable *)((char *)image + sizeof(struct FileHeader));
+				const struct nfst_StringTable saved = *header;
+				header->num_hash_slots = 1 << 24;
+				assert(nfst_open_mapped(image, bytes, 0) == NULL);
+				header->num_hash_slots = saved.num_hash_slots + GROUP_SIZE;
+				assert(nfst_open_mapped(image, bytes, 0) == NULL);
+				header->num_hash_slots = 0;
+				assert(nfst_open_mapped(image, bytes, 0) == NULL);
+				*header = saved;
+				header->string_bytes = -1;
+				assert(nfst_open_mapped(image, bytes, 0) == NULL);
+				header->string_bytes = saved.string_bytes + 8;
+				assert(nfst_open_mapped(image, bytes, 0) == NULL);
+				*header = saved;
+				header->count = -1;
+				assert(nfst_open_mapped(image, bytes, 0) == NULL);
+				header->count = saved.num_hash_slots + 1;
+				assert(nfst_open_mapped(image, bytes, 0) == NULL);
+				*header = saved;
+				assert(nfst_open_mapped(image, bytes, 0) == mapped);
+
+				// Corrupted images are rejected.
+				((char *)image)[bytes - 1] ^= 1;
+				assert(nfst_open_mapped(image, bytes, 1) == NULL);
+				assert(nfst_open_mapped(image, bytes, 0) == mapped);
+				assert(nfst_open_mapped(image, bytes - 1, 0) == NULL);
+				((char *)image)[0] ^= 1;
+				assert(nfst_open_mapped(image, bytes, 0) == NULL);
+				assert(nfst_validate(mapped, bytes - sizeof(struct FileHeader)));
+				assert(!nfst_validate(mapped, bytes - sizeof(struct FileHeader) - 8));
+				assert(!nfst_validate(mapped, 4));
+				free(image);
+			}
+			free(st);
+
+			// The dense and prefix indices must fit too.
+			st = realloc(NULL, 1024);
+			nfst_init_with_flags(st, 1024, 4, NFST_DENSE_INDEX | NFST_PREFIX_INDEX);
+			for (int i=0; i<10; ++i) {
+				char s[10];
+				sprintf(s, "%i", i);
+				assert(nfst_to_symbol(st, s) > 0);
+			}
+			const int bytes = nfst_pack(st);
+			assert(nfst_validate(st, bytes));
+			st->count += 1;
+			assert(!nfst_validate(st, bytes));
+			st->count -= 1;
+			st->string_bytes += 4;
+			assert(!nfst_validate(st, bytes));
+			free(st);
+		}
+
+		// Wide table test
+		{
+			struct nfst_WideStringTable *wst = nfst_wide_make(counting_realloc, NULL, 0, 6);
+			static long long syms[100000];
+			int high = 0;
+			for (int i=0; i<100000; ++i) {
+				char s[10];
+				sprintf(s, "%i", i);
+				syms[i] = nfst_wide_to_symbol(wst, s);
+				assert(syms[i] > 0);
+				high += syms[i] >= (1ll << 32);
+			}
+			assert(high > 90000);
+			assert(nfst_wide_count(wst) == 100000);
+			assert(nfst_wide_to_symbol(wst, "") == 0);
+			assert(nfst_wide_to_symbol_const(wst, "100000") == NFST_STRING_TABLE_FULL);
+			for (int i=0; i<100000; ++i) {
+				char s[10];
+				sprintf(s, "%i", i);
+				assert(nfst_wide_to_symbol(wst, s) == syms[i]);
+				assert(nfst_wide_to_symbol_const(wst, s) == syms[i]);
+				assert_strequal(s, nfst_wide_to_string(wst, syms[i]));
+			}
+
+			// Partitions are regular tables.
+			struct nfst_StringTable *st = nfst_wide_partition(wst, (int)(syms[17] >> 32));
+			assert_strequal("17", nfst_to_string(st, (int)syms[17]));
+			long long count = 0, bytes = 0;
+			for (int i=0; i<NFST_WIDE_PARTITIONS; ++i) {
+				count += nfst_count(nfst_wide_partition(wst, i));
+				bytes += nfst_wide_partition(wst, i)->allocated_bytes;
+			}
+			assert(count == 100000 && bytes == nfst_wide_bytes(wst));
+
+			// Growing stops at the maximum table size.
+			assert(growing_next_size(wst->partitions[0], NFST_MAX_TABLE_BYTES - 100) == NFST_MAX_TABLE_BYTES);
+			assert(growing_next_size(wst->partitions[0], NFST_MAX_TABLE_BYTES) == NFST_MAX_TABLE_BYTES);
+			nfst_wide_free(wst);
+			assert(allocated_bytes == 0);
 		}
 
 		// Grow test
@@ -392,6 +4498,28 @@ static void rebuild_hash_table(struct nfst_StringTable *st)
 
 			free(st);
 		}
+
+		// Threading test. One writer adds strings while other threads look
+		// them up without locking, see **Threading**.
+	#if !defined(_WIN32)
+		{
+			const int bytes = 1024*1024;
+			threading_st = malloc(bytes);
+			nfst_init(threading_st, bytes, 8);
+			pthread_t readers[3];
+			for (int i=0; i<3; ++i)
+				pthread_create(&readers[i], NULL, threading_reader, (void *)(uintptr_t)(i + 1));
+			for (int i=0; i<THREADING_STRINGS; ++i) {
+				char s[16];
+				sprintf(s, "t%i", i);
+				assert(nfst_to_symbol(threading_st, s) > 0);
+				__atomic_store_n(&threading_published, i + 1, __ATOMIC_RELEASE);
+			}
+			for (int i=0; i<3; ++i)
+				pthread_join(readers[i], NULL);
+			free(threading_st);
+		}
+	#endif
 	}
 
 #endif
@@ -404,10 +4532,375 @@ static void rebuild_hash_table(struct nfst_StringTable *st)
 	#include <stdlib.h>
 	#include <time.h>
 
+	// Measures the throughput of hash_and_length() for strings of different
+	// lengths.
+	static void hash_performance()
+	{
+		static const int lengths[] = {4, 8, 16, 32, 64, 128, 256, 1024};
+		const int total_bytes = 256*1024*1024;
+
+		for (int b = 0; b < sizeof(lengths)/sizeof(lengths[0]); ++b) {
+			const int len = lengths[b];
+			const int n = 1024;
+			char *buffer = malloc(n * (len + 1));
+			for (int i=0; i<n * (len + 1); ++i)
+				buffer[i] = 'a' + rand() % 26;
+			for (int i=0; i<n; ++i)
+				buffer[i * (len + 1) + len] = 0;
+
+			uint32_t h = 0;
+			const int iterations = total_bytes / (n * len);
+			clock_t start = clock();
+			for (int j=0; j<iterations; ++j) {
+				for (int i=0; i<n; ++i)
+					h += hash_and_length(buffer + i * (len + 1)).hash;
+			}
+			clock_t stop = clock();
+
+			double delta = ((double)(stop-start)) / CLOCKS_PER_SEC;
+			double bytes = (double)iterations * n * len;
+			printf("Hash %4i bytes: %8.1f MB/s (%x)\n", len, bytes / delta / (1024*1024), h);
+			free(buffer);
+		}
+	}
+
+	// Returns the number of groups that are probed to find the string with
+	// the `symbol` in the hash table of `st`.
+	static int probe_length(struct nfst_StringTable *st, int symbol)
+	{
+		uint32_t hash;
+		memcpy(&hash, strings(st) + symbol - RECORD_HEADER_BYTES, sizeof(hash));
+		const int group_mask = st->num_hash_slots / GROUP_SIZE - 1;
+		for (int g = hash & group_mask, n = 1; ; g = (g + 1) & group_mask, ++n) {
+			for (int i = g * GROUP_SIZE; i < (g + 1) * GROUP_SIZE; ++i) {
+				if (tags(st)[i] && slot_symbol(st, i) == symbol)
+					return n;
+			}
+		}
+	}
+
+	// Measures average and maximum probe lengths, the number of compared
+	// strings and the lookup throughput of the hash functions for a few
+	// kinds of strings, in packed tables.
+	static void probe_performance()
+	{
+		static const char *formats[] = {"%i", "entity_%i", "content/level%02i/props/mesh_%i.mesh", "gui.menu.item%i.label"};
+		static const char *hash_names[] = {"default", "lua", "wyhash", "crc32c"};
+		static const unsigned hashes[] = {NFST_HASH_DEFAULT, NFST_HASH_LUA, NFST_HASH_WYHASH, NFST_HASH_CRC32C};
+		const int n = 1000*1000;
+		char (*s)[48] = malloc(n * sizeof(*s));
+		const char **strs = malloc(n * sizeof(*strs));
+		int *syms = malloc(n * sizeof(*syms));
+
+		for (int f = 0; f < 4; ++f) {
+			for (int i=0; i<n; ++i) {
+				if (f == 2)
+					sprintf(s[i], formats[f], i % 100, i);
+				else
+					sprintf(s[i], formats[f], i);
+				strs[i] = s[i];
+			}
+			for (int h = 0; h < 4; ++h) {
+				const int bytes = 128*1024*1024;
+				struct nfst_StringTable *st = malloc(bytes);
+				nfst_init_with_flags(st, bytes, 16, hashes[h]);
+				for (int i=0; i<n; ++i)
+					syms[i] = nfst_to_symbol(st, s[i]);
+				nfst_pack(st);
+
+				long long total = 0, compares = 0;
+				int worst = 0;
+				for (int i=0; i<n; ++i) {
+					const int p = probe_length(st, syms[i]);
+					total += p;
+					worst = MAX(worst, p);
+					uint32_t hash;
+					memcpy(&hash, strings(st) + syms[i] - RECORD_HEADER_BYTES, sizeof(hash));
+					const int group_mask = st->num_hash_slots / GROUP_SIZE - 1;
+					for (int k = 0, g = hash & group_mask; k < p; ++k, g = (g + 1) & group_mask) {
+						for (unsigned m = match_group(load_group(tags(st) + g * GROUP_SIZE), hash_tag(hash)); m; m &= m - 1)
+							++compares;
+					}
+				}
+
+				srand(0);
+				for (int i=n-1; i>0; --i) {
+					const int j = (int)(((unsigned)rand() << 15 ^ (unsigned)rand()) % (unsigned)(i + 1));
+					const char *t = strs[i]; strs[i] = strs[j]; strs[j] = t;
+				}
+				clock_t start = clock();
+				int sum = 0;
+				for (int r=0; r<5; ++r) {
+					for (int i=0; i<n; ++i)
+						sum += nfst_to_symbol_const(st, strs[i]);
+				}
+				clock_t stop = clock();
+				printf("%-36s %-8s probes avg %.3f max %3i, compares %.3f, lookups %6.1f M/s (%x)\n",
+					formats[f], hash_names[h], (double)total / n, worst, (double)compares / n,
+					5.0 * n / (((double)(stop-start)) / CLOCKS_PER_SEC) / 1e6, sum);
+				free(st);
+			}
+		}
+		free(syms);
+		free(strs);
+		free(s);
+	}
+
+	// Compares nfst_to_symbol() with nfst_to_symbols() on a table that is
+	// too big to fit in the cache.
+	static void batch_performance()
+	{
+		const int n = 1000*1000;
+		const int bytes = 64*1024*1024;
+		char (*s)[12] = malloc(n * sizeof(*s));
+		const char **strs = malloc(n * sizeof(*strs));
+		int *syms = malloc(n * sizeof(*syms));
+		for (int i=0; i<n; ++i) {
+			sprintf(s[i], "%i", i);
+			strs[i] = s[i];
+		}
+		struct nfst_StringTable *st = malloc(bytes);
+		nfst_init(st, bytes, 7);
+		for (int i=0; i<n; ++i)
+			nfst_to_symbol(st, strs[i]);
+
+		srand(0);
+		for (int i=n-1; i>0; --i) {
+			const int j = (int)(((unsigned)rand() << 15 ^ (unsigned)rand()) % (unsigned)(i + 1));
+			const char *t = strs[i]; strs[i] = strs[j]; strs[j] = t;
+		}
+
+		clock_t start = clock();
+		for (int i=0; i<n; ++i)
+			syms[i] = nfst_to_symbol(st, strs[i]);
+		clock_t stop = clock();
+		printf("Single: %f\n", ((double)(stop-start)) / CLOCKS_PER_SEC);
+
+		start = clock();
+		const int done = nfst_to_symbols(st, strs, NULL, n, syms);
+		stop = clock();
+		assert(done == n);
+		printf("Batch: %f\n", ((double)(stop-start)) / CLOCKS_PER_SEC);
+
+		free(st);
+		free(syms);
+		free(strs);
+		free(s);
+	}
+
+	// Compares lookups in a packed table with lookups in a frozen one.
+	static void freeze_performance()
+	{
+		const int n = 1000*1000;
+		char (*s)[12] = malloc(n * sizeof(*s));
+		for (int i=0; i<n; ++i)
+			sprintf(s[i], "%i", i);
+		struct nfst_StringTable *st = malloc(64*1024*1024);
+		nfst_init(st, 64*1024*1024, 7);
+		for (int i=0; i<n; ++i)
+			nfst_to_symbol(st, s[i]);
+		printf("Packed bytes: %i\n", nfst_pack(st));
+
+		for (int frozen = 0; frozen < 2; ++frozen) {
+			if (frozen) {
+				const int scratch_bytes = nfst_freeze_scratch_bytes(st);
+				void *scratch = malloc(scratch_bytes);
+				clock_t start = clock();
+				const int bytes = nfst_freeze(st, scratch, scratch_bytes);
+				clock_t stop = clock();
+				printf("Frozen bytes: %i, freeze time: %f\n", bytes, ((double)(stop-start)) / CLOCKS_PER_SEC);
+				free(scratch);
+			}
+			srand(0);
+			clock_t start = clock();
+			int sum = 0;
+			for (int i=0; i<10*n; ++i)
+				sum += nfst_to_symbol_const(st, s[((unsigned)rand() * 31u + (unsigned)rand()) % (unsigned)n]);
+			clock_t stop = clock();
+			printf("%s lookups: %f (%x)\n", frozen ? "Frozen" : "Packed",
+				((double)(stop-start)) / CLOCKS_PER_SEC, sum);
+		}
+		free(st);
+		free(s);
+	}
+
+	// Compares the size and lookup speed of a packed table of file paths
+	// with a compressed one.
+	static void compress_performance()
+	{
+		const int n = 1000*1000;
+		char (*s)[48] = malloc(n * sizeof(*s));
+		for (int i=0; i<n; ++i)
+			sprintf(s[i], "content/textures/level%02i/props/rock_%i.dds", i % 50, i);
+		struct nfst_StringTable *st = malloc(128*1024*1024);
+		nfst_init(st, 128*1024*1024, 40);
+		for (int i=0; i<n; ++i)
+			nfst_to_symbol(st, s[i]);
+		printf("Paths packed bytes: %i\n", nfst_pack(st));
+
+		for (int compressed = 0; compressed < 2; ++compressed) {
+			if (compressed) {
+				const int scratch_bytes = nfst_compress_scratch_bytes(st);
+				void *scratch = malloc(scratch_bytes);
+				clock_t start = clock();
+				const int bytes = nfst_compress(st, scratch, scratch_bytes);
+				clock_t stop = clock();
+				printf("Paths compressed bytes: %i, compress time: %f\n", bytes, ((double)(stop-start)) / CLOCKS_PER_SEC);
+				free(scratch);
+			}
+			srand(0);
+			clock_t start = clock();
+			int sum = 0;
+			for (int i=0; i<n; ++i)
+				sum += nfst_to_symbol_const(st, s[((unsigned)rand() * 31u + (unsigned)rand()) % (unsigned)n]);
+			clock_t stop = clock();
+			printf("%s lookups: %f (%x)\n", compressed ? "Compressed" : "Packed",
+				((double)(stop-start)) / CLOCKS_PER_SEC, sum);
+
+			char buf[48];
+			start = clock();
+			for (int sym = nfst_next_symbol(st, 0); sym; sym = nfst_next_symbol(st, sym))
+				sum += nfst_to_string_buf(st, sym, buf, sizeof(buf));
+			stop = clock();
+			printf("%s decode all: %f (%x)\n", compressed ? "Compressed" : "Packed",
+				((double)(stop-start)) / CLOCKS_PER_SEC, sum);
+		}
+		free(st);
+		free(s);
+	}
+
+	// Compares building a lot of small tables, as for the packages of a
+	// content build, by adding the strings one by one, growing and packing
+	// with building them with nfst_build().
+	static void build_performance()
+	{
+		const int packages = 20000;
+		const int n = 500;
+		char (*s)[40] = malloc(n * sizeof(*s));
+		const char **strs = malloc(n * sizeof(*strs));
+		int *syms = malloc(n * sizeof(*syms));
+
+		double incremental = 0, built = 0;
+		long long total_bytes = 0;
+		for (int p=0; p<packages; ++p) {
+			for (int i=0; i<n; ++i) {
+				// Some strings are shared by all packages, like in real data.
+				if (i % 5 == 0)
+					sprintf(s[i], "core/shaders/shader_%i.shader", i);
+				else
+					sprintf(s[i], "package_%i/mesh_%i.mesh", p, i);
+				strs[i] = s[i];
+			}
+
+			clock_t start = clock();
+			int bytes = 4096;
+			struct nfst_StringTable *st = malloc(bytes);
+			nfst_init(st, bytes, 16);
+			int done = 0;
+			while ((done += nfst_to_symbols(st, strs + done, NULL, n - done, syms + done)) < n) {
+				bytes *= 2;
+				st = realloc(st, bytes);
+				nfst_grow(st, bytes);
+			}
+			st = realloc(st, nfst_pack(st));
+			clock_t stop = clock();
+			incremental += stop - start;
+			const int packed = st->allocated_bytes;
+			free(st);
+
+			start = clock();
+			bytes = nfst_build_bytes(strs, NULL, n, 0);
+			st = malloc(bytes);
+			nfst_build(st, bytes, strs, NULL, n, 0, syms);
+			stop = clock();
+			built += stop - start;
+			assert(st->allocated_bytes == packed);
+			total_bytes += st->allocated_bytes;
+			free(st);
+		}
+		printf("Build %i tables (%.1f MB): incremental %f, nfst_build %f\n", packages,
+			total_bytes / (1024.0 * 1024.0), incremental / CLOCKS_PER_SEC, built / CLOCKS_PER_SEC);
+
+		free(syms);
+		free(strs);
+		free(s);
+	}
+
+	static void *growing_realloc(void *ud, void *ptr, int osize, int nsize, const char *file, int line)
+	{
+		return realloc(ptr, nsize);
+	}
+
+	// Measures the worst case time of a single nfst_growing_to_symbol() call
+	// with and without incremental migration.
+	static void growing_performance()
+	{
+		const int n = 4*1000*1000;
+		for (int migrate_slots = 0; migrate_slots <= 16; migrate_slots += 16) {
+			const struct nfst_GrowthPolicy policy = {2.0f, 0, migrate_slots};
+			struct nfst_GrowingStringTable *gst = nfst_make(growing_realloc, NULL, 0, 7, &policy);
+			clock_t worst = 0;
+			clock_t start = clock();
+			for (int i=0; i<n; ++i) {
+				char s[12];
+				sprintf(s, "%i", i);
+				const clock_t t = clock();
+				nfst_growing_to_symbol(gst, s);
+				worst = MAX(worst, clock() - t);
+			}
+			clock_t stop = clock();
+			printf("Growing (migrate %2i): %f, worst insert %f ms\n", migrate_slots,
+				((double)(stop-start)) / CLOCKS_PER_SEC, 1000.0 * worst / CLOCKS_PER_SEC);
+			nfst_free(gst);
+		}
+	}
+
+	// Number of strings for wide_performance(). The default fits in the
+	// memory of a small machine. Compile with
+	// `-DWIDE_STRESS_STRINGS=500000000` for the full stress test, which
+	// needs about 30 GB.
+	#ifndef WIDE_STRESS_STRINGS
+		#define WIDE_STRESS_STRINGS (20*1000*1000)
+	#endif
+
+	// Inserts WIDE_STRESS_STRINGS distinct strings in a wide table and
+	// measures the insert and lookup times and the worst single insert.
+	static void wide_performance()
+	{
+		const long long n = WIDE_STRESS_STRINGS;
+		struct nfst_WideStringTable *wst = nfst_wide_make(growing_realloc, NULL, 0, 10);
+		clock_t worst = 0;
+		clock_t start = clock();
+		for (long long i=0; i<n; ++i) {
+			char s[24];
+			sprintf(s, "k%lld", i * 2654435761ll);
+			const clock_t t = clock();
+			const long long symbol = nfst_wide_to_symbol(wst, s);
+			worst = MAX(worst, clock() - t);
+			assert(symbol > 0);
+		}
+		clock_t stop = clock();
+		printf("Wide inserts (%lld): %f, worst insert %f ms, bytes %lld\n", n,
+			((double)(stop-start)) / CLOCKS_PER_SEC, 1000.0 * worst / CLOCKS_PER_SEC, nfst_wide_bytes(wst));
+
+		srand(0);
+		long long sum = 0;
+		start = clock();
+		for (int i=0; i<10*1000*1000; ++i) {
+			char s[24];
+			const long long j = (((long long)rand() << 31) ^ rand()) % n;
+			sprintf(s, "k%lld", j * 2654435761ll);
+			sum += nfst_wide_to_symbol_const(wst, s);
+		}
+		stop = clock();
+		printf("Wide lookups: %f (%llx)\n", ((double)(stop-start)) / CLOCKS_PER_SEC, sum);
+		nfst_wide_free(wst);
+	}
+
 	int main(int argc, char **argv)
 	{
-		struct nfst_StringTable *st = malloc(128*1024);
-		nfst_init(st, 128*1024, 4);
+		struct nfst_StringTable *st = malloc(256*1024);
+		nfst_init(st, 256*1024, 4);
 
 		char s[10000][5];
 		for (int i=0; i<10000; ++i)
@@ -424,7 +4917,16 @@ static void rebuild_hash_table(struct nfst_StringTable *st)
 		float delta = ((double)(stop-start)) / CLOCKS_PER_SEC;
 		printf("Time: %f\n", delta);
 		printf("Memory use: %i\n", st->allocated_bytes);
-		printf("16 bit: %i\n", st->uses_16_bit_hash_slots);
+		printf("16 bit: %i\n", uses_16_bit_hash_slots(st));
+
+		probe_performance();
+		batch_performance();
+		freeze_performance();
+		compress_performance();
+		build_performance();
+		growing_performance();
+		wide_performance();
+		hash_performance();
 	}
 
-#endif
\ No newline at end of file
+#endif